@@ -1,10 +1,10 @@
 DEBUG ?= 1
 
 CC	 = gcc
-CFLAGS   = -std=gnu17 -Wall -Wextra -Wno-unused #-fsanitize=address
+CFLAGS   = -std=gnu17 -Wall -Wextra -Wno-unused -pthread #-fsanitize=address
 
 CXX	 = g++
-CXXFLAGS = -std=gnu++20 -Wall -Wextra -Wno-unused #-fsanitize=address
+CXXFLAGS = -std=gnu++20 -Wall -Wextra -Wno-unused -pthread #-fsanitize=address
 
 AR	 = ar
 ARFLAGS  = -rcs
@@ -12,14 +12,16 @@ ARFLAGS  = -rcs
 LIBS	 = fuse3
 CFLAGS  += $(foreach lib,${LIBS},$(shell pkg-config --cflags ${lib}))
 CFLAGS  += -DFUSE_USE_VERSION=31
+LDFLAGS += -pthread
 LDFLAGS += $(foreach lib,${LIBS},$(shell pkg-config --libs ${lib}))
 EXE_NAME = cofs
 
-LAYER0   = layer0.o cofs_errno.o
+LAYER0   = layer0.o layer0_mmap.o layer0_pio.o layer0_uring.o layer0_writeback.o layer0_snapshot.o layer0_cache.o \
+	   cofs_errno.o
 
-LAYER1	 = ${LAYER0} free_list.o superblock.o cofs_inode_functions.o
+LAYER1	 = ${LAYER0} free_list.o free_bitmap.o superblock.o cofs_inode_functions.o
 
-LAYER2	 = ${LAYER1} cofs_mkfs.o layer2.o cofs_datablocks.o cofs_files.o gnu_basename.o cofs_directories.o
+LAYER2	 = ${LAYER1} cofs_mkfs.o layer2.o cofs_datablocks.o cofs_files.o gnu_basename.o cofs_directories.o cofs_dcache.o
 
 LAYER3	 = ${LAYER2} cofs_syscalls.o
 
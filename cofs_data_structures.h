@@ -201,6 +201,12 @@ typedef struct cofs_inode_s {
 _Static_assert(sizeof(cofs_inode) == INODE_SIZE,
                 "inode type too large! update `INODE_SIZE` or make it smaller!");
 
+/* How free data blocks are tracked on disk; chosen at mkfs time */
+enum {
+        COFS_ALLOC_FREELIST = 0,        /* chain of free list blocks (free_list.h) */
+        COFS_ALLOC_BITMAP,              /* free-space bitmap after the ilist (free_bitmap.h) */
+};
+
 typedef struct {
         size_t          ilist_size;      /* # of blocks in ilist */
         size_t          n_blocks;        /* total # blocks in partition */
@@ -214,6 +220,12 @@ typedef struct {
          */
         size_t          free_blocks;
         size_t          free_inodes;
+
+        /* added later, so that filesystems made without them read as zeroes */
+        size_t          allocator;       /* COFS_ALLOC_* */
+        size_t          bmap_start;      /* first block of the free-space bitmap */
+        size_t          bmap_blocks;     /* # of blocks in the bitmap (0 with a free list) */
+        size_t          flist_tail;      /* last free list block, 0 if not known yet */
 } __attribute__((aligned(COFS_BLOCK_SIZE))) cofs_superblock;
 
 _Static_assert(sizeof(cofs_superblock) == COFS_BLOCK_SIZE);
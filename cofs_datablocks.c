@@ -5,17 +5,20 @@
 #include "cofs_datablocks.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
-#include <sys/mman.h>
 
 #include "layer0.h"
 #include "cofs_data_structures.h"
 #include "free_list.h"
 #include "cofs_inode_functions.h"
 #include "cofs_errno.h"
+#include "cofs_util.h"
+
+// number of indirect blocks fetched per batched read while walking an inode
+#define INDIRECT_WINDOW         16U
 
 // iterate over all levels of data blocks in an inode and call func() on each one
-// you could definitely do this recursively in much less repetitive code but I can't be bothered
 bool
 foreach_datablock_in_inode(cofs_inode *inode, datablock_foreach func, size_t start_block, bool stop_on_false,
                            void *other)
@@ -25,7 +28,7 @@ foreach_datablock_in_inode(cofs_inode *inode, datablock_foreach func, size_t sta
 
         size_t curr_block = 0;
         /* direct blocks */
-        bool foreach_direct_block(block_reference *dir_blocks, size_t len)
+        bool foreach_direct_block(const block_reference *dir_blocks, size_t len)
         {
                 bool ret = true;
                 for (size_t b = 0; b < len; b++) {
@@ -43,118 +46,134 @@ foreach_datablock_in_inode(cofs_inode *inode, datablock_foreach func, size_t sta
                 return ret;
         }
 
-        /* single indirect blocks */
-        bool foreach_1indirect_block(block_reference *indir_blocks, size_t len)
+        /* indirect blocks `depth` levels above the data blocks. Up to INDIRECT_WINDOW
+         * sibling indirect blocks are fetched from the buffer cache at once (anything
+         * not resident comes in with one batched read), and subtrees that lie
+         * entirely before `start_block` are skipped without being read at all.
+         */
+        bool foreach_indirect_block(const block_reference *indir_blocks, size_t len, int depth)
         {
-                // LMAO for some reason calloc() segfaults *inside* glibc here? not so when using mmap()?
-//                block_reference *blockbuf = calloc(N_DIRECT_BLOCKS, sizeof(block_reference));
-                block_reference *blockbuf = mmap(NULL, N_DIRECT_BLOCKS * sizeof(block_reference), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-                if (blockbuf == MAP_FAILED)
-                        COFS_ERROR(ENOMEM);
-
-                bool ret = true;
-                for (size_t b = 0; b < len; b++) {
-                        block_reference block = indir_blocks[b];
-                        if (block == 0)
-                                goto finish_1indir;
+                if (len == 0 || indir_blocks[0] == 0)
+                        return true;
 
-                        layer0_readBlock(block, blockbuf);
-                        ret = foreach_direct_block(blockbuf, BLOCKS_PER_INDIRECT)
-                                && ret;
+                // number of data blocks reachable through each entry of indir_blocks
+                size_t span = 1;
+                for (int d = 0; d < depth; d++)
+                        span *= BLOCKS_PER_INDIRECT;
 
-                        if (stop_on_false && !ret) {
-                                ret = false;
-                                goto finish_1indir;
+                bool ret = true;
+                size_t b = 0;
+                while (b < len && indir_blocks[b] != 0) {
+                        if (curr_block + span <= start_block) {
+                                curr_block += span;
+                                ++b;
+                                continue;
                         }
-                }
-
-        finish_1indir:
-//                free(blockbuf);
-                munmap(blockbuf, N_DIRECT_BLOCKS * sizeof(block_reference));
-                return ret;
-        }
-
-        /* double indirect blocks */
-        bool foreach_2indirect_block(block_reference *indir2_blocks, size_t len)
-        {
-//                block_reference *blockbuf = calloc(N_1INDIRECT_BLOCKS, sizeof(block_reference));
-                block_reference *blockbuf = mmap(NULL, N_1INDIRECT_BLOCKS * sizeof(block_reference), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-                if (blockbuf == MAP_FAILED)
-                        COFS_ERROR(ENOMEM);
 
-                bool ret = true;
-                for (size_t b = 0; b < len; b++) {
-                        block_reference block = indir2_blocks[b];
-                        if (block == 0)
-                                goto finish_2indir;
+                        layer0_buffer *bufs[INDIRECT_WINDOW];
+                        size_t n = 0;
+                        while (n < INDIRECT_WINDOW && b + n < len && indir_blocks[b + n] != 0)
+                                ++n;
 
-                        layer0_readBlock(block, blockbuf);
-                        ret = foreach_1indirect_block(blockbuf, BLOCKS_PER_INDIRECT)
-                                && ret;
+                        if (layer0_getBuffers(indir_blocks + b, bufs, n) == -1)
+                                return false;
 
-                        if (stop_on_false && !ret) {
-                                ret = false;
-                                goto finish_2indir;
+                        bool stop = false;
+                        for (size_t i = 0; i < n && !stop; i++) {
+                                const block_reference *children = bufs[i]->data;
+                                ret = (depth == 1 ? foreach_direct_block(children, BLOCKS_PER_INDIRECT)
+                                                  : foreach_indirect_block(children, BLOCKS_PER_INDIRECT, depth - 1))
+                                        && ret;
+                                stop = stop_on_false && !ret;
                         }
-                }
 
-        finish_2indir:
-//                free(blockbuf);
-                munmap(blockbuf, N_1INDIRECT_BLOCKS * sizeof(block_reference));
-                return ret;
-        }
-
-         /* triple indirect blocks */
-        bool foreach_3indirect_block(block_reference *indir3_blocks, size_t len)
-        {
-//                block_reference *blockbuf = calloc(N_2INDIRECT_BLOCKS, sizeof(block_reference));
-                block_reference *blockbuf = mmap(NULL, N_2INDIRECT_BLOCKS * sizeof(block_reference), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-                if (blockbuf == MAP_FAILED)
-                        COFS_ERROR(ENOMEM);
-
-                bool ret = true;
-                for (size_t b = 0; b < len; b++) {
-                        block_reference block = indir3_blocks[b];
-                        if (block == 0)
-                                goto finish_3indir;
+                        for (size_t i = 0; i < n; i++)
+                                layer0_putBuffer(bufs[i]);
 
-                        layer0_readBlock(block, blockbuf);
-                        ret = foreach_2indirect_block(blockbuf, BLOCKS_PER_INDIRECT)
-                                && ret;
+                        if (stop)
+                                break;
 
-                        if (stop_on_false && !ret) {
-                                ret = false;
-                                goto finish_3indir;
-                        }
+                        b += n;
                 }
 
-        finish_3indir:
-//                free(blockbuf);
-                munmap(blockbuf, N_2INDIRECT_BLOCKS * sizeof(block_reference));
                 return ret;
         }
 
         if (inode->type != INODE_TYPE_SYML) {
                 cofs_file_inode *datablocks = &inode->file;
                 return (foreach_direct_block(datablocks->direct_blocks, N_DIRECT_BLOCKS) || !stop_on_false)
-                       && (foreach_1indirect_block(datablocks->single_indirect_blocks, N_1INDIRECT_BLOCKS)
+                       && (foreach_indirect_block(datablocks->single_indirect_blocks, N_1INDIRECT_BLOCKS, 1)
                            || !stop_on_false)
-                       && (foreach_2indirect_block(datablocks->double_indirect_blocks, N_2INDIRECT_BLOCKS)
+                       && (foreach_indirect_block(datablocks->double_indirect_blocks, N_2INDIRECT_BLOCKS, 2)
                            || !stop_on_false)
-                       && (foreach_3indirect_block(datablocks->triple_indirect_blocks, N_3INDIRECT_BLOCKS)
+                       && (foreach_indirect_block(datablocks->triple_indirect_blocks, N_3INDIRECT_BLOCKS, 3)
                            || !stop_on_false);
         } else {
                 return foreach_direct_block(inode->syml.direct, N_DIRECT_BLOCKS);
         }
 }
 
-static block_reference direct_alloc_block_val = 0;
+/* The allocation state below is per thread, so writers in different threads
+ * each work from their own batch and goal.
+ */
+static __thread block_reference direct_alloc_block_val = 0;
+
+/* blocks claimed together by alloc_new_datablocks(), handed out in order to
+ * the data and indirect blocks it adds; writes too short for a batch, and the
+ * single blocks taken outside one, come from the thread's magazine instead
+ */
+#define ALLOC_BATCH     1024U
+#define ALLOC_BATCH_MIN 64U
+static __thread block_reference alloc_batch[ALLOC_BATCH];
+static __thread size_t batch_next = 0, batch_len = 0;
+
+// where the next block should come from, just past the last one handed out
+static __thread block_reference alloc_goal = 0;
+
+/* hands `count` blocks back to the free list in one batch, stepping past any
+ * it refuses (already free, or its write failed) so the rest still go back
+ */
+static void __give_back(const block_reference blocks[], size_t count)
+{
+        for (size_t done = 0; done < count; done++) {
+                done += FreeList_appendMany(blocks + done, count - done);
+                if (done < count)
+                        PRINT_ERR("datablocks: cannot free block %zu\n", blocks[done]);
+        }
+}
+
+static block_reference __next_block(void)
+{
+        block_reference block;
+        if (batch_next < batch_len)
+                block = alloc_batch[batch_next++];
+        else
+                block = FreeList_popLocal(alloc_goal);
+
+        if (block != 0)
+                alloc_goal = block + 1;
+
+        return block;
+}
+
+/* allocated blocks aren't zeroed on disk, so a new indirect block starts out
+ * as a buffer that is cleared in the cache instead of being read in
+ */
+static layer0_buffer *__claim_zeroed(block_reference blk)
+{
+        layer0_buffer *buf = layer0_claimBuffer(blk);
+        if (buf != NULL)
+                memset(buf->data, 0, COFS_BLOCK_SIZE);
+
+        return buf;
+}
+
 /* Again like the foreach, these 4 can definitely be combined into one function,
  * but I don't want to risk getting it wrong
  */
 static bool __alloc_direct(block_reference *blocks, size_t size)
 {
-        block_reference block = FreeList_pop();
+        block_reference block = __next_block();
         if (block == 0)
                 return false;
 
@@ -167,7 +186,7 @@ static bool __alloc_direct(block_reference *blocks, size_t size)
         }
 
         // de-allocate the unused direct block
-        FreeList_append(block);
+        FreeList_appendLocal(block);
         return false;
 }
 
@@ -182,16 +201,14 @@ static bool __alloc_1indirect(block_reference *blocks, size_t size, size_t my_bl
 
         block_reference target_indirect;
 
-        block_reference *indblock = calloc(BLOCKS_PER_INDIRECT, sizeof(block_reference));
-        if (indblock == NULL)
-                return false;
+        layer0_buffer *indblock = NULL;
 
         bool cleanup_newblock = false;
 
         // determine if we need to allocate a whole new indirect block or just another direct inside of our indirect
         if (my_blocks % BLOCKS_PER_INDIRECT == 0) {
                 // allocate new indirect block
-                target_indirect = FreeList_pop();
+                target_indirect = __next_block();
                 if (target_indirect == 0)
                         goto cleanup;
 
@@ -201,20 +218,22 @@ static bool __alloc_1indirect(block_reference *blocks, size_t size, size_t my_bl
                 // allocate new direct inside the partially filled indirect
                 assert(first_unused != 0);
                 target_indirect = blocks[first_unused - 1];
-                if (layer0_readBlock(target_indirect, indblock) == -1)
-                        goto cleanup;
         }
 
-        ret = __alloc_direct(indblock, BLOCKS_PER_INDIRECT)
-                && (layer0_writeBlock(target_indirect, indblock) == 0);
+        indblock = cleanup_newblock ? __claim_zeroed(target_indirect) : layer0_getBuffer(target_indirect);
+        if (indblock == NULL)
+                goto cleanup;
+
+        ret = __alloc_direct(indblock->data, BLOCKS_PER_INDIRECT)
+                && (layer0_writeBuffer(indblock) == 0);
 
 cleanup:
-        free(indblock);
+        layer0_putBuffer(indblock);
 
         // de-allocate the empty indirect block if we failed in the lower level
         if (!ret && cleanup_newblock) {
                 blocks[first_unused] = 0;
-                FreeList_append(target_indirect);
+                FreeList_appendLocal(target_indirect);
         }
 
         return ret;
@@ -232,16 +251,14 @@ static bool __alloc_2indirect(block_reference *blocks, size_t size, size_t my_bl
         block_reference target_indirect;
         size_t spare_blocks = 0;
 
-        block_reference *indblock = calloc(BLOCKS_PER_INDIRECT, sizeof(block_reference));
-        if (indblock == NULL)
-                return false;
+        layer0_buffer *indblock = NULL;
 
         bool cleanup_newblock = false;
 
         // determine if we need to allocate a whole new indirect block or just another direct inside of our indirect
         if (my_blocks % (BLOCKS_PER_INDIRECT * BLOCKS_PER_INDIRECT) == 0) {
                 // allocate new indirect block
-                target_indirect = FreeList_pop();
+                target_indirect = __next_block();
                 if (target_indirect == 0)
                         goto cleanup;
 
@@ -251,23 +268,24 @@ static bool __alloc_2indirect(block_reference *blocks, size_t size, size_t my_bl
                 // allocate new direct inside the partially filled indirect
                 assert(first_unused != 0);
                 target_indirect = blocks[first_unused - 1];
-                if (layer0_readBlock(target_indirect, indblock) == -1)
-                        goto cleanup;
-
                 // number of direct blocks belonging only to the final partially full double-indirect block
                 spare_blocks = my_blocks % (first_unused * BLOCKS_PER_INDIRECT);
         }
 
-        ret = __alloc_1indirect(indblock, BLOCKS_PER_INDIRECT, spare_blocks)
-                && (layer0_writeBlock(target_indirect, indblock) == 0);
+        indblock = cleanup_newblock ? __claim_zeroed(target_indirect) : layer0_getBuffer(target_indirect);
+        if (indblock == NULL)
+                goto cleanup;
+
+        ret = __alloc_1indirect(indblock->data, BLOCKS_PER_INDIRECT, spare_blocks)
+                && (layer0_writeBuffer(indblock) == 0);
 
 cleanup:
-        free(indblock);
+        layer0_putBuffer(indblock);
 
         // de-allocate the empty indirect block if we failed in the lower levels
         if (!ret && cleanup_newblock) {
                 blocks[first_unused] = 0;
-                FreeList_append(target_indirect);
+                FreeList_appendLocal(target_indirect);
         }
 
         return ret;
@@ -285,16 +303,14 @@ static bool __alloc_3indirect(block_reference *blocks, size_t size, size_t my_bl
         block_reference target_indirect;
         size_t spare_blocks = 0;
 
-        block_reference *indblock = calloc(BLOCKS_PER_INDIRECT, sizeof(block_reference));
-        if (indblock == NULL)
-                return false;
+        layer0_buffer *indblock = NULL;
 
         bool cleanup_newblock = false;
 
         // determine if we need to allocate a whole new indirect block or just another direct inside of our indirect
         if (my_blocks % (BLOCKS_PER_INDIRECT * BLOCKS_PER_INDIRECT * BLOCKS_PER_INDIRECT) == 0) {
                 // allocate new indirect block
-                target_indirect = FreeList_pop();
+                target_indirect = __next_block();
                 if (target_indirect == 0)
                         goto cleanup;
 
@@ -304,29 +320,31 @@ static bool __alloc_3indirect(block_reference *blocks, size_t size, size_t my_bl
                 // allocate new direct inside the partially filled indirect
                 assert(first_unused != 0);
                 target_indirect = blocks[first_unused - 1];
-                if (layer0_readBlock(target_indirect, indblock) == -1)
-                        goto cleanup;
-
                 // number of direct blocks belonging only to the final partially full double-indirect block
                 spare_blocks = my_blocks % (first_unused * (BLOCKS_PER_INDIRECT * BLOCKS_PER_INDIRECT));
         }
 
-        ret = __alloc_2indirect(indblock, BLOCKS_PER_INDIRECT, spare_blocks)
-                && (layer0_writeBlock(target_indirect, indblock) == 0);
+        indblock = cleanup_newblock ? __claim_zeroed(target_indirect) : layer0_getBuffer(target_indirect);
+        if (indblock == NULL)
+                goto cleanup;
+
+        ret = __alloc_2indirect(indblock->data, BLOCKS_PER_INDIRECT, spare_blocks)
+                && (layer0_writeBuffer(indblock) == 0);
 
 cleanup:
-        free(indblock);
+        layer0_putBuffer(indblock);
 
         // de-allocate the empty indirect block if we failed in the lower levels
         if (!ret && cleanup_newblock) {
                 blocks[first_unused] = 0;
-                FreeList_append(target_indirect);
+                FreeList_appendLocal(target_indirect);
         }
 
         return ret;
 }
 
-block_reference alloc_new_datablock(cofs_inode *inode)
+// adds one data block (and any indirect blocks it needs) to the end of `inode`
+static bool __alloc_one(cofs_inode *inode)
 {
         static const size_t BLOCKS_IN_1INDIRECT =
                 N_1INDIRECT_BLOCKS * BLOCKS_PER_INDIRECT;
@@ -355,8 +373,13 @@ block_reference alloc_new_datablock(cofs_inode *inode)
                 inode->n_blocks++;
         }
 
+        return ret;
+}
+
+block_reference alloc_new_datablock(cofs_inode *inode)
+{
         // note: could defer the write_inode() to the caller? not sure if there's any benefit either way
-        if (ret && write_inode(inode, inode->inum))
+        if (__alloc_one(inode) && write_inode(inode, inode->inum))
                 return direct_alloc_block_val;
 
         return 0;
@@ -368,6 +391,37 @@ static bool __getLastDatablock_Iterator(block_reference block, void *block_outpt
         return true;
 }
 
+size_t alloc_new_datablocks(cofs_inode *inode, size_t count)
+{
+        // carry on from the end of the file, where the blocks will be read from next
+        alloc_goal = 0;
+        if (inode->n_blocks > 0
+            && foreach_datablock_in_inode(inode, &__getLastDatablock_Iterator, inode->n_blocks - 1, false, &alloc_goal))
+        {
+                ++alloc_goal;
+        }
+
+        size_t done;
+        for (done = 0; done < count; done++) {
+                if (batch_next == batch_len && count - done >= ALLOC_BATCH_MIN) {
+                        size_t want = count - done < ALLOC_BATCH ? count - done : ALLOC_BATCH;
+                        batch_next = 0;
+                        batch_len = FreeList_popMany(alloc_goal, alloc_batch, want);
+                }
+                if (!__alloc_one(inode))
+                        break;
+        }
+
+        // indirect blocks come out of the batch too, so it can fall short, but never over
+        __give_back(alloc_batch + batch_next, batch_len - batch_next);
+        batch_next = batch_len = 0;
+
+        if (done > 0 && !write_inode(inode, inode->inum))
+                return 0;
+
+        return done;
+}
+
 // finds the block number of the last datablock belonging to an inode
 block_reference get_last_datablock(cofs_inode *inode)
 {
@@ -379,11 +433,47 @@ block_reference get_last_datablock(cofs_inode *inode)
         return result;
 }
 
-static bool release_datablocks_indr(block_reference *blocks, int depth, size_t start, size_t *pos) {
+/* blocks freed by release_datablocks(), handed back to the free list in
+ * batches so it isn't rewritten once per block
+ */
+#define RELEASE_BATCH   1024U
+static __thread block_reference release_batch[RELEASE_BATCH];
+static __thread size_t n_released = 0;
+
+static void __flush_released(void)
+{
+        __give_back(release_batch, n_released);
+        n_released = 0;
+}
+
+static void __release(block_reference blk)
+{
+        release_batch[n_released++] = blk;
+        if (n_released == RELEASE_BATCH)
+                __flush_released();
+}
+
+// releases the data blocks under the indirect block `blk`; true if `blk` itself can go too
+static bool release_datablocks_indr(const block_reference *blocks, int depth, size_t start, size_t *pos);
+
+static bool __release_indirect_block(block_reference blk, int depth, size_t start, size_t *pos)
+{
+        layer0_buffer *indblock = layer0_getBuffer(blk);
+        if (indblock == NULL)
+                return false;
+
+        bool released = release_datablocks_indr(indblock->data, depth, start, pos);
+        layer0_putBuffer(indblock);
+        if (released)
+                __release(blk);
+
+        return released;
+}
+
+static bool release_datablocks_indr(const block_reference *blocks, int depth, size_t start, size_t *pos) {
         size_t idx;
         block_reference cur_block;
         int next_depth = depth - 1;
-        block_reference *blockbuf = calloc(BLOCKS_PER_INDIRECT, sizeof(block_reference));
         // The current indirect block should only be released if the first address in it is released
         bool first_released = (*pos >= start);
         for (idx = 0; idx < BLOCKS_PER_INDIRECT; ++idx) {
@@ -392,18 +482,14 @@ static bool release_datablocks_indr(block_reference *blocks, int depth, size_t s
                         break; // we can break here because doesn't support holes in files
                 if (next_depth > 0) {
                         // Looking at indirect block addresses
-                        layer0_readBlock(cur_block, blockbuf);
-                        if (release_datablocks_indr(blockbuf, next_depth, start, pos)) {
-                                FreeList_append(cur_block);
-                        }
+                        __release_indirect_block(cur_block, next_depth, start, pos);
                 } else  {
                         if (*pos >= start) {
-                                FreeList_append(cur_block);
+                                __release(cur_block);
                         }
                         ++(*pos);
                 }
         }
-        free(blockbuf);
         return first_released;
 }
 
@@ -418,12 +504,10 @@ bool release_datablocks(cofs_inode *inode, size_t start)
                 if (cur_block == 0)
                         break;
                 if (pos++ >= start) {
-                        FreeList_append(cur_block);
+                        __release(cur_block);
                         inode->file.direct_blocks[idx] = 0;
                 }
         }
-        // Allocate indirect block buffer once, shared among all recursive calls
-        block_reference *blockbuf = calloc(BLOCKS_PER_INDIRECT, sizeof(block_reference));
         // Clear single indirect blocks following pos
         for (idx = 0; idx < N_1INDIRECT_BLOCKS; ++idx) {
                 cur_block = inode->file.single_indirect_blocks[idx];
@@ -431,32 +515,23 @@ bool release_datablocks(cofs_inode *inode, size_t start)
                 if (cur_block == 0)
                         break;
 
-                layer0_readBlock(cur_block, blockbuf);
                 // T only when all addrs at cur_block have been released
-                if (release_datablocks_indr(blockbuf, 1, start, &pos)) {
-                        FreeList_append(cur_block);
+                if (__release_indirect_block(cur_block, 1, start, &pos))
                         inode->file.single_indirect_blocks[idx] = 0;
-                }
         }
         // Only 1 double indirect block per inode
         cur_block = inode->file.double_indirect_blocks[0];
         if (cur_block != 0) {
-                layer0_readBlock(cur_block, blockbuf);
-                if (release_datablocks_indr(blockbuf, 2, start, &pos)) {
-                        FreeList_append(cur_block);
+                if (__release_indirect_block(cur_block, 2, start, &pos))
                         inode->file.double_indirect_blocks[0] = 0;
-                }
                 // Similarly, only 1 triple indirect block per inode
                 cur_block = inode->file.triple_indirect_blocks[0];
                 if (cur_block != 0) {
-                        layer0_readBlock(cur_block, blockbuf);
-                        if (release_datablocks_indr(blockbuf, 3, start, &pos)) {
-                                FreeList_append(cur_block);
+                        if (__release_indirect_block(cur_block, 3, start, &pos))
                                 inode->file.triple_indirect_blocks[0] = 0;
-                        }
                 }
         }
-        free(blockbuf);
+        __flush_released();
         // n_blocks := n_blocks - (n_blocks - start)
         inode->n_blocks = start;
         return true;
@@ -31,6 +31,16 @@ foreach_datablock_in_inode(cofs_inode *inode, datablock_foreach func, size_t sta
  */
 block_reference alloc_new_datablock(cofs_inode *inode);
 
+/**
+ * Adds `count` data blocks to the end of an inode, taking them from the
+ * calling thread's magazine (see `FreeList_popLocal()`), which is refilled in
+ * as few contiguous runs as it can so the file is laid out in order on disk
+ * @param inode the inode to assign the data blocks
+ * @param count the number of data blocks wanted
+ * @return the number of data blocks added, fewer than `count` if the FS ran out of space
+ */
+size_t alloc_new_datablocks(cofs_inode *inode, size_t count);
+
 /**
  * Gets the block number of the last data block in a file
  * @param inode inode of the file
@@ -39,7 +49,8 @@ block_reference alloc_new_datablock(cofs_inode *inode);
 block_reference get_last_datablock(cofs_inode *inode);
 
 /**
- * Puts all of the data blocks after `start` belonging to an inode back onto the freelist
+ * Puts all of the data blocks after `start` belonging to an inode back onto the freelist,
+ * by way of the calling thread's magazine (see `FreeList_appendLocal()`)
  * @param inode  The inode owning the datablocks
  * @param start  The offset within the inode after which to free blocks. A value of 0 frees all of them
  * @return `true` on success, else `false`
@@ -0,0 +1,148 @@
+/* cofs_dcache.c - COFS directory entry cache
+ *
+ * Maps (directory inode, name) to the inode the entry refers to, so resolving
+ * a path that was resolved before costs one hash lookup per component instead
+ * of a scan through each directory's blocks. The cache only ever learns names
+ * from `Dir_lookup()` and `Dir_addEntry()`, and `Dir_removeEntry()` marks
+ * them absent again, so it never disagrees with the directories themselves.
+ * Renames are a remove plus an add, and invalidate through those.
+ *
+ * Names that were looked up and not found are cached too, as negative entries
+ * pointing at INODE_MISSING, so repeatedly probing for files that don't exist
+ * (include paths, $PATH searches) doesn't rescan the directory every time.
+ * Adding the name to the directory overwrites its negative entry.
+ *
+ * The least recently used entries are dropped once DCACHE_MAX_ENTRIES are held.
+ */
+
+#include "cofs_dcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DCACHE_BUCKETS          4096
+#define DCACHE_MAX_ENTRIES      16384
+
+struct dentry {
+        struct dentry *hash_next;
+        struct dentry *lru_prev, *lru_next;     /* most recently used at the head */
+        inode_reference dir, inum;
+        uint64_t hash;
+        char name[];
+};
+
+static struct dentry *buckets[DCACHE_BUCKETS];
+static struct dentry *lru_head, *lru_tail;
+static size_t n_entries = 0;
+
+static uint64_t __hash(inode_reference dir, const char *name)
+{
+        // FNV-1a over the name, seeded with the directory
+        uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t) dir * 0x9E3779B97F4A7C15ULL);
+        for (const unsigned char *p = (const unsigned char *) name; *p != '\0'; p++) {
+                h ^= *p;
+                h *= 0x100000001b3ULL;
+        }
+
+        return h;
+}
+
+static struct dentry **__find(inode_reference dir, const char *name, uint64_t hash)
+{
+        struct dentry **link = &buckets[hash % DCACHE_BUCKETS];
+        while (*link != NULL) {
+                struct dentry *d = *link;
+                if (d->hash == hash && d->dir == dir && strcmp(d->name, name) == 0)
+                        break;
+                link = &d->hash_next;
+        }
+
+        return link;
+}
+
+static void __lru_unlink(struct dentry *d)
+{
+        if (d->lru_prev != NULL)
+                d->lru_prev->lru_next = d->lru_next;
+        else
+                lru_head = d->lru_next;
+        if (d->lru_next != NULL)
+                d->lru_next->lru_prev = d->lru_prev;
+        else
+                lru_tail = d->lru_prev;
+}
+
+static void __lru_push(struct dentry *d)
+{
+        d->lru_prev = NULL;
+        d->lru_next = lru_head;
+        if (lru_head != NULL)
+                lru_head->lru_prev = d;
+        else
+                lru_tail = d;
+        lru_head = d;
+}
+
+// unlinks the entry at `*link` from the table and frees it
+static void __drop(struct dentry **link)
+{
+        struct dentry *d = *link;
+        *link = d->hash_next;
+        __lru_unlink(d);
+        free(d);
+        --n_entries;
+}
+
+bool Dcache_lookup(inode_reference dir, const char *name, inode_reference *inum)
+{
+        struct dentry *d = *__find(dir, name, __hash(dir, name));
+        if (d == NULL)
+                return false;
+
+        __lru_unlink(d);
+        __lru_push(d);
+        *inum = d->inum;
+        return true;
+}
+
+void Dcache_insert(inode_reference dir, const char *name, inode_reference inum)
+{
+        uint64_t hash = __hash(dir, name);
+        struct dentry **link = __find(dir, name, hash);
+        if (*link != NULL) {
+                (*link)->inum = inum;
+                __lru_unlink(*link);
+                __lru_push(*link);
+                return;
+        }
+
+        size_t len = strlen(name) + 1;
+        struct dentry *d = malloc(sizeof(struct dentry) + len);
+        if (d == NULL)
+                return; // it's only a cache
+
+        memcpy(d->name, name, len);
+        d->dir = dir;
+        d->inum = inum;
+        d->hash = hash;
+        d->hash_next = buckets[hash % DCACHE_BUCKETS];
+        buckets[hash % DCACHE_BUCKETS] = d;
+        __lru_push(d);
+        ++n_entries;
+
+        if (n_entries > DCACHE_MAX_ENTRIES)
+                __drop(__find(lru_tail->dir, lru_tail->name, lru_tail->hash));
+}
+
+void Dcache_purgeDir(inode_reference dir)
+{
+        for (size_t b = 0; b < DCACHE_BUCKETS; b++) {
+                struct dentry **link = &buckets[b];
+                while (*link != NULL) {
+                        if ((*link)->dir == dir)
+                                __drop(link);
+                        else
+                                link = &(*link)->hash_next;
+                }
+        }
+}
@@ -0,0 +1,30 @@
+/* cofs_dcache.h - COFS directory entry cache
+ *
+ */
+
+#pragma once
+
+#include "cofs_data_structures.h"
+
+/**
+ * Looks up `name` in directory `dir` without touching the directory's blocks
+ * @param dir inode number of the directory
+ * @param name name of the entry
+ * @param inum receives the inode the entry refers to on a hit, or
+ *             `INODE_MISSING` if the name is known to be absent from `dir`
+ * @return `true` on a hit, else `false` if the directory has to be searched
+ */
+bool Dcache_lookup(inode_reference dir, const char *name, inode_reference *inum);
+
+/**
+ * Records that `name` in directory `dir` refers to inode `inum`, replacing
+ * whatever was cached for it before. Passing `INODE_MISSING` records a
+ * negative entry, i.e. that `dir` has no entry called `name`.
+ */
+void Dcache_insert(inode_reference dir, const char *name, inode_reference inum);
+
+/**
+ * Forgets every entry cached for directory `dir`. Called when the directory
+ * goes away, so a new directory reusing its inode doesn't inherit its names.
+ */
+void Dcache_purgeDir(inode_reference dir);
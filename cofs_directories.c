@@ -7,6 +7,7 @@
 #include <string.h>
 #include <assert.h>
 
+#include "cofs_dcache.h"
 #include "cofs_inode_functions.h"
 #include "free_list.h"
 #include "layer0.h"
@@ -15,32 +16,37 @@
 #include "cofs_errno.h"
 #include "cofs_util.h"
 
-static cofs_direntry block_cache[DIRENTRIES_PER_BLOCK];
-static block_reference cached_idx = 0;
+struct __getNextUnused_Args {
+    layer0_buffer *buf; // OUTPUT: pinned block holding the free entry
+    cofs_direntry *entry; // OUTPUT
+};
 
-static bool __getNextUnused_Iterator(block_reference blk, void *found_entry)
+static bool __getNextUnused_Iterator(block_reference blk, void *_args)
 {
-        if (layer0_readBlock(blk, block_cache) == -1)
+        struct __getNextUnused_Args *args = _args;
+        layer0_buffer *buf = layer0_getBuffer(blk);
+        if (buf == NULL)
                 return false;
 
-        cached_idx = blk;
-
+        cofs_direntry *entries = buf->data;
         for (size_t entry = 0; entry < DIRENTRIES_PER_BLOCK; entry++) {
-                if (block_cache[entry].base_name[0] == '\0') {
-                        *((cofs_direntry **) found_entry) = &block_cache[entry];
+                if (entries[entry].base_name[0] == '\0') {
+                        args->buf = buf;
+                        args->entry = &entries[entry];
                         return false; // false will stop the iteration
                 }
         }
 
+        layer0_putBuffer(buf);
         return true;
 }
 
-// returns a pointer into the block_cache referencing the next unsused directory entry
-// in the directory dir, else NULL if no more are available
-static cofs_direntry *__get_next_unused(cofs_inode *dir)
+// returns a pointer into a pinned buffer (stored in *buf) referencing the next unused
+// directory entry in the directory dir, else NULL if no more are available
+static cofs_direntry *__get_next_unused(cofs_inode *dir, layer0_buffer **buf)
 {
-        cofs_direntry *found_entry = NULL;
-        if (foreach_datablock_in_inode(dir, &__getNextUnused_Iterator, 0, true, &found_entry)) {
+        struct __getNextUnused_Args args = {NULL, NULL};
+        if (foreach_datablock_in_inode(dir, &__getNextUnused_Iterator, 0, true, &args)) {
                 // not found -- need to allocate new block
                 block_reference block = alloc_new_datablock(dir);
                 if (block == 0)
@@ -48,39 +54,39 @@ static cofs_direntry *__get_next_unused(cofs_inode *dir)
 
                 dir->n_bytes += COFS_BLOCK_SIZE;
 
-                if (layer0_readBlock(block, &block_cache) == -1)
+                // the block comes back with stale contents; clear it in the cache instead of reading it in
+                args.buf = layer0_claimBuffer(block);
+                if (args.buf == NULL)
                         return NULL;
+                memset(args.buf->data, 0, COFS_BLOCK_SIZE);
 
-                // read block into cache and return
-                cached_idx = block;
-                return &block_cache[0];
+                args.entry = args.buf->data;
         }
 
-        return found_entry;
+        *buf = args.buf;
+        return args.entry;
 }
 
-// adds a directory entry without writing it back to disk. BE CAREFUL -- calling this
-// multiple times without flushing to disk can result in some blocks not being written *EVER*
-// if successive entries are not all allocated from the same data block!
-static bool __addEntry_noWriteBack(cofs_inode *dir, const char *name, inode_reference inum)
+bool Dir_addEntry(cofs_inode *dir, const char *name, inode_reference inum)
 {
-        cofs_direntry *new = __get_next_unused(dir);
-        if (new == NULL)
-                return false;
-
         if (strlen(name) + 1 > MAX_FILE_BASENAME)
                 COFS_ERROR(ENAMETOOLONG);
 
+        layer0_buffer *buf;
+        cofs_direntry *new = __get_next_unused(dir, &buf);
+        if (new == NULL)
+                return false;
+
         strcpy(new->base_name, name);
         new->inum = inum;
         ++dir->num_direntries;
-        return true;
-}
 
-bool Dir_addEntry(cofs_inode *dir, const char *name, inode_reference inum)
-{
-        return __addEntry_noWriteBack(dir, name, inum)
-                && (layer0_writeBlock(cached_idx, block_cache) == 0)
+        bool written = layer0_writeBuffer(buf) == 0;
+        layer0_putBuffer(buf);
+        if (written)
+                Dcache_insert(dir->inum, name, inum);
+
+        return written
                 && update_inode_mtime(dir)
                 && update_inode_ctime(dir)
                 && (write_inode(dir, dir->inum));
@@ -97,8 +103,7 @@ bool Dir_create(cofs_inode *dir, cofs_inode *parent)
         dir->type = INODE_TYPE_DIR;
         // safe to use here since we know these will be the 1st two entries in the dir
         if (!Dir_addEntry(dir, ".", dir->inum)
-            || !Dir_addEntry(dir, "..", parent->inum)
-            || (layer0_writeBlock(cached_idx, block_cache) == -1))
+            || !Dir_addEntry(dir, "..", parent->inum))
         {
                 return false;
         }
@@ -123,37 +128,54 @@ static bool __dirLookup_Iterator(block_reference block, void *_args)
         const char *target_name = ((struct __dirLookUpArgs *) _args)->target_name;
         bool remove_entry = ((struct __dirLookUpArgs *) _args)->remove_entry;
 
-        if (layer0_readBlock(block, block_cache) == -1)
+        // search the block in place in the buffer cache
+        layer0_buffer *buf = layer0_getBuffer(block);
+        if (buf == NULL)
                 return false;
 
-        cached_idx = block;
+        cofs_direntry *entries = buf->data;
         for (size_t entry = 0; entry < DIRENTRIES_PER_BLOCK; entry++) {
-                if (strcmp(block_cache[entry].base_name, target_name) == 0) {
-                        ((struct __dirLookUpArgs *) _args)->inum = block_cache[entry].inum;
+                if (strcmp(entries[entry].base_name, target_name) == 0) {
+                        ((struct __dirLookUpArgs *) _args)->inum = entries[entry].inum;
                         if (remove_entry) {
-                                memset(block_cache[entry].base_name, '\0', MAX_FILE_BASENAME);
-                                block_cache[entry].inum = 0;
-                                layer0_writeBlock(block, block_cache);
+                                memset(entries[entry].base_name, '\0', MAX_FILE_BASENAME);
+                                entries[entry].inum = 0;
+                                layer0_writeBuffer(buf);
                         }
+                        layer0_putBuffer(buf);
                         return false; // false will stop the iteration
                 }
 
-                if (--args->entries_to_search == 0)
+                if (--args->entries_to_search == 0) {
+                        layer0_putBuffer(buf);
                         COFS_ERROR(ENOENT);
+                }
         }
 
+        layer0_putBuffer(buf);
         return true;
 }
 
 inode_reference Dir_lookup(cofs_inode *dir, const char *name)
 {
+        inode_reference cached;
+        if (Dcache_lookup(dir->inum, name, &cached)) {
+                if (cached == INODE_MISSING)
+                        cofs_errno = ENOENT;
+                return cached;
+        }
+
         struct __dirLookUpArgs lookup_args = {name, INODE_MISSING, false, dir->num_direntries};
         if (foreach_datablock_in_inode(dir, &__dirLookup_Iterator, 0, true, &lookup_args)) {
                 if (cofs_errno == 0)
                         cofs_errno = ENOENT;
+                // remember the name is absent, so probing for it again doesn't rescan
+                if (cofs_errno == ENOENT)
+                        Dcache_insert(dir->inum, name, INODE_MISSING);
                 return INODE_MISSING;
         }
 
+        Dcache_insert(dir->inum, name, lookup_args.inum);
         return lookup_args.inum;
 }
 
@@ -167,12 +189,17 @@ bool Dir_removeEntry(cofs_inode *dir, const char *name)
                 return false;
         }
 
+        Dcache_insert(dir->inum, name, INODE_MISSING);
         dir->n_bytes -= sizeof(cofs_direntry);
 
         cofs_inode bye;
         if (!read_inode(&bye, lookup_args.inum))
                 return false;
 
+        // the inode may be reused by a new directory, which mustn't see these names
+        if (bye.type == INODE_TYPE_DIR)
+                Dcache_purgeDir(bye.inum);
+
         if (!decrement_inode_refcount(&bye))
                 return false;
 
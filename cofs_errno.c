@@ -4,4 +4,4 @@
 
 #include "cofs_errno.h"
 
-int cofs_errno = 0;
+__thread int cofs_errno = 0;
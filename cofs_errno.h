@@ -6,7 +6,8 @@
 
 #include <errno.h>
 
-extern int cofs_errno;
+// per thread, like errno, so layer 0 can be used from several threads at once
+extern __thread int cofs_errno;
 
 #define COFS_ERROR(errno_val) \
         do {                  \
@@ -4,6 +4,7 @@
 
 #include "cofs_files.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
@@ -13,10 +14,21 @@
 #include "layer0.h"
 #include "cofs_datablocks.h"
 #include "layer2.h"
+#include "superblock.h"
 #include "cofs_errno.h"
 
-static unsigned char cached_block[COFS_BLOCK_SIZE];
-static block_reference cached_idx = 0;
+// smallest read-ahead window, used when a file starts being read sequentially
+#define READAHEAD_MIN           16U
+// number of files whose access pattern we track at once
+#define READAHEAD_SLOTS         16U
+
+/* sequential access detector, one slot per recently read file (hashed by inum) */
+static struct readahead_state {
+    inode_reference inum;
+    size_t next_offset; // where a sequential read would start
+    size_t ra_end;      // first block index we haven't hinted yet
+    size_t window;      // current read-ahead window, in blocks
+} ra_states[READAHEAD_SLOTS];
 
 static inline size_t intdiv_ceil(size_t dividend, size_t divisor)
 {
@@ -31,6 +43,12 @@ struct __fileRead_Args {
     const size_t length;
     size_t bytes_read;
     const size_t file_size;
+    /* whole blocks staged for the vectored read, which land straight in `buf`.
+     * The (at most two) partial blocks at either end of the range are copied
+     * out of a borrowed view of the block instead.
+     */
+    struct layer0_iovec *iov;
+    size_t n_staged;
 };
 
 static bool __fileRead_Iterator(block_reference blk, void *_args)
@@ -43,37 +61,150 @@ static bool __fileRead_Iterator(block_reference blk, void *_args)
         // sanity check
         assert(args->bytes_read <= args->file_size);
 
-        if (layer0_readBlock(blk, cached_block) == -1)
-                return false;
-
         size_t start = 0;
         size_t amnt = COFS_BLOCK_SIZE;
 
         if (args->bytes_read == 0)
                 start = args->first_offset;
-        if (args->length - args->bytes_read < COFS_BLOCK_SIZE)
+        if (amnt > COFS_BLOCK_SIZE - start)
+                amnt = COFS_BLOCK_SIZE - start;
+        if (args->length - args->bytes_read < amnt)
                 amnt = args->length - args->bytes_read;
         if (args->bytes_read + amnt > args->file_size)
                 amnt = args->file_size - args->bytes_read;
 
-        memcpy(args->buf + args->bytes_read, cached_block + start, amnt);
+        if (amnt == 0)
+                return false; // nothing left in the file
+
+        if (amnt == COFS_BLOCK_SIZE) {
+                args->iov[args->n_staged].bnum = blk;
+                args->iov[args->n_staged].buf = args->buf + args->bytes_read;
+                ++args->n_staged;
+        } else {
+                const unsigned char *block = layer0_getBlockPtr(blk);
+                if (block == NULL)
+                        return false;
+
+                memcpy(args->buf + args->bytes_read, block + start, amnt);
+                layer0_putBlockPtr(block);
+        }
 
         args->bytes_read += amnt;
 
         return true;
 }
 
+struct __raCollect_Args {
+    block_reference *bnums;
+    size_t count;
+    const size_t max;
+};
+
+static bool __raCollect_Iterator(block_reference blk, void *_args)
+{
+        struct __raCollect_Args *args = _args;
+        args->bnums[args->count++] = blk;
+        return args->count < args->max;
+}
+
+// hint blocks [first, first + count) of `file`, one request per contiguous run on disk
+static void __readahead_blocks(cofs_inode *file, size_t first, size_t count)
+{
+        struct __raCollect_Args args = {
+                .bnums = calloc(count, sizeof(block_reference)), .max = count,
+        };
+        if (args.bnums == NULL)
+                return;
+
+        // walking the block map also brings in the indirect blocks for this window
+        foreach_datablock_in_inode(file, &__raCollect_Iterator, first, true, &args);
+
+        for (size_t i = 0; i < args.count; ) {
+                size_t run = 1;
+                while (i + run < args.count && args.bnums[i + run] == args.bnums[i] + run)
+                        ++run;
+
+                layer0_readahead(args.bnums[i], run);
+                i += run;
+        }
+
+        free(args.bnums);
+}
+
+/* Detects sequential reads of a file and keeps a read-ahead window of up to
+ * `layer0_opts.readahead_blocks` blocks in front of them. The window starts at
+ * READAHEAD_MIN and doubles on every sequential read; the next batch is hinted
+ * once the reader is halfway through the current one. A seek resets it.
+ */
+static void __readahead(cofs_inode *file, off_t start, size_t length)
+{
+        if (layer0_opts.readahead_blocks == 0)
+                return;
+
+        struct readahead_state *ra = &ra_states[file->inum % READAHEAD_SLOTS];
+        size_t end_block = intdiv_ceil(start + length, COFS_BLOCK_SIZE);
+        size_t file_blocks = intdiv_ceil(file->n_bytes, COFS_BLOCK_SIZE);
+
+        bool sequential = start == 0
+                          || (ra->inum == file->inum && (size_t) start == ra->next_offset);
+        if (start == 0 || !sequential || ra->inum != file->inum) {
+                ra->inum = file->inum;
+                ra->ra_end = end_block;
+                ra->window = READAHEAD_MIN < layer0_opts.readahead_blocks ? READAHEAD_MIN
+                                                                          : layer0_opts.readahead_blocks;
+        }
+        ra->next_offset = start + length;
+
+        if (!sequential || end_block + ra->window / 2 < ra->ra_end)
+                return;
+
+        size_t from = ra->ra_end > end_block ? ra->ra_end : end_block;
+        size_t to = end_block + ra->window;
+        if (to > file_blocks)
+                to = file_blocks;
+
+        if (from < to) {
+                __readahead_blocks(file, from, to - from);
+                ra->ra_end = to;
+        }
+
+        ra->window *= 2;
+        if (ra->window > layer0_opts.readahead_blocks)
+                ra->window = layer0_opts.readahead_blocks;
+}
+
 bool File_readData(cofs_inode *file, char *buf, off_t start, size_t length)
 {
         if (buf == NULL)
                 COFS_ERROR(EFAULT);
 
+        if (length == 0)
+                return true;
+
         // Calculate initial block number and offset within the block
         size_t block_index = start / COFS_BLOCK_SIZE;
         size_t block_offset = start % COFS_BLOCK_SIZE;
+        size_t n_touched = intdiv_ceil(block_offset + length, COFS_BLOCK_SIZE);
+
+        __readahead(file, start, length);
+
+        struct __fileRead_Args args = {
+                .buf = buf, .first_offset = block_offset, .length = length,
+                .file_size = file->n_bytes,
+                .iov = calloc(n_touched, sizeof(struct layer0_iovec)),
+        };
+
+        if (args.iov == NULL) {
+                cofs_errno = ENOMEM;
+        } else {
+                foreach_datablock_in_inode(file, &__fileRead_Iterator, block_index, true, &args);
+
+                // pull every whole block in at once
+                if (cofs_errno == 0)
+                        layer0_readvData(args.iov, args.n_staged);
+        }
 
-        struct __fileRead_Args args = {buf, block_offset, length, 0, file->n_bytes};
-        foreach_datablock_in_inode(file, &__fileRead_Iterator, block_index, true, &args);
+        free(args.iov);
 
         // technically this code is redundant but it's good to have explicitly
         if (args.bytes_read < length && cofs_errno == 0)
@@ -87,7 +218,21 @@ struct __fileWrite_Args {
     size_t first_offset;
     const size_t length;
     size_t bytes_written;
-    const size_t final_size;
+    /* blocks staged for the batched write. Whole blocks are written straight
+     * out of `buf`; the (at most two) partial blocks at either end of the
+     * range are merged with their old contents in `bounce` first.
+     */
+    struct layer0_iovec *iov;
+    size_t n_staged;
+    unsigned char *bounce;
+    /* blocks from `fresh_from` on were only just allocated and still hold
+     * whatever they held when they were freed, so their old contents are never
+     * read: partial writes are merged with zeros, and the blocks of a gap
+     * between the old end of the file and `first_block` are written as zeros.
+     */
+    size_t blk_idx;
+    const size_t first_block;
+    const size_t fresh_from;
 };
 
 static bool __fileWrite_Iterator(block_reference blk, void *_args)
@@ -97,31 +242,43 @@ static bool __fileWrite_Iterator(block_reference blk, void *_args)
         if (args->bytes_written >= args->length)
                 return false; // done writing--stop iteration
 
-       // sanity check
-        assert(args->bytes_written <= args->final_size);
+        bool fresh = args->blk_idx++ >= args->fresh_from;
+        if (args->blk_idx <= args->first_block) {
+                // part of the gap: nothing is being written here, but it must read back as zeros
+                args->iov[args->n_staged].bnum = blk;
+                args->iov[args->n_staged].buf = (void *) ZERO_BLOCK;
+                ++args->n_staged;
+                return true;
+        }
 
         size_t start = 0;
         size_t amt = COFS_BLOCK_SIZE;
 
         if (args->bytes_written == 0)
                 start = args->first_offset;
-        if (args->length - args->bytes_written < COFS_BLOCK_SIZE)
+        if (amt > COFS_BLOCK_SIZE - start)
+                amt = COFS_BLOCK_SIZE - start;
+        if (amt > args->length - args->bytes_written)
                 amt = args->length - args->bytes_written;
-        if (args->length - args->bytes_written > args->final_size)
-                amt = args->final_size - args->bytes_written;
 
-        if (start != 0) {
-                if (layer0_readBlock(blk, cached_block) == -1)
+        const void *src = args->buf + args->bytes_written;
+        if (amt != COFS_BLOCK_SIZE) {
+                // partial block: keep whatever we aren't overwriting
+                unsigned char *block = args->bounce
+                                       + (args->bytes_written == 0 ? 0 : COFS_BLOCK_SIZE);
+                if (fresh)
+                        memset(block, 0, COFS_BLOCK_SIZE);
+                else if (layer0_readBlock(blk, block) == -1)
                         return false;
-        } else {
-                memset(cached_block, 0, COFS_BLOCK_SIZE);
-        }
-
-        memcpy(cached_block + start, args->buf + args->bytes_written, amt);
 
+                memcpy(block + start, src, amt);
+                src = block;
+        }
 
-        if (layer0_writeBlock(blk, cached_block) == -1)
-                return false;
+        // layer0_writevData() only reads from the buffers, so dropping const is safe
+        args->iov[args->n_staged].bnum = blk;
+        args->iov[args->n_staged].buf = (void *) src;
+        ++args->n_staged;
 
         args->bytes_written += amt;
 
@@ -133,24 +290,52 @@ bool File_writeData(cofs_inode *file, const char *buf, off_t start, size_t lengt
         if (buf == NULL)
                 COFS_ERROR(EFAULT);
 
+        if (length == 0)
+                return true;
+
         // Calculate initial block number and offset within the block
         size_t block_index = start / COFS_BLOCK_SIZE;
         size_t block_offset = start % COFS_BLOCK_SIZE;
+        size_t n_touched = intdiv_ceil(block_offset + length, COFS_BLOCK_SIZE);
 
-        // calculate ending file size if the write succeeds
-        size_t initial_size = file->n_bytes;
+        // calculate ending file size if the write succeeds, and claim all the blocks it needs at once
         size_t final_size = start + length;
-        while (file->n_blocks < intdiv_ceil(final_size, COFS_BLOCK_SIZE))
-                alloc_new_datablock(file);
+        size_t final_blocks = intdiv_ceil(final_size, COFS_BLOCK_SIZE);
+        size_t fresh_from = file->n_blocks;
+        if (file->n_blocks < final_blocks)
+                alloc_new_datablocks(file, final_blocks - file->n_blocks);
+
+        // a write past the end of the file also covers the new blocks before it
+        size_t first_visited = block_index < fresh_from ? block_index : fresh_from;
+
+        struct __fileWrite_Args args = {
+                .buf = buf, .first_offset = block_offset, .length = length,
+                .iov = calloc(n_touched + block_index - first_visited, sizeof(struct layer0_iovec)),
+                .bounce = aligned_alloc(COFS_BLOCK_SIZE, 2 * COFS_BLOCK_SIZE),
+                .blk_idx = first_visited, .first_block = block_index, .fresh_from = fresh_from,
+        };
+
+        if (args.iov == NULL || args.bounce == NULL) {
+                cofs_errno = ENOMEM;
+        } else {
+                foreach_datablock_in_inode(file, &__fileWrite_Iterator, first_visited, true, &args);
+
+                if (args.bytes_written < length && cofs_errno == 0)
+                        cofs_errno = ENOSPC;
 
-        struct __fileWrite_Args args = {buf, block_offset, length, 0, final_size};
-        foreach_datablock_in_inode(file, &__fileWrite_Iterator, block_index, true, &args);
+                // push every staged block out at once, unless staging them failed part way
+                if (cofs_errno != 0 || layer0_writevData(args.iov, args.n_staged) == -1)
+                        args.bytes_written = 0;
+        }
+
+        free(args.iov);
+        free(args.bounce);
 
         // don't grow the file if the write didn't fully complete
         if (cofs_errno != 0 && file->n_bytes < final_size)
                 release_datablocks(file, intdiv_ceil(file->n_bytes, COFS_BLOCK_SIZE));
-        else
-                file->n_bytes += args.bytes_written;
+        else if (start + args.bytes_written > file->n_bytes)
+                file->n_bytes = start + args.bytes_written;
 
         return cofs_errno == 0;
-}
\ No newline at end of file
+}
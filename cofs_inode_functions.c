@@ -5,97 +5,495 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "cofs_inode_functions.h"
 #include "layer0.h"
 #include "superblock.h"
 #include "cofs_errno.h"
 #include "layer2.h"
+#include "cofs_util.h"
 
 #define ILIST_START_BLOCK       (1UL)
 
-static cofs_inode inode_cache[INODES_PER_BLOCK];
-static block_reference cached_inode_block = 0;
+// most unreferenced inodes kept in core; past this the least recently used is dropped
+#define ITABLE_MAX_UNREFERENCED 1024
+#define ITABLE_BUCKETS          1024
+
+// inodes summarised by each free count in `imap_group_free`
+#define IMAP_GROUP_INODES       4096
+#define IMAP_WORD_BITS          64
+#define IMAP_GROUP_WORDS        (IMAP_GROUP_INODES / IMAP_WORD_BITS)
+
+/* Free-inode bitmap, one bit per ilist slot (set while the inode is free),
+ * with a count of free inodes per group of IMAP_GROUP_INODES. It is built
+ * from the ilist at mount, so allocating an inode never has to read ilist
+ * blocks just to find a free slot.
+ */
+static uint64_t *imap = NULL;
+static size_t *imap_group_free = NULL;
+static size_t imap_inodes = 0;
+static size_t imap_groups = 0;
+// group the last inode was allocated from; it is checked first next time
+static size_t imap_hint = 0;
+
+/* An inode held in core by the inode table (see `iget()`). Referenced inodes
+ * are never dropped; once the last reference is put back an inode stays
+ * around on an LRU list so reopening it is free, and is written back (if it
+ * is dirty) when it falls off the end.
+ */
+struct incore_inode {
+    cofs_inode inode;                           /* what callers see; must come first */
+    struct incore_inode *hash_next;
+    struct incore_inode *lru_prev, *lru_next;   /* on the LRU while `refs` is 0 */
+    unsigned refs;
+    bool dirty;                                 /* newer than the copy in the ilist */
+    bool time_dirty;                            /* only its timestamps are newer (lazytime) */
+};
+
+static struct incore_inode *itable[ITABLE_BUCKETS];
+static struct incore_inode *lru_head, *lru_tail;
+static size_t n_unreferenced = 0;
+static size_t n_dirty = 0;
+static size_t n_time_dirty = 0;
+// when dirty inodes were last written back, for the `interval' writeback policy
+static struct timespec last_sync;
+
+static inline void __imap_set(inode_reference inum)
+{
+    uint64_t bit = 1ULL << (inum % IMAP_WORD_BITS);
+    if (!(imap[inum / IMAP_WORD_BITS] & bit)) {
+        imap[inum / IMAP_WORD_BITS] |= bit;
+        ++imap_group_free[inum / IMAP_GROUP_INODES];
+    }
+}
+
+static inline void __imap_clear(inode_reference inum)
+{
+    uint64_t bit = 1ULL << (inum % IMAP_WORD_BITS);
+    if (imap[inum / IMAP_WORD_BITS] & bit) {
+        imap[inum / IMAP_WORD_BITS] &= ~bit;
+        --imap_group_free[inum / IMAP_GROUP_INODES];
+    }
+}
+
+// (re)allocates the bitmap for `n_inodes` inodes, either all free or all in use
+static bool __imap_reset(size_t n_inodes, bool all_free)
+{
+    size_t n_groups = (n_inodes + IMAP_GROUP_INODES - 1) / IMAP_GROUP_INODES;
+    uint64_t *map = calloc(n_groups * IMAP_GROUP_WORDS, sizeof(uint64_t));
+    size_t *group_free = calloc(n_groups, sizeof(size_t));
+    if (map == NULL || group_free == NULL) {
+        free(map);
+        free(group_free);
+        COFS_ERROR(ENOMEM);
+    }
+
+    free(imap);
+    free(imap_group_free);
+    imap = map;
+    imap_group_free = group_free;
+    imap_inodes = n_inodes;
+    imap_groups = n_groups;
+    imap_hint = 0;
+
+    if (all_free)
+        for (inode_reference inum = 0; inum < n_inodes; inum++)
+            __imap_set(inum);
+
+    return true;
+}
+
+bool ilist_init(void)
+{
+    if (!__imap_reset(sblock_incore.ilist_size * INODES_PER_BLOCK, false))
+        return false;
+
+    for (size_t i = 0; i < sblock_incore.ilist_size; i++) {
+        layer0_buffer *buf = layer0_getBuffer(i + ILIST_START_BLOCK);
+        if (buf == NULL)
+            return false;
+
+        const cofs_inode *inodes = buf->data;
+        for (size_t j = 0; j < INODES_PER_BLOCK; j++)
+            if (!inodes[j].in_use)
+                __imap_set(i * INODES_PER_BLOCK + j);
+
+        layer0_putBuffer(buf);
+    }
+
+    return true;
+}
+
+// builds the bitmap if this filesystem hasn't got one yet
+static bool __imap_ready(void)
+{
+    if (imap != NULL && imap_inodes == sblock_incore.ilist_size * INODES_PER_BLOCK)
+        return true;
+
+    return ilist_init();
+}
 
 bool ilist_create(size_t ilist_size)
 {
-        memset(&inode_cache, 0, sizeof(inode_cache));
+        cofs_inode *iblock;
+        MALIGN_CHECK(iblock, COFS_BLOCK_SIZE);
+        if (iblock == NULL)
+                COFS_ERROR(ENOMEM);
 
+        memset(iblock, 0, COFS_BLOCK_SIZE);
+
+        bool ret = true;
         for (block_reference iblock_num = 0; iblock_num < ilist_size; iblock_num++) {
                 for (size_t i = 0; i < INODES_PER_BLOCK; i++)
-                        inode_cache[i].inum = iblock_num * INODES_PER_BLOCK + i;
+                        iblock[i].inum = iblock_num * INODES_PER_BLOCK + i;
 
                 // add one because the ilist starts at block 1
-                if (layer0_writeBlock(iblock_num + ILIST_START_BLOCK, inode_cache) == -1)
-                        return false;
+                if (layer0_writeBlock(iblock_num + ILIST_START_BLOCK, iblock) == -1) {
+                        ret = false;
+                        break;
+                }
         }
 
-        return true;
+        free(iblock);
+        return ret && __imap_reset(ilist_size * INODES_PER_BLOCK, true);
 }
 
-inode_reference allocate_inode() {
-    // Calculate size of the ilist in blocks and the number of inodes per block
-    size_t ilist_size_in_blocks = sblock_incore.ilist_size;
-
-    // check if our cached block has any free inodes
-    if (cached_inode_block != 0) {
-        for (size_t i = 0; i < INODES_PER_BLOCK; i++)
-            if (!inode_cache[i].in_use) {
-                inode_cache[i].in_use = 1;
-                layer0_writeBlock(cached_inode_block, inode_cache);
-                --sblock_incore.free_inodes;
-                return inode_cache[i].inum;
+// gets the (pinned) ilist block holding inode `index`, and the inode's slot in it
+static layer0_buffer *__get_inode_block(inode_reference index, cofs_inode **slot)
+{
+    // Calculate the block index and inode index within the block
+    size_t block_index = index / INODES_PER_BLOCK + ILIST_START_BLOCK;
+    size_t inode_index_within_block = index % INODES_PER_BLOCK;
+
+    layer0_buffer *buf = layer0_getBuffer(block_index);
+    if (buf != NULL)
+        *slot = (cofs_inode *) buf->data + inode_index_within_block;
+
+    return buf;
+}
+
+// finds a free inode in the bitmap, else returns INODE_MISSING
+static inode_reference __imap_find(void)
+{
+    for (size_t n = 0; n < imap_groups; n++) {
+        size_t group = (imap_hint + n) % imap_groups;
+        if (imap_group_free[group] == 0)
+            continue;
+
+        const uint64_t *words = imap + group * IMAP_GROUP_WORDS;
+        for (size_t w = 0; w < IMAP_GROUP_WORDS; w++) {
+            if (words[w] != 0) {
+                imap_hint = group;
+                return (group * IMAP_GROUP_WORDS + w) * IMAP_WORD_BITS
+                       + __builtin_ffsll((long long) words[w]) - 1;
             }
+        }
     }
 
-    // Loop through ilist blocks
-    for (cached_inode_block = ILIST_START_BLOCK; cached_inode_block <= ilist_size_in_blocks; cached_inode_block++) {
-        // Read the block containing inodes
-        layer0_readBlock(cached_inode_block, inode_cache);
+    return INODE_MISSING;
+}
 
-        // Loop through inodes in the block
-        for (inode_reference inode_index = 0; inode_index < INODES_PER_BLOCK; inode_index++) {
-            // Check if the inode is free
-            if (inode_cache[inode_index].in_use == 0) {
-                // Allocate the inode
-                inode_cache[inode_index].in_use = 1;
+inode_reference allocate_inode() {
+    if (!__imap_ready())
+        return INODE_MISSING;
 
-                // Write the updated block back to disk
-                layer0_writeBlock(cached_inode_block, inode_cache);
+    inode_reference inum;
+    while ((inum = __imap_find()) != INODE_MISSING) {
+        cofs_inode *slot;
+        layer0_buffer *buf = __get_inode_block(inum, &slot);
+        if (buf == NULL)
+            return INODE_MISSING;
 
-                --sblock_incore.free_inodes;
-                // Calculate and return the index of the inode in the ilist
-                return inode_cache[inode_index].inum;
-            }
+        // the bitmap is only a summary; the ilist has the last word
+        if (slot->in_use) {
+            __imap_clear(inum);
+            layer0_putBuffer(buf);
+            continue;
         }
+
+        // Allocate the inode and write the updated block back to disk
+        slot->in_use = 1;
+        bool written = layer0_writeBuffer(buf) == 0;
+        if (!written)
+            slot->in_use = 0;
+        layer0_putBuffer(buf);
+
+        if (!written)
+            return INODE_MISSING;
+
+        __imap_clear(inum);
+        --sblock_incore.free_inodes;
+        return inum;
     }
 
+    cofs_errno = ENOSPC;
     return INODE_MISSING;
 }
 
-bool free_inode(inode_reference index) {
-    // Calculate the block index and inode index within the block
-    size_t block_index = index / INODES_PER_BLOCK + ILIST_START_BLOCK;
-    inode_reference inode_index_within_block = index % INODES_PER_BLOCK;
+static inline struct incore_inode *__from_inode(cofs_inode *inode)
+{
+    return (struct incore_inode *) inode;
+}
+
+static struct incore_inode *__itable_lookup(inode_reference inum)
+{
+    struct incore_inode *in = itable[inum % ITABLE_BUCKETS];
+    while (in != NULL && in->inode.inum != inum)
+        in = in->hash_next;
+
+    return in;
+}
+
+static void __lru_remove(struct incore_inode *in)
+{
+    if (in->lru_prev != NULL)
+        in->lru_prev->lru_next = in->lru_next;
+    else
+        lru_head = in->lru_next;
+    if (in->lru_next != NULL)
+        in->lru_next->lru_prev = in->lru_prev;
+    else
+        lru_tail = in->lru_prev;
+
+    in->lru_prev = in->lru_next = NULL;
+    --n_unreferenced;
+}
+
+static void __lru_push(struct incore_inode *in)
+{
+    in->lru_prev = NULL;
+    in->lru_next = lru_head;
+    if (lru_head != NULL)
+        lru_head->lru_prev = in;
+    else
+        lru_tail = in;
+    lru_head = in;
+    ++n_unreferenced;
+}
+
+// a write of the whole inode takes its timestamps along, so either way it's no longer time dirty
+static void __set_dirty(struct incore_inode *in, bool dirty)
+{
+    if (in->dirty != dirty)
+        n_dirty += dirty ? 1 : -1;
+    in->dirty = dirty;
+
+    if (in->time_dirty)
+        --n_time_dirty;
+    in->time_dirty = false;
+}
+
+// copies `count` inodes into their ilist slots, one buffer per ilist block they share
+static bool __write_slots(cofs_inode *const inodes[], size_t count)
+{
+    bool ret = true;
+    for (size_t i = 0; i < count; ) {
+        cofs_inode *slot;
+        layer0_buffer *buf = __get_inode_block(inodes[i]->inum, &slot);
+        if (buf == NULL)
+            return false;
 
-    // read the inode's block into our cache if needed
-    if (cached_inode_block != block_index) {
-        if (layer0_readBlock(block_index, inode_cache) == -1)
-            return false; // read failed
-        cached_inode_block = block_index;
+        block_reference bnum = buf->bnum;
+        do {
+            memcpy((cofs_inode *) buf->data + inodes[i]->inum % INODES_PER_BLOCK, inodes[i], INODE_SIZE);
+            ++i;
+        } while (i < count && inodes[i]->inum / INODES_PER_BLOCK + ILIST_START_BLOCK == bnum);
+
+        ret = layer0_writeBuffer(buf) == 0 && ret;
+        layer0_putBuffer(buf);
+    }
+
+    return ret;
+}
+
+// writes an unreferenced inode back if need be, and drops it from the table
+static bool __evict(struct incore_inode *in)
+{
+    cofs_inode *inode = &in->inode;
+    if ((in->dirty || in->time_dirty) && !__write_slots(&inode, 1))
+        return false;
+
+    __set_dirty(in, false);
+    __lru_remove(in);
+
+    struct incore_inode **link = &itable[in->inode.inum % ITABLE_BUCKETS];
+    while (*link != in)
+        link = &(*link)->hash_next;
+    *link = in->hash_next;
+
+    free(in);
+    return true;
+}
+
+// under the `interval' writeback policy, writes dirty inodes back once they are old enough.
+// Only called from iput(): the table isn't locked, so the layer 0 flusher thread can't
+// sync it, and an idle filesystem keeps its dirty inodes in core (see mark_inode_dirty())
+static void __sync_if_due(void)
+{
+    // timestamps changed under lazytime don't make a write due on their own
+    if (layer0_opts.writeback != LAYER0_WRITEBACK_INTERVAL || n_dirty == 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - last_sync.tv_sec) * 1000
+                      + (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+    if (elapsed_ms >= (long) layer0_opts.writeback_interval_ms)
+        sync_inodes();
+}
+
+cofs_inode *iget(inode_reference inum)
+{
+    if (inum >= sblock_incore.ilist_size * INODES_PER_BLOCK) {
+        cofs_errno = EINVAL;
+        return NULL;
+    }
+
+    struct incore_inode *in = __itable_lookup(inum);
+    if (in != NULL) {
+        if (in->refs++ == 0)
+            __lru_remove(in);
+        return &in->inode;
+    }
+
+    in = aligned_alloc(INODE_SIZE, sizeof(struct incore_inode));
+    if (in == NULL) {
+        cofs_errno = ENOMEM;
+        return NULL;
+    }
+
+    cofs_inode *slot;
+    layer0_buffer *buf = __get_inode_block(inum, &slot);
+    if (buf == NULL) {
+        free(in);
+        return NULL;
+    }
+
+    memcpy(&in->inode, slot, INODE_SIZE);
+    layer0_putBuffer(buf);
+
+    in->refs = 1;
+    in->dirty = false;
+    in->time_dirty = false;
+    in->lru_prev = in->lru_next = NULL;
+    in->hash_next = itable[inum % ITABLE_BUCKETS];
+    itable[inum % ITABLE_BUCKETS] = in;
+    return &in->inode;
+}
+
+void iput(cofs_inode *inode)
+{
+    if (inode == NULL)
+        return;
+
+    struct incore_inode *in = __from_inode(inode);
+    if (--in->refs > 0)
+        return;
+
+    __lru_push(in);
+    while (n_unreferenced > ITABLE_MAX_UNREFERENCED)
+        if (!__evict(lru_tail))
+            break; // keep it; sync_inodes() will retry the write
+
+    __sync_if_due();
+}
+
+bool mark_inode_dirty(cofs_inode *inode)
+{
+    struct incore_inode *in = __from_inode(inode);
+    if (layer0_opts.writeback == LAYER0_WRITEBACK_SYNC) {
+        bool ret = __write_slots(&inode, 1);
+        __set_dirty(in, !ret);
+        return ret;
     }
 
+    __set_dirty(in, true);
+    return true;
+}
+
+bool mark_inode_time_dirty(cofs_inode *inode)
+{
+    struct incore_inode *in = __from_inode(inode);
+    if (!in->dirty && !in->time_dirty) {
+        in->time_dirty = true;
+        ++n_time_dirty;
+    }
+
+    return true;
+}
+
+static int __inum_comp(const void *a, const void *b)
+{
+    inode_reference arg1 = (*(cofs_inode *const *) a)->inum;
+    inode_reference arg2 = (*(cofs_inode *const *) b)->inum;
+
+    return (arg1 > arg2) - (arg1 < arg2);
+}
+
+bool sync_inodes(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    if (n_dirty + n_time_dirty == 0)
+        return true;
+
+    cofs_inode **dirty = malloc((n_dirty + n_time_dirty) * sizeof(cofs_inode *));
+    if (dirty == NULL)
+        COFS_ERROR(ENOMEM);
+
+    size_t count = 0;
+    for (size_t b = 0; b < ITABLE_BUCKETS; b++)
+        for (struct incore_inode *in = itable[b]; in != NULL; in = in->hash_next)
+            if (in->dirty || in->time_dirty)
+                dirty[count++] = &in->inode;
+
+    // in ilist order, so inodes sharing a block go out with one buffer write
+    qsort(dirty, count, sizeof(cofs_inode *), &__inum_comp);
+    bool ret = __write_slots(dirty, count);
+    if (ret)
+        for (size_t i = 0; i < count; i++)
+            __set_dirty(__from_inode(dirty[i]), false);
+
+    free(dirty);
+    return ret;
+}
+
+bool evict_inodes(void)
+{
+    bool ret = sync_inodes();
+    while (ret && lru_tail != NULL)
+        ret = __evict(lru_tail);
+
+    return ret;
+}
+
+bool free_inode(inode_reference index) {
+    cofs_inode *slot;
+    layer0_buffer *buf = __get_inode_block(index, &slot);
+    if (buf == NULL)
+        return false; // read failed
+
     // Mark the inode as free and zero it out
-    memset(&inode_cache[inode_index_within_block], 0, sizeof(cofs_inode));
-    inode_cache[inode_index_within_block].inum = index;
+    memset(slot, 0, sizeof(cofs_inode));
+    slot->inum = index;
 
+    // an in-core copy must not bring the old inode back when it is written back
+    struct incore_inode *in = __itable_lookup(index);
+    if (in != NULL) {
+        memcpy(&in->inode, slot, INODE_SIZE);
+        __set_dirty(in, false);
+    }
 
     // Write the updated inode block back to the disk
-    if (layer0_writeBlock(cached_inode_block, inode_cache) == 0) {
-            ++sblock_incore.free_inodes;
-            return true;
+    bool ret = layer0_writeBuffer(buf) == 0;
+    layer0_putBuffer(buf);
+
+    if (ret) {
+        ++sblock_incore.free_inodes;
+        if (imap != NULL && index < imap_inodes)
+            __imap_set(index);
     }
-    return false;
+    return ret;
 }
 
 bool read_inode(cofs_inode* inode, inode_reference index) {
@@ -104,21 +502,25 @@ bool read_inode(cofs_inode* inode, inode_reference index) {
         COFS_ERROR(EIO);
     }
 
-    // Calculate the block index and inode index within the block
-    size_t block_index = index / INODES_PER_BLOCK + ILIST_START_BLOCK;
-    size_t inode_index_within_block = index % INODES_PER_BLOCK;
+    // the in-core copy is the newest one there is
+    struct incore_inode *in = __itable_lookup(index);
+    if (in != NULL) {
+        if (inode != &in->inode)
+            memcpy(inode, &in->inode, INODE_SIZE);
+        return true;
+    }
 
-    if (cached_inode_block != block_index) {
-        // Read the block containing the inode from the disk
-        if (layer0_readBlock(block_index, inode_cache) == -1) {
-            // Handle read error
-            return false;
-        }
-        cached_inode_block = block_index;
+    // Get the block containing the inode
+    cofs_inode *slot;
+    layer0_buffer *buf = __get_inode_block(index, &slot);
+    if (buf == NULL) {
+        // Handle read error
+        return false;
     }
 
     // Copy the inode data from the block buffer to the provided inode pointer
-    memcpy(inode, &inode_cache[inode_index_within_block], INODE_SIZE);
+    memcpy(inode, slot, INODE_SIZE);
+    layer0_putBuffer(buf);
 
     return true;
 }
@@ -129,23 +531,26 @@ bool write_inode(cofs_inode* inode, inode_reference index) {
         COFS_ERROR(EIO);
     }
 
-    // Calculate the block index and inode index within the block
-    size_t block_index = index / INODES_PER_BLOCK + ILIST_START_BLOCK;
-    size_t inode_index_within_block = index % INODES_PER_BLOCK;
-
-    if (cached_inode_block != block_index) {
-        // Read the block containing the target inode from the disk
-        if (layer0_readBlock(block_index, inode_cache) == -1) {
-            // Handle read error
-            return false;
-        }
+    // inodes held in core are written back later, along with everything else that changed
+    struct incore_inode *in = __itable_lookup(index);
+    if (in != NULL) {
+        if (inode != &in->inode)
+            memcpy(&in->inode, inode, INODE_SIZE);
+        return mark_inode_dirty(&in->inode);
+    }
 
-        cached_inode_block = block_index;
+    // Get the block containing the target inode
+    cofs_inode *slot;
+    layer0_buffer *buf = __get_inode_block(index, &slot);
+    if (buf == NULL) {
+        // Handle read error
+        return false;
     }
 
-    // Update the specific inode in the block buffer
-    memcpy(&inode_cache[inode_index_within_block], inode, INODE_SIZE);
+    // Update the specific inode in the block buffer and write it back to the disk
+    memcpy(slot, inode, INODE_SIZE);
+    bool ret = layer0_writeBuffer(buf) == 0;
+    layer0_putBuffer(buf);
 
-    // Write the updated block back to the disk
-    return layer0_writeBlock(cached_inode_block, inode_cache) == 0;
-}
\ No newline at end of file
+    return ret;
+}
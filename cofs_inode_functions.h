@@ -12,6 +12,13 @@
  */
 bool ilist_create(size_t ilist_size);
 
+/**
+ * Builds the in-core free-inode bitmap from the ilist. Called at mount;
+ * `allocate_inode()` also builds it on first use if it wasn't.
+ * @return `true` on success, else `false`
+ */
+bool ilist_init(void);
+
 /**
  * Allocates an inode for a new file
  * @return Index of allocated inode in ilist on success, else -1
@@ -39,4 +46,58 @@ bool read_inode(cofs_inode* inode, inode_reference index);
  * @param index index to write inode to in the ilist
  * @return 'true' if success, else 'false' 
  */
-bool write_inode(cofs_inode* inode, inode_reference index);
\ No newline at end of file
+bool write_inode(cofs_inode* inode, inode_reference index);
+/**
+ * Gets inode `inum` from the in-core inode table, reading it in if it isn't
+ * there yet, and takes a reference to it. The inode stays in core (and the
+ * pointer stays valid) until the reference is dropped with `iput()`; changes
+ * made through it are seen by every other holder and by `read_inode()`.
+ * @param inum index of the inode in the ilist
+ * @return the in-core inode, else NULL on failure
+ */
+cofs_inode *iget(inode_reference inum);
+
+/**
+ * Drops a reference taken by `iget()`. An inode nobody references stays in
+ * core for a while, and is written back if dirty when it is dropped.
+ * @param inode The in-core inode. NULL is ignored.
+ */
+void iput(cofs_inode *inode);
+
+/**
+ * Records that an in-core inode was changed. Under the `sync' writeback
+ * policy it is written to the ilist right away; otherwise the write is
+ * deferred until `sync_inodes()` or until it is dropped from the table.
+ * `write_inode()` on an inode that is in core does the same.
+ * Under `interval' a due sync also happens on the next `iput()`, but nothing
+ * syncs inodes on a timer: the background flusher only sees layer 0 blocks,
+ * so on an idle filesystem a changed inode stays in core until the next
+ * operation, fsync or unmount.
+ * @param inode an inode obtained from `iget()`
+ * @return 'true' if success, else 'false'
+ */
+bool mark_inode_dirty(cofs_inode *inode);
+
+/**
+ * Records that only an in-core inode's timestamps changed. Unlike
+ * `mark_inode_dirty()` this never writes the inode out by itself, whatever
+ * the writeback policy: the timestamps reach the ilist with the next write of
+ * the inode, `sync_inodes()`, or when the inode is dropped from the table.
+ * @param inode an inode obtained from `iget()`
+ * @return 'true' if success, else 'false'
+ */
+bool mark_inode_time_dirty(cofs_inode *inode);
+
+/**
+ * Writes every dirty in-core inode to the ilist, in ilist order so inodes
+ * sharing a block go out together. Must be called before `layer0_flush()`
+ * or `layer0_teardown()` for inode changes to reach the disk.
+ * @return 'true' if success, else 'false'
+ */
+bool sync_inodes(void);
+
+/**
+ * Like `sync_inodes()`, then drops every unreferenced inode from the table
+ * @return 'true' if success, else 'false'
+ */
+bool evict_inodes(void);
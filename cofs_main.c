@@ -23,12 +23,16 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "layer0.h"
 #include "cofs_util.h"
 #include "cofs_syscalls.h"
 #include "superblock.h"
 #include "free_list.h"
+#include "cofs_inode_functions.h"
+#include "layer2.h"
+#include "cofs_mkfs.h"
 #include "cofs_errno.h"
 
 /*
@@ -42,6 +46,22 @@ static struct options {
 	int show_help;
         const char *mem_size;
         const char *blkdev;
+        const char *backend;
+        int direct;
+        const char *writeback;
+        const char *hugepages;
+        int populate;
+        const char *load;
+        int cow;
+        const char *save;
+        int discard;
+        const char *readahead;
+        const char *cache_mb;
+        const char *cache_shards;
+        int noatime;
+        int relatime;
+        int lazytime;
+        const char *allocator;
 } options;
 
 #define OPTION_FLAG(opt, var)           \
@@ -50,6 +70,10 @@ static struct options {
 #define OPTION_PARAM(opt, arg, var) \
         { opt" "arg, offsetof(struct options, var), 0 }
 
+/* mount options given as `-o opt=<value>' */
+#define OPTION_MOUNT(opt, var) \
+        { opt"=%s", offsetof(struct options, var), 0 }
+
 static const struct fuse_opt option_spec[] = {
         OPTION_FLAG("-h", show_help),
         OPTION_FLAG("--help", show_help),
@@ -57,6 +81,22 @@ static const struct fuse_opt option_spec[] = {
         OPTION_PARAM("--use-mem", "%s", mem_size),
         OPTION_PARAM("-b", "%s", blkdev),
         OPTION_PARAM("--blkdev", "%s", blkdev),
+        OPTION_MOUNT("backend", backend),
+        OPTION_FLAG("direct", direct),
+        OPTION_MOUNT("writeback", writeback),
+        OPTION_MOUNT("hugepages", hugepages),
+        OPTION_FLAG("populate", populate),
+        OPTION_MOUNT("load", load),
+        OPTION_FLAG("cow", cow),
+        OPTION_MOUNT("save", save),
+        OPTION_FLAG("discard", discard),
+        OPTION_MOUNT("readahead", readahead),
+        OPTION_MOUNT("cache_mb", cache_mb),
+        OPTION_MOUNT("cache_shards", cache_shards),
+        OPTION_FLAG("noatime", noatime),
+        OPTION_FLAG("relatime", relatime),
+        OPTION_FLAG("lazytime", lazytime),
+        OPTION_MOUNT("allocator", allocator),
         FUSE_OPT_END
 };
 
@@ -88,8 +128,49 @@ static void show_help(const char *progname)
         printf("COFS filesystem-specific options:\n"
                "    -m, --use-mem=<size>        Create and use an in-memory filesystem\n"
                "                                (<size> may include a suffix B|K|M|G)\n"
-               "    -b, --blkdev=<device>       Block device containing the filesystem\n"
-               "The `-m' and `-b' options are mutually exclusive.\n"
+               "    -b, --blkdev=<device>       Block device (or regular image file, see\n"
+               "                                `mkfs.cofs -s') containing the filesystem\n"
+               "    -o backend=<engine>         I/O engine used to access the filesystem:\n"
+               "                                `mmap' (default), `pio' (pread/pwrite)\n"
+               "                                or `uring' (io_uring)\n"
+               "    -o direct                   Open the block device with O_DIRECT, bypassing\n"
+               "                                the host page cache (implies backend=pio\n"
+               "                                unless backend=uring is given)\n"
+               "    -o writeback=<policy>       When written blocks reach the device:\n"
+               "                                `sync' (default, as they are written),\n"
+               "                                `interval=<ms>' (background flush every <ms>;\n"
+               "                                changed inodes go with the first flush after\n"
+               "                                the next filesystem operation)\n"
+               "                                or `on-fsync' (only on fsync and unmount)\n"
+               "    -o hugepages=<mode>         Page size backing an in-memory filesystem:\n"
+               "                                `none' (default), `thp' (transparent huge\n"
+               "                                pages) or `hugetlb' (reserved huge pages)\n"
+               "    -o populate                 Pre-fault the in-memory filesystem at mount\n"
+               "    -o load=<image>             Start an in-memory filesystem from a saved\n"
+               "                                image instead of a fresh one (implies -m,\n"
+               "                                sized to fit the image)\n"
+               "    -o cow                      Map the image given to `load' copy-on-write\n"
+               "                                instead of reading it in (mmap engine only)\n"
+               "    -o save=<image>             Save the in-memory filesystem to <image>\n"
+               "                                when it is unmounted\n"
+               "    -o discard                  Return freed blocks to the host: punch holes\n"
+               "                                in image files, drop in-memory pages\n"
+               "    -o readahead=<blocks>       Largest read-ahead window for sequential\n"
+               "                                reads (default 256, 0 disables)\n"
+               "    -o cache_mb=<MiB>           Size of the buffer cache holding inode,\n"
+               "                                directory and indirect blocks (default 16)\n"
+               "    -o cache_shards=<n>         Number of separately locked parts of the\n"
+               "                                buffer cache (default: one per 256 KiB)\n"
+               "    -o noatime                  Never update access times\n"
+               "    -o relatime                 Only update access times older than the last\n"
+               "                                modification, or more than a day old\n"
+               "    -o lazytime                 Keep access time updates in memory until the\n"
+               "                                inode is synced or evicted\n"
+               "    -o allocator=<alloc>        How a new in-memory filesystem tracks free\n"
+               "                                blocks: `list' (default) or `bitmap'\n"
+               "                                (see `mkfs.cofs -a')\n"
+               "The `-m' and `-b' options are mutually exclusive, and `load'/`save'\n"
+               "only apply to in-memory filesystems.\n"
                "\n");
 }
 static size_t parse_mem_size(const char *str)
@@ -135,7 +216,9 @@ static struct {
 static bool setup(struct options *opts)
 {
         // options are mutually exclusive
-        if ((opts->blkdev == NULL) == (opts->mem_size == NULL))
+        if (opts->blkdev && (opts->mem_size || opts->load || opts->save))
+                return false;
+        if (opts->blkdev == NULL && opts->mem_size == NULL && opts->load == NULL)
                 return false;
 
         cofs_init_args.memsize = parse_mem_size(opts->mem_size);
@@ -147,6 +230,70 @@ static bool setup(struct options *opts)
                 cofs_init_args.blkdev = opts->blkdev;
         }
 
+        if (opts->backend && !layer0_setBackend(opts->backend)) {
+                fprintf(stderr, "Unknown I/O backend: '%s'\n\n", opts->backend);
+                return false;
+        }
+
+        layer0_opts.direct = opts->direct;
+
+        if (opts->writeback && !layer0_setWriteback(opts->writeback)) {
+                fprintf(stderr, "Invalid writeback policy: '%s'\n\n", opts->writeback);
+                return false;
+        }
+
+        if (opts->hugepages && !layer0_setHugepages(opts->hugepages)) {
+                fprintf(stderr, "Unknown huge page mode: '%s'\n\n", opts->hugepages);
+                return false;
+        }
+
+        layer0_opts.populate = opts->populate;
+        layer0_opts.load_image = opts->load;
+        layer0_opts.load_cow = opts->cow;
+        layer0_opts.save_image = opts->save;
+        layer0_opts.discard = opts->discard;
+
+        if (opts->readahead) {
+                char *end;
+                unsigned long blocks = strtoul(opts->readahead, &end, 10);
+                if (*opts->readahead == '\0' || *end != '\0' || blocks > UINT_MAX) {
+                        fprintf(stderr, "Invalid read-ahead window: '%s'\n\n", opts->readahead);
+                        return false;
+                }
+                layer0_opts.readahead_blocks = blocks;
+        }
+
+        if (opts->cache_mb) {
+                char *end;
+                unsigned long mb = strtoul(opts->cache_mb, &end, 10);
+                if (*opts->cache_mb == '\0' || *end != '\0' || mb > UINT_MAX) {
+                        fprintf(stderr, "Invalid buffer cache size: '%s'\n\n", opts->cache_mb);
+                        return false;
+                }
+                layer0_opts.cache_mb = mb;
+        }
+
+        if (opts->cache_shards) {
+                char *end;
+                unsigned long n = strtoul(opts->cache_shards, &end, 10);
+                if (*opts->cache_shards == '\0' || *end != '\0' || n > UINT_MAX) {
+                        fprintf(stderr, "Invalid number of cache shards: '%s'\n\n", opts->cache_shards);
+                        return false;
+                }
+                layer0_opts.cache_shards = n;
+        }
+
+        if (opts->noatime)
+                layer2_opts.atime = LAYER2_ATIME_NOATIME;
+        else if (opts->relatime)
+                layer2_opts.atime = LAYER2_ATIME_RELATIME;
+        layer2_opts.lazytime = opts->lazytime;
+
+        if (opts->allocator && !mkfs_setAllocator(opts->allocator)) {
+                fprintf(stderr, "Unknown block allocator: '%s'\n\n", opts->allocator);
+                return false;
+        }
+
         return true;
 }
 
@@ -192,22 +339,37 @@ static void *cofs_init(struct fuse_conn_info *inf, struct fuse_config *conf)
                 cofs_abort();
         }
 
+        if (!ilist_init()) {
+                PRINT_ERR("Inode bitmap initialization failed\n");
+                cofs_abort();
+        }
+
         return NULL;
 }
 
 static void cofs_destroy(void *private_data)
 {
+        evict_inodes();
+        FreeList_drainMagazines();
+        update_superblock();
         layer0_teardown();
 }
 
-static int cofs_fsync()
-{ return 0; }
+static int cofs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+        (void) path; (void) datasync; (void) fi;
+        // the free counts and the free list's tail go out with everything else
+        return sync_inodes() && FreeList_drainMagazines() && update_superblock() != -1
+               && layer0_flush() ? 0 : -EIO;
+}
 
 static int cofs_lock()
 { return 0; }
 
-static int cofs_fsyncdir()
-{ return 0; }
+static int cofs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+        return cofs_fsync(path, datasync, fi);
+}
 
 static off_t cofs_lseek(const char *, off_t off, int whence, struct fuse_file_info *)
 {
@@ -237,13 +399,13 @@ static const struct fuse_operations cofs_oper = {
         .read           = cofs_read,
         .write          = cofs_write,
         .statfs         = cofs_statfs,
-        .release        = NULL, // don't need
-//        .fsync          = cofs_fsync,
+        .release        = cofs_release,
+        .fsync          = cofs_fsync,
 
         .opendir        = cofs_opendir,
         .readdir	= cofs_readdir,
-//        .fsyncdir       = cofs_fsyncdir,
-        .releasedir     = NULL, // don't need
+        .fsyncdir       = cofs_fsyncdir,
+        .releasedir     = cofs_release,
 
 //        .lock           = cofs_lock,
         .utimens        = cofs_utimens,
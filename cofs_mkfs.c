@@ -19,12 +19,27 @@
 #include "layer0.h"
 #include "cofs_data_structures.h"
 #include "free_list.h"
+#include "free_bitmap.h"
 #include "superblock.h"
 #include "cofs_inode_functions.h"
 #include "cofs_errno.h"
 
 #define ROOTDIR_INUM    0
 
+size_t mkfs_allocator = COFS_ALLOC_FREELIST;
+
+bool mkfs_setAllocator(const char *name)
+{
+        if (strcmp(name, "list") == 0)
+                mkfs_allocator = COFS_ALLOC_FREELIST;
+        else if (strcmp(name, "bitmap") == 0)
+                mkfs_allocator = COFS_ALLOC_BITMAP;
+        else
+                return false;
+
+        return true;
+}
+
 static cofs_inode root_dir = {
        .in_use = 1, .type = INODE_TYPE_DIR,
        .permissions = {.world_r = 1, .group_r = 1, .owner_r = 1,
@@ -55,6 +70,27 @@ static inline gid_t fs_gid(void)
 
 static int exitcode = EXIT_FAILURE;
 
+// size to create/grow a regular image file to, from `-s'
+static size_t image_size = 0;
+
+// parse a size with an optional B|K|M|G suffix, returning 0 on error
+static size_t parse_size(const char *str)
+{
+        char *end;
+        size_t sz = strtoull(str, &end, 10);
+
+        switch (*end) {
+            case 'G': case 'g': sz <<= 10; // fall through
+            case 'M': case 'm': sz <<= 10; // fall through
+            case 'K': case 'k': sz <<= 10; // fall through
+            case 'B': case 'b': ++end; break;
+            case '\0': break;
+            default: return 0;
+        }
+
+        return *end == '\0' ? sz : 0;
+}
+
 // returm index of the blkdev option
 static size_t mkfs_argparse(int argc, char **argv)
 {
@@ -62,8 +98,23 @@ static size_t mkfs_argparse(int argc, char **argv)
         __fs_gid = getgid();
         struct passwd *p;
         char opt;
-        while ((opt = getopt(argc, argv, "ho:g:")) != -1) {
+        while ((opt = getopt(argc, argv, "ha:o:g:s:")) != -1) {
                 switch (opt) {
+                    case 'a':
+                        if (!mkfs_setAllocator(optarg)) {
+                                fprintf(stderr, "Invalid block allocator '%s'\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+
+                    case 's':
+                        image_size = parse_size(optarg);
+                        if (image_size < COFS_BLOCK_SIZE) {
+                                fprintf(stderr, "Invalid image size '%s'\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+
                     case 'o': {
                         p = getpwnam(optarg);
                         if (p == NULL) {
@@ -106,10 +157,20 @@ int main(int argc, char* argv[])
         // Check if we have valid arguments. If not, enlighten the user.
         size_t blkidx = mkfs_argparse(argc, argv);
         if (!blkidx) {
-                fprintf(stderr, "Usage: mkfs.cofs [-o <owner>] [-g <group>] <device path>\n");
+                fprintf(stderr, "Usage: mkfs.cofs [-o <owner>] [-g <group>] [-s <size>] [-a <alloc>] <device path>\n"
+                                "  -s <size>   create (or grow) a regular image file of <size>\n"
+                                "              bytes, with an optional K|M|G suffix\n"
+                                "  -a <alloc>  track free blocks with a `list' (default) or\n"
+                                "              a `bitmap'\n");
                 return exitcode;
         }
 
+        if (image_size && !layer0_createImage(argv[blkidx], image_size)) {
+                fprintf(stderr, "Unable to create image '%s': %s\n",
+                        argv[blkidx], strerror(errno));
+                return EXIT_FAILURE;
+        }
+
         // open the block device
         size_t size;
         if (layer0_mapBlkdev(argv[blkidx], &size) == NULL) {
@@ -125,6 +186,12 @@ int main(int argc, char* argv[])
                 return EXIT_FAILURE;
         }
 
+        // push out anything still held in the buffer cache
+        if (!layer0_teardown()) {
+                fprintf(stderr, "Unable to write out block device '%s'\n", argv[blkidx]);
+                return EXIT_FAILURE;
+        }
+
         return 0;
 }
 #else
@@ -142,13 +209,15 @@ bool mkfs(size_t disk_size_in_bytes) {
         // Size of disk in blocks
         NUM_BLOCKS = disk_size_in_bytes / COFS_BLOCK_SIZE;
 
-        // Set block numbers for superblock, ilist (10% of disk), and free list
+        // Set block numbers for superblock, ilist (10% of disk), bitmap (if any) and free list
         block_reference const superblock_block_number = 0;
         size_t const ilist_size_in_blocks = NUM_BLOCKS / ILIST_SIZE_FRACTION;
-        block_reference const start_of_free_list = (ilist_size_in_blocks) + 1;
+        size_t const bmap_blocks = (mkfs_allocator == COFS_ALLOC_BITMAP)
+                                   ? FreeBitmap_blocksNeeded(NUM_BLOCKS) : 0;
+        block_reference const start_of_free_list = (ilist_size_in_blocks) + 1 + bmap_blocks;
 
-        // Set number of data blocks to (total number of blocks on disk - (superblock + blocks in list))
-        size_t const number_of_data_blocks = NUM_BLOCKS - (1 + ilist_size_in_blocks);
+        // Set number of data blocks to (total number of blocks on disk - (superblock + blocks in list + bitmap))
+        size_t const number_of_data_blocks = NUM_BLOCKS - (1 + ilist_size_in_blocks + bmap_blocks);
 
         // Create a superblock.
         memset(&sblock_incore, 0, sizeof sblock_incore);
@@ -157,6 +226,9 @@ bool mkfs(size_t disk_size_in_bytes) {
         sblock_incore.flist_head = start_of_free_list;
         sblock_incore.free_blocks = number_of_data_blocks;
         sblock_incore.free_inodes = ilist_size_in_blocks * INODES_PER_BLOCK;
+        sblock_incore.allocator = mkfs_allocator;
+        sblock_incore.bmap_start = ilist_size_in_blocks + 1;
+        sblock_incore.bmap_blocks = bmap_blocks;
 
         // Write our superblock to the device.
         if (update_superblock() != 0)
@@ -175,7 +247,10 @@ bool mkfs(size_t disk_size_in_bytes) {
                INODES_PER_BLOCK * ilist_size_in_blocks,
                ilist_size_in_blocks);
 
-        FreeList_create(number_of_data_blocks, start_of_free_list);
+        if (mkfs_allocator == COFS_ALLOC_BITMAP)
+                FreeBitmap_create(start_of_free_list);
+        else
+                FreeList_create(number_of_data_blocks, start_of_free_list);
         FreeList_init(sblock_incore.flist_head);
 
 #ifndef COFS_TEST_FREELIST
@@ -226,7 +301,11 @@ bool mkfs(size_t disk_size_in_bytes) {
 #endif
         update_superblock();
 
-        printf("mkfs.cofs: Initialized free block list starting at block %lu\n", start_of_free_list);
+        if (mkfs_allocator == COFS_ALLOC_BITMAP)
+                printf("mkfs.cofs: Initialized free block bitmap of %lu blocks at block %lu\n",
+                       bmap_blocks, ilist_size_in_blocks + 1);
+        else
+                printf("mkfs.cofs: Initialized free block list starting at block %lu\n", start_of_free_list);
 
         return ret;
 }
@@ -6,4 +6,13 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+/* how the next mkfs() tracks free blocks (COFS_ALLOC_*); a free list by default */
+extern size_t mkfs_allocator;
+
+/**
+ * Selects `mkfs_allocator` by name: `list' or `bitmap'
+ * @return `true` on success, else `false` if the name is unknown
+ */
+bool mkfs_setAllocator(const char *name);
+
 bool mkfs(size_t disk_size_in_bytes);
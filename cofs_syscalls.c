@@ -22,6 +22,7 @@
 #include "layer0.h"
 #include "cofs_datablocks.h"
 #include "superblock.h"
+#include "free_list.h"
 #include "cofs_util.h"
 
 static cofs_inode my_ino;
@@ -43,10 +44,12 @@ int cofs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
-        if (!read_inode(&my_ino, target))
+        cofs_inode *ino = iget(target);
+        if (ino == NULL)
                 return -cofs_errno;
 
-        fill_statbuf(stbuf, &my_ino);
+        fill_statbuf(stbuf, ino);
+        iput(ino);
 
         return -cofs_errno;
 }
@@ -247,13 +250,15 @@ int cofs_chmod(const char *pathname, mode_t mode, struct fuse_file_info *fi)
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
-        if (!read_inode(&my_ino, target))
+        cofs_inode *ino = iget(target);
+        if (ino == NULL)
                 return -cofs_errno;
 
-        my_ino.permissions = get_ino_perms(mode);
-        update_inode_ctime(&my_ino);
+        ino->permissions = get_ino_perms(mode);
+        update_inode_ctime(ino);
 
-        write_inode(&my_ino, target);
+        mark_inode_dirty(ino);
+        iput(ino);
         return -cofs_errno;
 }
 
@@ -265,16 +270,18 @@ int cofs_chown(const char *pathname, uid_t uid, gid_t gid, struct fuse_file_info
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
-        if (!read_inode(&my_ino, target))
+        cofs_inode *ino = iget(target);
+        if (ino == NULL)
                 return -cofs_errno;
 
-        my_ino.uid = uid;
-        my_ino.gid = gid;
-        my_ino.permissions.sg = 0;
-        my_ino.permissions.su = 0;
+        ino->uid = uid;
+        ino->gid = gid;
+        ino->permissions.sg = 0;
+        ino->permissions.su = 0;
 
-        update_inode_ctime(&my_ino);
-        write_inode(&my_ino, target);
+        update_inode_ctime(ino);
+        mark_inode_dirty(ino);
+        iput(ino);
         return -cofs_errno;
 }
 
@@ -299,6 +306,10 @@ int cofs_open(const char *pathname, struct fuse_file_info *fi)
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
+        // keep the inode in core for as long as the file is open
+        if (iget(target) == NULL)
+                return -cofs_errno;
+
         fi->fh = target;
 
         // TODO: update inode access time?
@@ -308,6 +319,23 @@ int cofs_open(const char *pathname, struct fuse_file_info *fi)
         return -cofs_errno;
 }
 
+// also serves as releasedir, since cofs_opendir() holds the inode the same way
+int cofs_release(const char *pathname, struct fuse_file_info *fi)
+{
+        (void) pathname;
+        CLEAR_ERRNO();
+
+        // the inode is still in core from cofs_open(), so this only finds it;
+        // then drop both this reference and the one cofs_open() took
+        cofs_inode *ino = iget(fi->fh);
+        if (ino != NULL) {
+                iput(ino);
+                iput(ino);
+        }
+
+        return -cofs_errno;
+}
+
 int cofs_read(const char *path, char *buf, size_t count,
               off_t offset, struct fuse_file_info *fi)
 {
@@ -318,12 +346,9 @@ int cofs_read(const char *path, char *buf, size_t count,
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
-        cofs_inode *file = malloc(sizeof(cofs_inode));
+        cofs_inode *file = iget(target);
         if (file == NULL)
-                return -errno; // whatever error code malloc gave us
-
-        if (!read_inode(file, target))
-                goto cleanup;
+                return -cofs_errno;
 
         if (file->type == INODE_TYPE_DIR) {
                 cofs_errno = EISDIR;
@@ -337,11 +362,10 @@ int cofs_read(const char *path, char *buf, size_t count,
         if (!File_readData(file, buf, offset, count))
                 goto cleanup;
 
-        update_inode_atime(file);
-        write_inode(file, target);
+        touch_inode_atime(file);
 
 cleanup:
-        free(file);
+        iput(file);
         return (cofs_errno == 0) ? (int) count : -cofs_errno;
 }
 
@@ -358,12 +382,9 @@ int cofs_write(const char *path, const char *buf, size_t count,
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
-        cofs_inode *file = malloc(sizeof(cofs_inode));
+        cofs_inode *file = iget(target);
         if (file == NULL)
-                return -errno; // whatever error code malloc gave us
-
-        if (!read_inode(file, target))
-                goto cleanup;
+                return -cofs_errno;
 
         if (file->type == INODE_TYPE_DIR) {
                 cofs_errno = EISDIR;
@@ -374,10 +395,10 @@ int cofs_write(const char *path, const char *buf, size_t count,
                 goto cleanup;
 
         update_inode_mtime(file);
-        write_inode(file, target);
+        mark_inode_dirty(file);
 
 cleanup:
-        free(file);
+        iput(file);
         return (cofs_errno == 0) ? (int) count : -cofs_errno;
 }
 
@@ -387,12 +408,13 @@ int cofs_statfs(const char *ignored, struct statvfs *statbuf)
         (void) ignored;
 
         statbuf->f_bsize = statbuf->f_frsize = COFS_BLOCK_SIZE;
-        statbuf->f_blocks = sblock_incore.n_blocks - sblock_incore.ilist_size - 1;
-        statbuf->f_bfree = statbuf->f_bavail = sblock_incore.free_blocks;
+        statbuf->f_blocks = sblock_incore.n_blocks - sblock_incore.ilist_size - sblock_incore.bmap_blocks - 1;
+        // blocks parked in the allocation magazines are free too, just not on disk yet
+        statbuf->f_bfree = statbuf->f_bavail = sblock_incore.free_blocks + FreeList_parkedBlocks();
         statbuf->f_files = sblock_incore.ilist_size * INODES_PER_BLOCK;
         statbuf->f_ffree = statbuf->f_favail = sblock_incore.free_inodes;
         statbuf->f_namemax = MAX_FILE_BASENAME;
-        statbuf->f_flag = 0x10; // ST_SYNCHRONOUS
+        statbuf->f_flag = layer0_opts.writeback == LAYER0_WRITEBACK_SYNC ? 0x10 : 0; // ST_SYNCHRONOUS
 
         return -cofs_errno;
 }
@@ -418,7 +440,6 @@ struct __readDir_Args {
     void *buf;
     fuse_fill_dir_t filler;
     enum fuse_fill_dir_flags flags;
-    cofs_direntry *block_cache;
     struct stat *stbuf;
     size_t entries_to_read;
 };
@@ -426,30 +447,38 @@ struct __readDir_Args {
 static bool __readDir_Iterator(block_reference block, void *_args)
 {
         struct __readDir_Args *args = _args;
-        if (layer0_readBlock(block, args->block_cache) != 0)
+        layer0_buffer *dirblock = layer0_getBuffer(block);
+        if (dirblock == NULL)
                 return false;
 
-        for (size_t i = 0; i < DIRENTRIES_PER_BLOCK; i++) {
-                if (args->entries_to_read == 0)
-                        return false; // END OF DIRECTORY
+        bool ret = true;
+        for (size_t i = 0; i < DIRENTRIES_PER_BLOCK && ret; i++) {
+                if (args->entries_to_read == 0) {
+                        ret = false; // END OF DIRECTORY
+                        break;
+                }
 
-                cofs_direntry *entry = &args->block_cache[i];
+                const cofs_direntry *entry = (const cofs_direntry *) dirblock->data + i;
                 if (entry->inum == INODE_MISSING)
                         continue; // HOLE
 
-                if (!read_inode(&my_ino, entry->inum))
-                        return false;
+                if (!read_inode(&my_ino, entry->inum)) {
+                        ret = false;
+                        break;
+                }
 
                 fill_statbuf(args->stbuf, &my_ino);
 
                 --args->entries_to_read;
 
                 if (args->filler(args->buf, entry->base_name, args->stbuf, 0, args->flags) == 1) {
-                        COFS_ERROR(EAGAIN); // TODO: not really sure what this error should be
+                        cofs_errno = EAGAIN; // TODO: not really sure what this error should be
+                        ret = false;
                 }
         }
 
-        return true;
+        layer0_putBuffer(dirblock);
+        return ret;
 }
 
 int cofs_opendir(const char *pathname, struct fuse_file_info *fi)
@@ -460,6 +489,9 @@ int cofs_opendir(const char *pathname, struct fuse_file_info *fi)
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
+        if (iget(target) == NULL)
+                return -cofs_errno;
+
         fi->fh = target;
 
         // TODO: update inode access time?
@@ -479,22 +511,16 @@ int cofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                 return (cofs_errno == 0) ? -ENOENT : -cofs_errno;
 
         // can't use my_ino since the iterator uses it
-        cofs_inode *dir = malloc(sizeof(cofs_inode));
+        cofs_inode *dir = iget(target);
         if (dir == NULL)
-                return -errno; // whatever error code malloc gave us
-
-        /* TODO: handle errors involving inode lookup here */
-
-        if (!read_inode(dir, target))
                 return -cofs_errno;
 
-        if (dir->type != INODE_TYPE_DIR)
+        if (dir->type != INODE_TYPE_DIR) {
+                iput(dir);
                 return -ENOTDIR;
+        }
 
-        update_inode_atime(dir);
-
-        if (!write_inode(dir, target))
-                return -cofs_errno;
+        touch_inode_atime(dir);
 
         struct stat stbuf;
 
@@ -502,19 +528,12 @@ int cofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                 .buf = buf,
                 .filler = filler,
                 .flags = (flags == FUSE_READDIR_PLUS ? FUSE_FILL_DIR_PLUS : 0),
-                .block_cache = calloc(DIRENTRIES_PER_BLOCK, sizeof(cofs_direntry)),
                 .stbuf = &stbuf, .entries_to_read = dir->num_direntries
         };
 
-        if (args.block_cache == NULL) {
-                free(dir);
-                return -errno;
-        }
-
         foreach_datablock_in_inode(dir, __readDir_Iterator, 0, true, &args);
 
-        free(dir);
-        free(args.block_cache);
+        iput(dir);
 
         return -cofs_errno;
 }
@@ -527,28 +546,27 @@ int cofs_utimens(const char *pathname, const struct timespec tv[2], struct fuse_
         if (target == INODE_MISSING)
                 return -cofs_errno;
 
-        if (!read_inode(&my_ino, target))
+        cofs_inode *ino = iget(target);
+        if (ino == NULL)
                 return -cofs_errno;
 
         if (tv == NULL) {
-                update_inode_atime(&my_ino);
-                update_inode_mtime(&my_ino);
-                return -cofs_errno;
-        }
-
-        if (tv[0].tv_nsec == UTIME_NOW) {
-                update_inode_atime(&my_ino);
-        } else {
-                my_ino.atim = tv[0];
-        }
-
-        if (tv[1].tv_nsec == UTIME_NOW) {
-                update_inode_mtime(&my_ino);
+                update_inode_atime(ino);
+                update_inode_mtime(ino);
         } else {
-                my_ino.mtim = tv[1];
+                if (tv[0].tv_nsec == UTIME_NOW)
+                        update_inode_atime(ino);
+                else
+                        ino->atim = tv[0];
+
+                if (tv[1].tv_nsec == UTIME_NOW)
+                        update_inode_mtime(ino);
+                else
+                        ino->mtim = tv[1];
         }
 
-        write_inode(&my_ino, target);
+        mark_inode_dirty(ino);
+        iput(ino);
 
         return -cofs_errno;
 }
@@ -31,6 +31,7 @@ int cofs_chown(const char *pathname, uid_t uid, gid_t gid, struct fuse_file_info
 int cofs_truncate (const char *pathname, off_t size, struct fuse_file_info *fi);
 
 int cofs_open(const char *pathname, struct fuse_file_info *fi);
+int cofs_release(const char *pathname, struct fuse_file_info *fi);
 int cofs_read(const char *path, char *buf, size_t count, off_t offset, struct fuse_file_info *fi);
 int cofs_write(const char *path, const char *buf, size_t count, off_t offset, struct fuse_file_info *fi);
 int cofs_statfs(const char *, struct statvfs *statbuf);
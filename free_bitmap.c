@@ -0,0 +1,390 @@
+/* free_bitmap.c - block free-space bitmap for COFS
+ *
+ * One bit per block in the FS, set while the block is free, stored in
+ * `sblock_incore.bmap_blocks` blocks starting at `sblock_incore.bmap_start`
+ * (right after the ilist). Each bitmap block is a group; a count of the free
+ * blocks in every group is kept in core, built at mount, so allocation skips
+ * full groups without reading them and then finds a free bit with
+ * find-first-set over 64-bit words, resuming where the last one was found.
+ * Runs of contiguous blocks are searched for bit by bit within one group,
+ * starting from a goal block (usually just past the end of the file being
+ * extended), so a file written in large chunks ends up laid out in order.
+ * The bitmap blocks themselves go through the buffer cache, which coalesces
+ * repeated updates of the same block.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "free_bitmap.h"
+#include "cofs_util.h"
+#include "cofs_errno.h"
+#include "layer0.h"
+#include "superblock.h"
+
+#define BITS_PER_BMAP_BLOCK     (COFS_BLOCK_SIZE * 8)
+#define WORDS_PER_BMAP_BLOCK    (COFS_BLOCK_SIZE / sizeof(uint64_t))
+
+// number of bitmap blocks FreeBitmap_create() writes per vectored write
+#define CREATE_BATCH            64U
+
+static size_t *group_free = NULL;       /* free blocks per bitmap block */
+static size_t n_groups = 0;
+// where the last block was found; the search starts there next time
+static size_t hint_group = 0, hint_word = 0;
+
+size_t FreeBitmap_blocksNeeded(size_t n_blocks)
+{
+        return (n_blocks + BITS_PER_BMAP_BLOCK - 1) / BITS_PER_BMAP_BLOCK;
+}
+
+static inline block_reference __first_data_block(void)
+{
+        return sblock_incore.bmap_start + sblock_incore.bmap_blocks;
+}
+
+// sets the bits of bitmap block `group` for the blocks in [first, last)
+static void __fill_group(uint64_t *words, size_t group, block_reference first, block_reference last)
+{
+        for (size_t w = 0; w < WORDS_PER_BMAP_BLOCK; w++) {
+                block_reference base = group * BITS_PER_BMAP_BLOCK + w * 64;
+                if (base >= first && base + 64 <= last) {
+                        words[w] = ~0ULL;
+                        continue;
+                }
+
+                words[w] = 0;
+                for (size_t bit = 0; bit < 64; bit++)
+                        if (base + bit >= first && base + bit < last)
+                                words[w] |= 1ULL << bit;
+        }
+}
+
+bool FreeBitmap_create(block_reference first_data_block)
+{
+        uint64_t *blocks;
+        MALIGN_CHECK(blocks, CREATE_BATCH * COFS_BLOCK_SIZE);
+        if (blocks == NULL)
+                COFS_ERROR(ENOMEM);
+
+        struct layer0_iovec iov[CREATE_BATCH];
+        bool ret = true;
+
+        for (size_t g = 0; g < sblock_incore.bmap_blocks; ) {
+                size_t n;
+                for (n = 0; n < CREATE_BATCH && g < sblock_incore.bmap_blocks; n++, g++) {
+                        uint64_t *words = blocks + n * WORDS_PER_BMAP_BLOCK;
+                        __fill_group(words, g, first_data_block, sblock_incore.n_blocks);
+                        iov[n].bnum = sblock_incore.bmap_start + g;
+                        iov[n].buf = words;
+                }
+
+                if (layer0_writev(iov, n) == -1) {
+                        ret = false;
+                        break;
+                }
+        }
+
+        free(blocks);
+        return ret;
+}
+
+bool FreeBitmap_init(void)
+{
+        size_t *counts = calloc(sblock_incore.bmap_blocks, sizeof(size_t));
+        uint64_t *words;
+        MALIGN_CHECK(words, COFS_BLOCK_SIZE);
+        if (counts == NULL || words == NULL) {
+                free(counts);
+                free(words);
+                COFS_ERROR(ENOMEM);
+        }
+
+        // read around the buffer cache's LRU; the bitmap is only scanned once here
+        bool ret = true;
+        for (size_t g = 0; g < sblock_incore.bmap_blocks; g++) {
+                if (layer0_readBlock(sblock_incore.bmap_start + g, words) == -1) {
+                        ret = false;
+                        break;
+                }
+
+                for (size_t w = 0; w < WORDS_PER_BMAP_BLOCK; w++)
+                        counts[g] += __builtin_popcountll(words[w]);
+        }
+
+        free(words);
+        if (!ret) {
+                free(counts);
+                return false;
+        }
+
+        /* the bitmap and the superblock are written back separately, so after an
+         * unclean unmount the superblock's count can be off; the bitmap is the truth
+         */
+        size_t total = 0;
+        for (size_t g = 0; g < sblock_incore.bmap_blocks; g++)
+                total += counts[g];
+        sblock_incore.free_blocks = total;
+
+        free(group_free);
+        group_free = counts;
+        n_groups = sblock_incore.bmap_blocks;
+        hint_group = hint_word = 0;
+        return true;
+}
+
+// clears the first set bit in `words` at or after word `start`, wrapping around
+static size_t __take_bit(uint64_t *words, size_t start)
+{
+        for (size_t i = 0; i < WORDS_PER_BMAP_BLOCK; i++) {
+                size_t w = (start + i) % WORDS_PER_BMAP_BLOCK;
+                if (words[w] != 0) {
+                        size_t bit = __builtin_ffsll((long long) words[w]) - 1;
+                        words[w] &= ~(1ULL << bit);
+                        return w * 64 + bit;
+                }
+        }
+
+        return SIZE_MAX;
+}
+
+block_reference FreeBitmap_pop(void)
+{
+        for (size_t n = 0; n < n_groups; n++) {
+                size_t g = (hint_group + n) % n_groups;
+                if (group_free[g] == 0)
+                        continue;
+
+                layer0_buffer *buf = layer0_getBuffer(sblock_incore.bmap_start + g);
+                if (buf == NULL)
+                        return 0;
+
+                size_t bit = __take_bit(buf->data, g == hint_group ? hint_word : 0);
+                if (bit == SIZE_MAX) {
+                        // the count was off; believe the bitmap
+                        layer0_putBuffer(buf);
+                        group_free[g] = 0;
+                        continue;
+                }
+
+                block_reference block = g * BITS_PER_BMAP_BLOCK + bit;
+                if (layer0_writeBuffer(buf) == -1) {
+                        ((uint64_t *) buf->data)[bit / 64] |= 1ULL << (bit % 64);
+                        layer0_putBuffer(buf);
+                        return 0;
+                }
+                layer0_putBuffer(buf);
+
+                --group_free[g];
+                hint_group = g;
+                hint_word = bit / 64;
+                --sblock_incore.free_blocks;
+                return block;
+        }
+
+        return 0; // No more free blocks available
+}
+
+static inline bool __bit_is_set(const uint64_t *words, size_t bit)
+{
+        return words[bit / 64] & (1ULL << (bit % 64));
+}
+
+/* finds the first run of `want` free bits in `words` at or after bit `from`,
+ * wrapping around to the start; failing that, the longest run there is.
+ * @return the run's length (0 if the group is full), with its start in `*start`
+ */
+static size_t __find_run(const uint64_t *words, size_t from, size_t want, size_t *start)
+{
+        size_t best = 0, run = 0, run_start = 0;
+        for (size_t i = 0; i < BITS_PER_BMAP_BLOCK; i++) {
+                size_t bit = (from + i) % BITS_PER_BMAP_BLOCK;
+                // a run can't wrap past the end of the group
+                if (bit == 0)
+                        run = 0;
+
+                // skip over words with nothing free in them
+                if (bit % 64 == 0 && words[bit / 64] == 0 && i + 64 <= BITS_PER_BMAP_BLOCK) {
+                        run = 0;
+                        i += 63;
+                        continue;
+                }
+
+                if (!__bit_is_set(words, bit)) {
+                        run = 0;
+                        continue;
+                }
+
+                if (run++ == 0)
+                        run_start = bit;
+                if (run > best) {
+                        best = run;
+                        *start = run_start;
+                        if (best == want)
+                                break;
+                }
+        }
+
+        return best;
+}
+
+size_t FreeBitmap_popRun(block_reference goal, size_t count, block_reference *start)
+{
+        if (count == 0)
+                return 0;
+
+        bool have_goal = goal >= __first_data_block() && goal < sblock_incore.n_blocks;
+        size_t first_group = have_goal ? goal / BITS_PER_BMAP_BLOCK : hint_group;
+
+        for (size_t n = 0; n < n_groups; n++) {
+                size_t g = (first_group + n) % n_groups;
+                if (group_free[g] == 0)
+                        continue;
+
+                layer0_buffer *buf = layer0_getBuffer(sblock_incore.bmap_start + g);
+                if (buf == NULL)
+                        return 0;
+
+                size_t from = 0;
+                if (n == 0)
+                        from = have_goal ? goal % BITS_PER_BMAP_BLOCK : hint_word * 64;
+
+                size_t first_bit;
+                uint64_t *words = buf->data;
+                size_t len = __find_run(words, from, count, &first_bit);
+                if (len == 0) {
+                        // the count was off; believe the bitmap
+                        layer0_putBuffer(buf);
+                        group_free[g] = 0;
+                        continue;
+                }
+
+                block_reference first = g * BITS_PER_BMAP_BLOCK + first_bit;
+                for (size_t bit = first_bit; bit < first_bit + len; bit++)
+                        words[bit / 64] &= ~(1ULL << (bit % 64));
+
+                if (layer0_writeBuffer(buf) == -1) {
+                        for (size_t bit = first_bit; bit < first_bit + len; bit++)
+                                words[bit / 64] |= 1ULL << (bit % 64);
+                        layer0_putBuffer(buf);
+                        return 0;
+                }
+                layer0_putBuffer(buf);
+
+                group_free[g] -= len;
+                hint_group = g;
+                hint_word = (first_bit + len - 1) / 64;
+                sblock_incore.free_blocks -= len;
+                *start = first;
+                return len;
+        }
+
+        return 0; // No more free blocks available
+}
+
+size_t FreeBitmap_popMany(block_reference goal, block_reference blocks[], size_t count)
+{
+        size_t done = 0;
+        while (done < count) {
+                block_reference start;
+                size_t len = FreeBitmap_popRun(goal, count - done, &start);
+                if (len == 0)
+                        break;
+
+                for (size_t i = 0; i < len; i++)
+                        blocks[done++] = start + i;
+                goal = start + len;
+        }
+
+        return done;
+}
+
+bool FreeBitmap_append(block_reference block_index)
+{
+        if (block_index >= sblock_incore.n_blocks || block_index < __first_data_block())
+                return false;
+
+        size_t g = block_index / BITS_PER_BMAP_BLOCK;
+        size_t bit = block_index % BITS_PER_BMAP_BLOCK;
+        layer0_buffer *buf = layer0_getBuffer(sblock_incore.bmap_start + g);
+        if (buf == NULL)
+                return false;
+
+        uint64_t *word = (uint64_t *) buf->data + bit / 64;
+        if (*word & (1ULL << (bit % 64))) {
+                // already free
+                layer0_putBuffer(buf);
+                return false;
+        }
+
+        *word |= 1ULL << (bit % 64);
+        bool ret = layer0_writeBuffer(buf) == 0;
+        if (!ret)
+                *word &= ~(1ULL << (bit % 64));
+        layer0_putBuffer(buf);
+        if (!ret)
+                return false;
+
+        ++group_free[g];
+        // nothing is stored in the block itself, so its storage can go
+        layer0_discard(block_index);
+        ++sblock_incore.free_blocks;
+        return true;
+}
+
+/* Writes back bitmap block `g` after `blocks[0..n)` were marked free in it. On
+ * failure their bits are cleared again, so the cached bitmap doesn't call
+ * them free when the counts don't; they are only discarded once committed.
+ */
+static bool __commit_group(layer0_buffer *buf, size_t g, const block_reference blocks[], size_t n)
+{
+        bool ret = layer0_writeBuffer(buf) == 0;
+        if (!ret) {
+                for (size_t i = 0; i < n; i++)
+                        ((uint64_t *) buf->data)[blocks[i] % BITS_PER_BMAP_BLOCK / 64] &= ~(1ULL << (blocks[i] % 64));
+        }
+        layer0_putBuffer(buf);
+        if (!ret)
+                return false;
+
+        group_free[g] += n;
+        sblock_incore.free_blocks += n;
+        for (size_t i = 0; i < n; i++)
+                layer0_discard(blocks[i]);
+
+        return true;
+}
+
+size_t FreeBitmap_appendMany(const block_reference blocks[], size_t count)
+{
+        // consecutive blocks in the same group share one write of its bitmap block
+        layer0_buffer *buf = NULL;
+        size_t g = 0, pending = 0, done;
+        for (done = 0; done < count; done++) {
+                block_reference block = blocks[done];
+                if (block >= sblock_incore.n_blocks || block < __first_data_block())
+                        break;
+
+                if (buf == NULL || block / BITS_PER_BMAP_BLOCK != g) {
+                        if (buf != NULL && !__commit_group(buf, g, blocks + done - pending, pending))
+                                return done - pending;
+
+                        g = block / BITS_PER_BMAP_BLOCK;
+                        pending = 0;
+                        if ((buf = layer0_getBuffer(sblock_incore.bmap_start + g)) == NULL)
+                                return done;
+                }
+
+                uint64_t *word = (uint64_t *) buf->data + block % BITS_PER_BMAP_BLOCK / 64;
+                if (*word & (1ULL << (block % 64)))
+                        break; // already free
+
+                *word |= 1ULL << (block % 64);
+                ++pending;
+        }
+
+        if (buf != NULL && !__commit_group(buf, g, blocks + done - pending, pending))
+                return done - pending;
+
+        return done;
+}
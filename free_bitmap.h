@@ -0,0 +1,77 @@
+/* free_bitmap.h - block free-space bitmap for COFS
+ *
+ * An alternative to the free list (free_list.h), chosen at mkfs time. The
+ * FreeList_ functions hand over to these when the superblock says the
+ * filesystem uses a bitmap, so callers don't need to care which one it is.
+ */
+
+#pragma once
+
+#include "cofs_data_structures.h"
+
+/**
+ * @param n_blocks Total number of blocks in the FS
+ * @return The number of bitmap blocks needed to cover `n_blocks` blocks
+ */
+size_t FreeBitmap_blocksNeeded(size_t n_blocks);
+
+/**
+ * Writes out a bitmap in which every block from `first_data_block` up to the
+ * end of the FS is free. Should only be called by mkfs, after it has filled
+ * in `sblock_incore.n_blocks`, `bmap_start` and `bmap_blocks`.
+ * @param first_data_block The first block that may be handed out
+ * @return `true` on success, else `false`
+ */
+bool FreeBitmap_create(block_reference first_data_block);
+
+/**
+ * Builds the in-core free counts from the on-disk bitmap described by the
+ * superblock, and takes the superblock's `free_blocks` from them too. Should
+ * be called as part of the mount process.
+ * @return `true` on success, else `false`
+ */
+bool FreeBitmap_init(void);
+
+/**
+ * Claims a free block, leaving its contents as they are
+ * @return The index of the claimed block, else 0 if there is none
+ */
+block_reference FreeBitmap_pop(void);
+
+/**
+ * Claims a run of contiguous free blocks, looking for one at or after `goal`
+ * first. Like `FreeBitmap_pop()`, the blocks aren't zeroed.
+ * @param goal Where the run should preferably start; ignored if it isn't a
+ *             data block
+ * @param count The number of blocks wanted
+ * @param start Receives the first block of the run
+ * @return The length of the run, at most `count`, else 0 if there are no free
+ *         blocks. A run of `count` blocks is only missed if no group holds one.
+ */
+size_t FreeBitmap_popRun(block_reference goal, size_t count, block_reference *start);
+
+/**
+ * Claims `count` blocks, as a series of `FreeBitmap_popRun()` calls that each
+ * carry on from where the last run ended
+ * @param goal Where the first run should preferably start
+ * @param blocks Receives the claimed blocks
+ * @param count The number of blocks wanted
+ * @return The number of blocks claimed, less than `count` only if there were
+ *         no more free blocks
+ */
+size_t FreeBitmap_popMany(block_reference goal, block_reference blocks[], size_t count);
+
+/**
+ * Marks the specified block free again
+ * @param block_index The block number to free
+ * @return `true` on success, else `false` (including if it was already free)
+ */
+bool FreeBitmap_append(block_reference block_index);
+
+/**
+ * Marks every block in `blocks` free again, writing each bitmap block back
+ * once per run of entries that fall in it
+ * @return The number of blocks freed, from the start of `blocks`. It stops at
+ *         the first invalid or already free block, or failed write.
+ */
+size_t FreeBitmap_appendMany(const block_reference blocks[], size_t count);
@@ -2,15 +2,20 @@
  *  Layout based on https://sites.cs.ucsb.edu/~rich/class/cs270/papers/fs-impl.pdf
  */
 
-// TODO: add locking for concurrency support
+/* The shared allocator (the list, or the bitmap it hands over to) is guarded
+ * by `flist_lock`. Paths that allocate a lot go through the per-thread
+ * magazines (`struct magazine`) instead, which only take the lock now and then.
+ */
 // TODO: add error checking in places that don't have it!
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <malloc.h>
+#include <pthread.h>
 #include "cofs_parameters.h"
 #include "cofs_util.h"
 #include "free_list.h"
+#include "free_bitmap.h"
 #include "cofs_data_structures.h"
 #include "layer0.h"
 #include "superblock.h"
@@ -23,6 +28,9 @@ typedef struct freelist_block {
 } *list_node;
 _Static_assert(sizeof(struct freelist_block) == COFS_BLOCK_SIZE, "");
 
+// number of free list blocks FreeList_create() writes per vectored write
+#define CREATE_BATCH            64U
+
 // just to make typing easier LOL
 typedef block_reference blkref;
 
@@ -30,11 +38,40 @@ typedef block_reference blkref;
 static size_t block_count; // TODO: make use of this to check error stuff
 
 static blkref list_head_blkidx;
-static struct freelist_block list_head;
+static struct freelist_block list_head __attribute__((aligned(COFS_BLOCK_SIZE)));
 static const list_node head_ptr = &list_head;
 static size_t next_freeslot = 0;
 static blkref tail_idx = 0;
 
+static pthread_mutex_t flist_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per-thread magazines: a small stack of free blocks each thread allocates
+ * from and frees onto without touching the shared allocator. Only when a
+ * magazine runs empty or fills up does its thread take `flist_lock`, to move
+ * half a magazine's worth of blocks in or out with one __popMany() or
+ * __appendMany(), so threads allocating at the same time rarely wait on each
+ * other. Blocks sitting in a magazine count as in use until they are drained.
+ */
+#define MAGAZINE_SIZE           256U
+
+struct magazine {
+        pthread_mutex_t lock;           /* its thread's, except while being drained */
+        struct magazine *next;          /* every thread's magazine, on `magazines` */
+        size_t n;
+        blkref blocks[MAGAZINE_SIZE];   /* the next block to hand out on top */
+};
+
+static struct magazine *magazines = NULL;       /* guarded by flist_lock */
+static __thread struct magazine *my_magazine = NULL;
+
+// the lowest block that can ever be free: past the ilist, and past the bitmap on bitmap filesystems
+static inline blkref __first_data_block(void)
+{
+        if (sblock_incore.allocator == COFS_ALLOC_BITMAP)
+                return sblock_incore.bmap_start + sblock_incore.bmap_blocks;
+        return sblock_incore.ilist_size + 1;
+}
+
 static inline size_t intdiv_ceil(size_t dividend, size_t divisor)
 {
         // NOTE: the addition *can* overflow if numbers are large enough, but
@@ -49,6 +86,7 @@ void __create_starting_flist_block(blkref my_blocknum, list_node me, size_t firs
         if (me->next >= sblock_incore.n_blocks)
                 me->next = 0;
 
+        memset(me->data, 0, first_entry * sizeof(blkref));
         for (size_t i = first_entry; i < ENTRIES_PER_FREEBLOCK; i++) {
                 // add one first so we don't put ourselves at 0
                 me->data[i] = ++my_blocknum;
@@ -62,47 +100,88 @@ bool FreeList_create(size_t n_data_blocks, blkref head)
         size_t leftover = n_data_blocks % (ENTRIES_PER_FREEBLOCK + 1);
 
         size_t start_idx = ENTRIES_PER_FREEBLOCK - leftover;
-        list_node node;
-        MALIGN_CHECK(node, sizeof(struct freelist_block));
+        list_node nodes;
+        MALIGN_CHECK(nodes, CREATE_BATCH * sizeof(struct freelist_block));
+        struct layer0_iovec iov[CREATE_BATCH];
+        bool ret = true;
 
         sblock_incore.flist_head = head;
 
-        for (size_t i = 0; i < n_freelistblocks; i++) {
-                __create_starting_flist_block(head, node, start_idx);
-                if (layer0_writeBlock(head, node) == -1)
-                        return false;
-                head = node->next;
-                start_idx = 0;
+        // build the list CREATE_BATCH nodes at a time and write each batch out in one go
+        for (size_t i = 0; i < n_freelistblocks; ) {
+                size_t n;
+                for (n = 0; n < CREATE_BATCH && i < n_freelistblocks; n++, i++) {
+                        __create_starting_flist_block(head, &nodes[n], start_idx);
+                        iov[n].bnum = head;
+                        iov[n].buf = &nodes[n];
+                        head = nodes[n].next;
+                        start_idx = 0;
+                }
+
+                if (layer0_writev(iov, n) == -1) {
+                        ret = false;
+                        break;
+                }
+                sblock_incore.flist_tail = iov[n - 1].bnum;
         }
-        node->next = 0;
 
-        free(node);
-        return true;
+        free(nodes);
+        return ret;
 }
 
 bool FreeList_init(block_reference head)
 {
+        // whatever is left in the magazines belongs to the FS mounted before
+        for (struct magazine *m = magazines; m != NULL; m = m->next)
+                m->n = 0;
+
+        if (sblock_incore.allocator == COFS_ALLOC_BITMAP)
+                return FreeBitmap_init();
+
         list_head_blkidx = head;
+        // 0 on filesystems made before the tail was kept; then it's found when first needed
+        tail_idx = sblock_incore.flist_tail;
         bool ret = layer0_readBlock(head, head_ptr) == 0;
         next_freeslot = ENTRIES_PER_FREEBLOCK - 1;
 
-        while (list_head.data[next_freeslot] != 0 && next_freeslot != SIZE_MAX)
+        while (next_freeslot != SIZE_MAX && list_head.data[next_freeslot] != 0)
                 --next_freeslot;
 
         return ret;
 }
 
+// writes the in-core list head back through the buffer cache, so that the
+// pops and appends between two flushes cost a single write of the block
+static int __write_head(void)
+{
+        layer0_buffer *buf = layer0_claimBuffer(list_head_blkidx);
+        if (buf == NULL)
+                return -1;
+
+        memcpy(buf->data, head_ptr, COFS_BLOCK_SIZE);
+        int ret = layer0_writeBuffer(buf);
+        layer0_putBuffer(buf);
+        return ret;
+}
+
 // gets the new head of the free list after we've used up the old one
 void __update_head(void)
 {
         blkref new_head = head_ptr->next;
         sblock_incore.flist_head = new_head;
+        if (new_head == 0)
+                sblock_incore.flist_tail = tail_idx = 0; // the list is empty now
         update_superblock();
         list_head_blkidx = new_head;
         layer0_readBlock(new_head, head_ptr);
 }
 
-block_reference FreeList_pop(void)
+/* takes the next free block off the list: an entry of the head block, or once
+ * those are used up the head block itself. Only the in-core head is changed;
+ * `*head_dirty` is set if it has to be written back, and cleared again if the
+ * head block was handed out.
+ */
+static blkref __take(bool *head_dirty)
 {
         if (list_head_blkidx == 0)
                 return 0; // No more free blocks available
@@ -110,12 +189,8 @@ block_reference FreeList_pop(void)
         for (next_freeslot += 1; next_freeslot < ENTRIES_PER_FREEBLOCK; next_freeslot++) {
                 blkref cand;
                 if ((cand = list_head.data[next_freeslot]) != 0) {
-                        // zero out the block on-disk
-                        if (layer0_writeBlock(cand, ZERO_BLOCK) == -1)
-                                return false;
                         list_head.data[next_freeslot] = 0;
-                        layer0_writeBlock(list_head_blkidx, head_ptr);
-                        --sblock_incore.free_blocks;
+                        *head_dirty = true;
                         return cand;
                 }
         }
@@ -123,77 +198,328 @@ block_reference FreeList_pop(void)
         next_freeslot = SIZE_MAX;
         blkref ret = list_head_blkidx;
         __update_head();
-        // zero out the block on-disk
-        if (ret != 0 && layer0_writeBlock(ret, ZERO_BLOCK) == -1)
-                return 0;
-        --sblock_incore.free_blocks;
+        *head_dirty = false;
         return ret;
 }
 
-// update's the list's tail block's `next` pointer to reference the new_tail block
-void __update_tail(blkref new_tail)
+static size_t __popMany(block_reference goal, block_reference blocks[], size_t count)
 {
-	if (list_head.next == 0)
-                list_head.next = new_tail;
+        if (sblock_incore.allocator == COFS_ALLOC_BITMAP)
+                return FreeBitmap_popMany(goal, blocks, count);
 
-	list_node old_tail;
-        MALIGN_CHECK(old_tail, sizeof(struct freelist_block));
+        /* the list can't be searched, but consecutive entries in a list block
+         * are often consecutive blocks (they start out that way at mkfs), so
+         * taking them in order keeps those runs together
+         */
+        (void) goal;
+        bool head_dirty = false;
+        size_t n;
+        for (n = 0; n < count && (blocks[n] = __take(&head_dirty)) != 0; n++)
+                ;
+
+        if (head_dirty)
+                __write_head();
+        sblock_incore.free_blocks -= n;
+        return n;
+}
+
+/* links the list block `new_first` on after the current tail, and records
+ * `new_last` (the end of the chain starting at `new_first`) as the new tail.
+ * The tail is kept in the superblock, so this costs one block update and no
+ * walk of the list, even right after mounting.
+ * @return `false` if the chain could not be linked in, in which case nothing
+ *      links to it and the list is as it was
+ */
+static bool __append_chain(blkref new_first, blkref new_last)
+{
         if (tail_idx == 0) {
-                // find the list's tail if we don't know it already
-                old_tail->next = list_head_blkidx;
+                // filesystems made before the tail was kept: find it once. The walk
+                // reads around the buffer cache so it doesn't push everything else out.
+                list_node node;
+                MALIGN_CHECK(node, sizeof(struct freelist_block));
+                if (node == NULL)
+                        return false;
+
+                node->next = list_head_blkidx;
                 do {
-                        tail_idx = old_tail->next;
-                        assert(layer0_readBlock(tail_idx, old_tail) == 0);
-                } while (old_tail->next != 0);
-        } else {
-                layer0_readBlock(tail_idx, old_tail);
+                        tail_idx = node->next;
+                        if (layer0_readBlock(tail_idx, node) != 0) {
+                                tail_idx = 0;
+                                free(node);
+                                return false;
+                        }
+                } while (node->next != 0);
+                free(node);
+        }
+
+        layer0_buffer *tail_buf = layer0_getBuffer(tail_idx);
+        if (tail_buf == NULL)
+                return false;
+
+        // if we went down before the superblock caught up, the real tail is a little further on
+        while (((list_node) tail_buf->data)->next != 0) {
+                tail_idx = ((list_node) tail_buf->data)->next;
+                layer0_putBuffer(tail_buf);
+                if ((tail_buf = layer0_getBuffer(tail_idx)) == NULL)
+                        return false;
+        }
+
+        // the new blocks are already on disk, so link them in, then move the tail
+        ((list_node) tail_buf->data)->next = new_first;
+        if (layer0_writeBuffer(tail_buf) != 0) {
+                ((list_node) tail_buf->data)->next = 0;
+                layer0_putBuffer(tail_buf);
+                return false;
+        }
+        layer0_putBuffer(tail_buf);
+
+        if (list_head.next == 0)
+                list_head.next = new_first;
+        sblock_incore.flist_tail = tail_idx = new_last;
+        update_superblock();
+        return true;
+}
+
+/* turns `blocks` into new list blocks, each the first of a run of
+ * ENTRIES_PER_FREEBLOCK + 1 and holding the rest, linked in the order given
+ */
+static bool __write_nodes(const blkref blocks[], size_t count)
+{
+        size_t n_nodes = intdiv_ceil(count, ENTRIES_PER_FREEBLOCK + 1);
+        if (n_nodes > CREATE_BATCH)
+                n_nodes = CREATE_BATCH;
+
+        list_node nodes;
+        MALIGN_CHECK(nodes, n_nodes * sizeof(struct freelist_block));
+        struct layer0_iovec iov[CREATE_BATCH];
+        bool ret = true;
+
+        for (size_t i = 0; i < count && ret; ) {
+                size_t n;
+                for (n = 0; n < CREATE_BATCH && i < count; n++) {
+                        size_t entries = count - i - 1;
+                        if (entries > ENTRIES_PER_FREEBLOCK)
+                                entries = ENTRIES_PER_FREEBLOCK;
+
+                        // fill from the end, like FreeList_create() does the first block
+                        memset(&nodes[n], 0, sizeof(struct freelist_block));
+                        iov[n].bnum = blocks[i++];
+                        iov[n].buf = &nodes[n];
+                        for (size_t e = ENTRIES_PER_FREEBLOCK - entries; e < ENTRIES_PER_FREEBLOCK; e++) {
+                                nodes[n].data[e] = blocks[i];
+                                // nothing is stored in the block itself, so its storage can go
+                                layer0_discard(blocks[i++]);
+                        }
+                        nodes[n].next = i < count ? blocks[i] : 0;
+                }
+
+                ret = layer0_writev(iov, n) == 0;
         }
 
-        old_tail->next = new_tail;
-        layer0_writeBlock(tail_idx, old_tail);
+        free(nodes);
+        return ret;
+}
+
+static size_t __appendMany(const block_reference blocks[], size_t count)
+{
+        if (sblock_incore.allocator == COFS_ALLOC_BITMAP)
+                return FreeBitmap_appendMany(blocks, count);
+
+        size_t valid;
+        for (valid = 0; valid < count; valid++)
+                if (blocks[valid] >= NUM_BLOCKS || blocks[valid] <= sblock_incore.ilist_size)
+                        break;
+
+        // fill the open slots on the current list head's data first, then write it back once
+        size_t done = 0;
+        if (list_head_blkidx != 0) {
+                for (; done < valid && next_freeslot != SIZE_MAX; next_freeslot--) {
+                        if (list_head.data[next_freeslot] == 0) {
+                                list_head.data[next_freeslot] = blocks[done];
+                                layer0_discard(blocks[done++]);
+                        }
+                }
+
+                if (done > 0)
+                        __write_head();
+                sblock_incore.free_blocks += done;
+        }
+
+        if (done == valid)
+                return done;
+
+        // the rest become new list blocks, chained together and then onto the tail
+        if (!__write_nodes(blocks + done, valid - done))
+                return done;
+
+        blkref last_node = blocks[done + (valid - done - 1) / (ENTRIES_PER_FREEBLOCK + 1) * (ENTRIES_PER_FREEBLOCK + 1)];
+        if (list_head_blkidx == 0) {
+                // the list was empty, so the first of them is its new head
+                sblock_incore.flist_tail = tail_idx = last_node;
+                list_head.next = blocks[done];
+                __update_head();
+                next_freeslot = ENTRIES_PER_FREEBLOCK - 1;
+                while (next_freeslot != SIZE_MAX && list_head.data[next_freeslot] != 0)
+                        --next_freeslot;
+        } else if (!__append_chain(blocks[done], last_node)) {
+                // the new list blocks are written but unreachable, so none of them is free
+                return done;
+        }
+
+        sblock_incore.free_blocks += valid - done;
+        return valid;
+}
+
+block_reference FreeList_pop(void)
+{
+        block_reference block;
+        pthread_mutex_lock(&flist_lock);
+        if (sblock_incore.allocator == COFS_ALLOC_BITMAP)
+                block = FreeBitmap_pop();
+        else if (__popMany(0, &block, 1) != 1)
+                block = 0;
+        pthread_mutex_unlock(&flist_lock);
+        return block;
+}
 
-        tail_idx = new_tail;
-        free(old_tail);
+size_t FreeList_popMany(block_reference goal, block_reference blocks[], size_t count)
+{
+        pthread_mutex_lock(&flist_lock);
+        size_t n = __popMany(goal, blocks, count);
+        pthread_mutex_unlock(&flist_lock);
+        return n;
 }
 
 bool FreeList_append(block_reference block_index)
 {
-        if (block_index >= NUM_BLOCKS || block_index <= sblock_incore.ilist_size)
-                return false;
-	
-	// handle case for empty list
-	if (list_head_blkidx == 0) {
-                memcpy(head_ptr, ZERO_BLOCK, COFS_BLOCK_SIZE);
-		list_head.next = block_index;
-		__update_head();
-                ++sblock_incore.free_blocks;
-		return true;
-	}
-
-        // check if there are any open slots on the current list head's data
-        for (; next_freeslot != SIZE_MAX; next_freeslot--) {
-                if (list_head.data[next_freeslot] == 0) {
-                        list_head.data[next_freeslot--] = block_index;
-                        layer0_writeBlock(list_head_blkidx, head_ptr);
-                        ++sblock_incore.free_blocks;
-                        return true;
+        bool ret;
+        pthread_mutex_lock(&flist_lock);
+        if (sblock_incore.allocator == COFS_ALLOC_BITMAP)
+                ret = FreeBitmap_append(block_index);
+        else
+                ret = __appendMany(&block_index, 1) == 1;
+        pthread_mutex_unlock(&flist_lock);
+        return ret;
+}
+
+size_t FreeList_appendMany(const block_reference blocks[], size_t count)
+{
+        pthread_mutex_lock(&flist_lock);
+        size_t n = __appendMany(blocks, count);
+        pthread_mutex_unlock(&flist_lock);
+        return n;
+}
+
+static struct magazine *__get_magazine(void)
+{
+        if (my_magazine != NULL)
+                return my_magazine;
+
+        struct magazine *m = calloc(1, sizeof(struct magazine));
+        if (m == NULL)
+                return NULL;
+
+        pthread_mutex_init(&m->lock, NULL);
+        // magazines are never freed, so the list can be walked once a pointer to it is read
+        pthread_mutex_lock(&flist_lock);
+        m->next = magazines;
+        magazines = m;
+        pthread_mutex_unlock(&flist_lock);
+        return my_magazine = m;
+}
+
+// hands the bottom `count` blocks of `m` back to the shared allocator; `m` is locked
+static bool __drain(struct magazine *m, size_t count)
+{
+        // a block the allocator refuses (already free, or its write failed) is
+        // dropped, so it can't sit at the bottom and stop every later drain
+        bool ret = true;
+        pthread_mutex_lock(&flist_lock);
+        for (size_t done = 0; done < count; done++) {
+                done += __appendMany(m->blocks + done, count - done);
+                if (done < count) {
+                        PRINT_ERR("magazine: cannot free block %zu\n", m->blocks[done]);
+                        ret = false;
                 }
         }
+        pthread_mutex_unlock(&flist_lock);
 
-        next_freeslot = SIZE_MAX;
-        // if not, create a new free list block (using the block we're trying to append)
-        // and update the old tail
-        list_node new_tail;
-        MALIGN_CHECK(new_tail, sizeof(struct freelist_block));
-        memset(new_tail, 0, sizeof(struct freelist_block));
-        __update_tail(block_index);
-        bool ret = layer0_writeBlock(block_index, new_tail) != -1;
-        free(new_tail);
-        if (ret)
-                ++sblock_incore.free_blocks;
+        memmove(m->blocks, m->blocks + count, (m->n - count) * sizeof(blkref));
+        m->n -= count;
         return ret;
 }
 
+block_reference FreeList_popLocal(block_reference goal)
+{
+        struct magazine *m = __get_magazine();
+        if (m == NULL)
+                return FreeList_pop();
+
+        pthread_mutex_lock(&m->lock);
+        if (m->n == 0) {
+                blkref batch[MAGAZINE_SIZE / 2];
+                pthread_mutex_lock(&flist_lock);
+                size_t n = __popMany(goal, batch, MAGAZINE_SIZE / 2);
+                pthread_mutex_unlock(&flist_lock);
+
+                // lowest on top, so a run comes back out in order
+                for (size_t i = 0; i < n; i++)
+                        m->blocks[i] = batch[n - 1 - i];
+                m->n = n;
+        }
+
+        blkref block = m->n > 0 ? m->blocks[--m->n] : 0;
+        pthread_mutex_unlock(&m->lock);
+        return block;
+}
+
+bool FreeList_appendLocal(block_reference block_index)
+{
+        if (block_index >= NUM_BLOCKS || block_index < __first_data_block())
+                return false;
+
+        struct magazine *m = __get_magazine();
+        if (m == NULL)
+                return FreeList_append(block_index);
+
+        pthread_mutex_lock(&m->lock);
+        if (m->n == MAGAZINE_SIZE)
+                __drain(m, MAGAZINE_SIZE / 2);
+
+        m->blocks[m->n++] = block_index;
+        pthread_mutex_unlock(&m->lock);
+        return true;
+}
+
+bool FreeList_drainMagazines(void)
+{
+        pthread_mutex_lock(&flist_lock);
+        struct magazine *first = magazines;
+        pthread_mutex_unlock(&flist_lock);
+
+        bool ret = true;
+        for (struct magazine *m = first; m != NULL; m = m->next) {
+                pthread_mutex_lock(&m->lock);
+                ret = __drain(m, m->n) && ret;
+                pthread_mutex_unlock(&m->lock);
+        }
+
+        return ret;
+}
+
+size_t FreeList_parkedBlocks(void)
+{
+        pthread_mutex_lock(&flist_lock);
+        struct magazine *first = magazines;
+        pthread_mutex_unlock(&flist_lock);
+
+        size_t n = 0;
+        for (struct magazine *m = first; m != NULL; m = m->next)
+                n += __atomic_load_n(&m->n, __ATOMIC_RELAXED);
+
+        return n;
+}
+
 // comparison function for qsort() that will give us an ascending order
 int __blkref_comp(const void *a, const void *b)
 {
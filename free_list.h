@@ -10,12 +10,16 @@
  * Creates the Free List for data blocks. Should only be called by mkfs.
  * @param n_data_blocks Total number of data blocks in the FS
  * @param head Initial head of the free list
+ * @note Sets `flist_head` and `flist_tail` in `sblock_incore`; writing the
+ *      superblock out is left to the caller
  */
 bool FreeList_create(size_t n_data_blocks, block_reference head);
 
 /**
  * Initializes the Free List interface. Should be called as part of the mount
- * process for an existing FS.
+ * process for an existing FS. This and the pop/append calls below go to the
+ * free-space bitmap (free_bitmap.h) instead on filesystems made with one.
+ * The list's tail is taken from `sblock_incore.flist_tail`.
  * @param head The head of the free list
  * @return `true` on success, else `false`
  */
@@ -24,9 +28,25 @@ bool FreeList_init(block_reference head);
 /**
  * Removes the next free block in the free list.
  * @return The index of the removed block
+ * @note The block is not zeroed: it holds whatever it held when it was freed,
+ *      so the caller has to fill in every part of it that will be read back
  */
 block_reference FreeList_pop(void);
 
+/**
+ * Removes up to `count` free blocks at once. The list's head block is written
+ * back once for the whole call rather than once per block.
+ * @param goal Where the blocks should preferably start, e.g. just past the
+ *             last block of the file being extended, or 0 for anywhere. Only
+ *             the bitmap can act on it; it hands out contiguous runs from there.
+ * @param blocks Receives the indices of the removed blocks
+ * @param count The number of blocks wanted
+ * @return The number of blocks removed, less than `count` only if the FS ran
+ *         out of free blocks
+ * @note As with `FreeList_pop()`, the blocks are not zeroed
+ */
+size_t FreeList_popMany(block_reference goal, block_reference blocks[], size_t count);
+
 /**
  * Adds the specified block to the free list
  * @param blk - The block number to add to the list
@@ -34,6 +54,53 @@ block_reference FreeList_pop(void);
  */
 bool FreeList_append(block_reference block_index);
 
+/**
+ * Adds every block in `blocks` to the free list. The open slots of the head
+ * block are filled first, and it is written back once; the rest become new
+ * list blocks of their own, which are written out together and linked onto the
+ * tail with a single update.
+ * @param blocks The block numbers to add
+ * @param count The number of entries in `blocks`
+ * @return The number of blocks added, from the start of `blocks`. Less than
+ *         `count` if an invalid block was found or a write failed.
+ */
+size_t FreeList_appendMany(const block_reference blocks[], size_t count);
+
+/**
+ * Takes a free block from the calling thread's magazine, refilling it from the
+ * free list with a batch of blocks if it is empty. For paths that allocate a
+ * lot, since threads only contend with each other on refills.
+ * @param goal Passed on to `FreeList_popMany()` when the magazine is refilled
+ * @return The index of the block, else 0 if there are no free blocks left
+ * @note As with `FreeList_pop()`, the block is not zeroed
+ */
+block_reference FreeList_popLocal(block_reference goal);
+
+/**
+ * Puts a freed block in the calling thread's magazine, for `FreeList_popLocal()`
+ * to hand out again. Half of the magazine goes back to the free list in one
+ * batch whenever it fills up.
+ * @param block_index The block number to free
+ * @return `true` on success, else `false` if it isn't a data block
+ */
+bool FreeList_appendLocal(block_reference block_index);
+
+/**
+ * Returns the blocks in every thread's magazine to the free list. Until this is
+ * done they are neither free on disk nor owned by a file, so it should be
+ * called before the free counts are written, and when unmounting.
+ * @return `true` if every block went back, else `false` (blocks the free list
+ *      refused were dropped from their magazine all the same)
+ */
+bool FreeList_drainMagazines(void);
+
+/**
+ * Counts the blocks sitting in threads' magazines, which `free_blocks` leaves
+ * out until they are drained. A snapshot: threads may be refilling or draining
+ * their magazines while it is taken.
+ */
+size_t FreeList_parkedBlocks(void);
+
 /**
  * Verifies the integrity of the Free List a. la. `fsck(8)`
  * @param head The head of the free list stored in the superblock
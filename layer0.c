@@ -1,18 +1,20 @@
 /* layer0.c - COFS layer 0 implementation
  *
+ * The actual block transfers are done by one of the I/O engines declared in
+ * layer0_backend.h; this file selects the engine and bounds-checks requests.
  */
 
 #include "layer0.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-#include <unistd.h>
-#include <fcntl.h>
 #include <errno.h>
-#include <sys/mman.h>
-#include <sys/ioctl.h>
-#include <linux/fs.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "cofs_parameters.h"
 #include "cofs_util.h"
@@ -20,103 +22,260 @@
 #include "cofs_data_structures.h"
 #include "superblock.h"
 #include "cofs_errno.h"
+#include "layer0_backend.h"
+
+struct layer0_options layer0_opts = {
+        .backend = LAYER0_BACKEND_MMAP,
+        .readahead_blocks = 256,
+        .cache_mb = 16,
+};
 
-static volatile unsigned char *backing;
+static const layer0_backend *const backends[] = {
+        [LAYER0_BACKEND_MMAP] = &layer0_mmap_backend,
+        [LAYER0_BACKEND_PIO] = &layer0_pio_backend,
+        [LAYER0_BACKEND_URING] = &layer0_uring_backend,
+};
+
+// mkfs.cofs calls layer0_mapBlkdev() directly without going through
+// layer0_init(), so default to the mmap engine
+static const layer0_backend *backend = &layer0_mmap_backend;
 
 static size_t unmap_size = 0;
 
+// whether we are running an in-memory filesystem (the only kind we snapshot)
+static bool in_memory = false;
+
 size_t NUM_BLOCKS = 0;
 
-// initialize layer 0 using memory
-static void * __init_use_mem(size_t memsize)
+bool layer0_setBackend(const char *name)
 {
-        void *buf = mmap(NULL, memsize, PROT_WRITE | PROT_READ,
-                          MAP_ANON | MAP_PRIVATE, 0, 0);
+        for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+                if (strcmp(backends[i]->name, name) == 0) {
+                        layer0_opts.backend = i;
+                        return true;
+                }
+        }
 
-        if (buf == MAP_FAILED) {
-                PRINT_ERR("Cannot allocate in-memory filesystem: %s\n",
-                          strerror(errno));
-                return NULL;
+        return false;
+}
+
+bool layer0_setWriteback(const char *spec)
+{
+        if (strcmp(spec, "sync") == 0) {
+                layer0_opts.writeback = LAYER0_WRITEBACK_SYNC;
+        } else if (strcmp(spec, "on-fsync") == 0) {
+                layer0_opts.writeback = LAYER0_WRITEBACK_ON_FSYNC;
+        } else if (strncmp(spec, "interval=", 9) == 0) {
+                char *end;
+                unsigned long ms = strtoul(spec + 9, &end, 10);
+                if (spec[9] == '\0' || *end != '\0' || ms == 0 || ms > UINT_MAX)
+                        return false;
+
+                layer0_opts.writeback = LAYER0_WRITEBACK_INTERVAL;
+                layer0_opts.writeback_interval_ms = ms;
+        } else {
+                return false;
         }
 
-//        void *buf = aligned_alloc(COFS_BLOCK_SIZE, memsize);
+        return true;
+}
 
-        unmap_size = memsize;
-        backing = buf;
+bool layer0_setHugepages(const char *name)
+{
+        static const char *const modes[] = {
+                [LAYER0_HUGEPAGES_NONE] = "none",
+                [LAYER0_HUGEPAGES_THP] = "thp",
+                [LAYER0_HUGEPAGES_HUGETLB] = "hugetlb",
+        };
+
+        for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+                if (strcmp(modes[i], name) == 0) {
+                        layer0_opts.hugepages = i;
+                        return true;
+                }
+        }
 
-        if (!mkfs(memsize)) {
-                PRINT_ERR("mkfs.cofs failed for in-memory filesystem\n");
-                return NULL;
+        return false;
+}
+
+bool layer0_createImage(const char *path, size_t size)
+{
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+                PRINT_ERR("Cannot create image %s: %s\n", path, strerror(errno));
+                return false;
+        }
+
+        struct stat st;
+        bool ret = fstat(fd, &st) == 0;
+        if (ret && !S_ISREG(st.st_mode)) {
+                PRINT_ERR("%s is not a regular file\n", path);
+                ret = false;
+        } else if (ret && (size_t) st.st_size < size) {
+                // the new space is a hole, so the image only takes up what we write
+                ret = ftruncate(fd, size) == 0;
+                if (!ret)
+                        PRINT_ERR("Cannot grow image %s: %s\n", path, strerror(errno));
         }
 
-        return buf;
+        return close(fd) == 0 && ret;
 }
 
-// initialize layer 0 using the path to a block device
-// We can change this later... but it feels cleaner to me than using lseek/read/write
-void *layer0_mapBlkdev(const char *path, size_t *size)
+// initialize layer 0 from a saved in-memory filesystem
+static bool __init_use_snapshot(const char *path)
 {
-        int fdd = open(path, O_RDWR | O_NONBLOCK);
-        if (fdd < 0) {
-                PRINT_ERR("Cannot open block device: %s\n",
-                          strerror(errno));
-                return NULL;
+        ssize_t size = snapshot_size(path);
+        if (size < 0)
+                return false;
+
+        if (layer0_opts.load_cow) {
+                if (backend->open_cow) {
+                        if (!backend->open_cow(path, size))
+                                return false;
+
+                        unmap_size = size;
+                        return true;
+                }
+
+                PRINT_ERR("Copy-on-write images need the mmap engine; reading it in instead\n");
         }
 
-        uint64_t blkdev_size = 0;
-        ioctl(fdd, BLKGETSIZE64, &blkdev_size);
+        if (!backend->open_mem(size)) {
+                PRINT_ERR("Cannot allocate in-memory filesystem: %s\n",
+                          strerror(errno));
+                return false;
+        }
 
-        PRINT_DBG("Loading block device %s with size %zu\n", path, *size);
+        unmap_size = size;
+        NUM_BLOCKS = unmap_size / COFS_BLOCK_SIZE;
+        return snapshot_load(path, NUM_BLOCKS);
+}
 
-        void *buf = mmap(NULL, blkdev_size, PROT_READ | PROT_WRITE,
-                MAP_FILE | MAP_SHARED, fdd, 0);
+// initialize layer 0 using memory
+static bool __init_use_mem(size_t memsize)
+{
+        if ((layer0_opts.hugepages != LAYER0_HUGEPAGES_NONE || layer0_opts.populate)
+            && backend != &layer0_mmap_backend)
+        {
+                PRINT_ERR("Huge pages and pre-faulting need the mmap engine; ignoring\n");
+        }
 
-        close(fdd);
+        if (layer0_opts.load_image)
+                return __init_use_snapshot(layer0_opts.load_image);
 
-        if (buf == MAP_FAILED) {
-                PRINT_ERR("Cannot map block device: %s\n",
+        if (!backend->open_mem(memsize)) {
+                PRINT_ERR("Cannot allocate in-memory filesystem: %s\n",
                           strerror(errno));
-                return NULL;
+                return false;
         }
 
-        // touch all of the pages so that we can access them later
-//        for (size_t offset = 0; offset < blkdev_size; offset += sysconf(_SC_PAGESIZE)) {
-//                volatile unsigned char a = *(volatile unsigned char *) (backing + offset);
-//        }
+        unmap_size = memsize;
 
-        unmap_size = blkdev_size;
-        *size = blkdev_size;
+        if (!mkfs(memsize)) {
+                PRINT_ERR("mkfs.cofs failed for in-memory filesystem\n");
+                return false;
+        }
 
-        backing = buf;
+        return true;
+}
+
+// initialize layer 0 using the path to a block device
+static bool __init_use_blkdev(const char *path)
+{
+        size_t size;
+        if (!backend->open(path, &size))
+                return false;
 
-        return buf;
+        unmap_size = size;
+        return true;
 }
 
 bool layer0_init(const char *blkdev, size_t memsize)
 {
-        backing = blkdev ? layer0_mapBlkdev(blkdev, &memsize)
+        backend = backends[layer0_opts.backend];
+        if (layer0_opts.direct && blkdev && backend == &layer0_mmap_backend) {
+                PRINT_DBG("Direct I/O cannot be used with a mapping; switching to pio\n");
+                backend = &layer0_pio_backend;
+        }
+        PRINT_DBG("Using layer 0 engine '%s'\n", backend->name);
+
+        bool ok = blkdev ? __init_use_blkdev(blkdev)
                          : __init_use_mem(memsize);
 
         NUM_BLOCKS = unmap_size / COFS_BLOCK_SIZE;
 
-        if (backing == NULL)
+        if (!ok || !writeback_init(backend, NUM_BLOCKS))
                 return false;
 
-        return layer0_readBlock(0, &sblock_incore) == 0;
+        in_memory = blkdev == NULL;
+
+        if (layer0_readBlock(0, &sblock_incore) == -1)
+                return false;
+
+        // images come from outside, so make sure this one at least looks like ours
+        if (layer0_opts.load_image && !blkdev
+            && (sblock_incore.n_blocks == 0 || sblock_incore.n_blocks > NUM_BLOCKS))
+        {
+                PRINT_ERR("%s does not contain a COFS filesystem\n", layer0_opts.load_image);
+                return false;
+        }
+
+        return true;
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored  "-Wdiscarded-qualifiers"
 bool layer0_teardown(void)
 {
-        if (unmap_size) {
-                // mmap(2) man page indicates that changes may not be committed before munmap()
-                // call unless we cal msync()
-                msync(backing, unmap_size, MS_SYNC);
-                munmap(backing, unmap_size);
+        writeback_stopFlusher();
+        bool ret = cache_teardown();
+        ret = writeback_teardown() && ret;
+
+        if (in_memory && layer0_opts.save_image && unmap_size != 0)
+                ret = snapshot_save(layer0_opts.save_image, NUM_BLOCKS) && ret;
+
+        ret = backend->teardown() && ret;
+        unmap_size = 0;
+        in_memory = false;
+        return ret;
+}
+
+bool layer0_flush(void)
+{
+        if (unmap_size == 0)
+                return true;
+
+        if (!cache_flush())
+                return false;
+
+        if (layer0_opts.writeback != LAYER0_WRITEBACK_SYNC)
+                return writeback_flush();
+
+        // nothing is tracked in sync mode, so flush the whole store
+        return backend->flush == NULL || backend->flush(0, NUM_BLOCKS) == 0;
+}
+
+void layer0_readahead(block_reference first, size_t count)
+{
+        if (backend->readahead == NULL || first >= NUM_BLOCKS)
+                return;
+
+        if (count > NUM_BLOCKS - first)
+                count = NUM_BLOCKS - first;
+
+        backend->readahead(first, count);
+}
+
+int layer0_discard(block_reference bnum)
+{
+        if (!layer0_opts.discard || backend->discard == NULL)
+                return 0;
+
+        if (bnum >= NUM_BLOCKS) {
+                cofs_errno = EIO;
+                return -1;
         }
 
-        return true;
+        cache_drop(bnum);
+        return backend->discard(bnum, 1);
 }
 
 int layer0_writeBlock(block_reference bnum, const void *buf) {
@@ -125,11 +284,11 @@ int layer0_writeBlock(block_reference bnum, const void *buf) {
         return -1;
     }
 
-    unsigned char *dest = backing + (bnum * COFS_BLOCK_SIZE);
-
-    memcpy(dest, buf, COFS_BLOCK_SIZE);
-    msync(dest, COFS_BLOCK_SIZE, MS_ASYNC);
+    if (backend->write(bnum, buf) == -1)
+        return -1;
 
+    cache_update(bnum, buf);
+    writeback_markBlockDirty(bnum);
     return 0;
 }
 
@@ -139,20 +298,160 @@ int layer0_readBlock(block_reference bnum, void *buf) {
         return -1;
     }
 
-    memcpy(buf, backing + (bnum * COFS_BLOCK_SIZE), COFS_BLOCK_SIZE);
-    return 0;
+    if (cache_read(bnum, buf))
+        return 0;
+
+    return backend->read(bnum, buf);
 }
-#pragma GCC diagnostic pop
 
-// FOR TESTING ONLY!!
-size_t getsize(void)
+// check a whole batch up front so we never submit half of one
+static bool __iov_in_bounds(const struct layer0_iovec iov[], size_t count)
 {
-        return unmap_size;
+        for (size_t i = 0; i < count; i++) {
+                if (iov[i].bnum >= NUM_BLOCKS) {
+                        cofs_errno = EIO;
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+size_t layer0_contiguousRun(const struct layer0_iovec iov[], size_t count, size_t max)
+{
+        size_t n = 1;
+        while (n < count && n < max && iov[n].bnum == iov[n - 1].bnum + 1)
+                ++n;
+
+        return n;
 }
 
-#ifdef DEBUG
+int layer0_engineWritev(const struct layer0_iovec iov[], size_t count)
+{
+        if (!__iov_in_bounds(iov, count))
+                return -1;
+
+        int ret = 0;
+        if (backend->writev) {
+                ret = backend->writev(iov, count);
+        } else {
+                for (size_t i = 0; i < count && ret == 0; i++)
+                        ret = backend->write(iov[i].bnum, iov[i].buf);
+        }
+
+        // mark even on failure: some of the blocks may have made it
+        writeback_markDirty(iov, count);
+        return ret;
+}
 
-volatile unsigned char *getmembase(void)
-{ return backing; }
+int layer0_engineReadv(const struct layer0_iovec iov[], size_t count)
+{
+        if (!__iov_in_bounds(iov, count))
+                return -1;
+
+        if (backend->readv)
+                return backend->readv(iov, count);
+
+        for (size_t i = 0; i < count; i++) {
+                if (backend->read(iov[i].bnum, iov[i].buf) == -1)
+                        return -1;
+        }
+
+        return 0;
+}
+
+int layer0_writev(const struct layer0_iovec iov[], size_t count)
+{
+        int ret = layer0_engineWritev(iov, count);
+
+        // after a failure we can't tell which blocks made it, so forget them
+        for (size_t i = 0; i < count; i++) {
+                if (ret == 0)
+                        cache_update(iov[i].bnum, iov[i].buf);
+                else
+                        cache_drop(iov[i].bnum);
+        }
 
-#endif
+        return ret;
+}
+
+int layer0_readv(const struct layer0_iovec iov[], size_t count)
+{
+        if (!__iov_in_bounds(iov, count))
+                return -1;
+
+        size_t i = 0;
+        while (i < count && !cache_read(iov[i].bnum, iov[i].buf))
+                ++i;
+
+        if (i == count)
+                return layer0_engineReadv(iov, count);
+
+        // some blocks were served out of the buffer cache; only read the rest
+        struct layer0_iovec *misses = malloc(count * sizeof(struct layer0_iovec));
+        if (misses == NULL) {
+                cofs_errno = ENOMEM;
+                return -1;
+        }
+
+        memcpy(misses, iov, i * sizeof(struct layer0_iovec));
+        size_t n_misses = i;
+        for (++i; i < count; i++) {
+                if (!cache_read(iov[i].bnum, iov[i].buf))
+                        misses[n_misses++] = iov[i];
+        }
+
+        int ret = n_misses == 0 ? 0 : layer0_engineReadv(misses, n_misses);
+        free(misses);
+        return ret;
+}
+
+const void *layer0_getBlockPtr(block_reference bnum)
+{
+        if (bnum >= NUM_BLOCKS) {
+                cofs_errno = EIO;
+                return NULL;
+        }
+
+        // a cached copy may be newer than the image
+        const void *cached = cache_borrow(bnum);
+        if (cached != NULL)
+                return cached;
+
+        if (backend->get_ptr)
+                return backend->get_ptr(bnum);
+
+        void *copy = aligned_alloc(COFS_BLOCK_SIZE, COFS_BLOCK_SIZE);
+        if (copy == NULL) {
+                cofs_errno = ENOMEM;
+                return NULL;
+        }
+
+        if (layer0_readBlock(bnum, copy) == -1) {
+                free(copy);
+                return NULL;
+        }
+
+        return copy;
+}
+
+void layer0_putBlockPtr(const void *ptr)
+{
+        if (cache_unborrow(ptr))
+                return;
+
+        // borrowed views into the image need no cleanup; private copies are ours to free
+        if (backend->get_ptr == NULL)
+                free((void *) ptr);
+}
+
+bool layer0_isZeroCopy(void)
+{
+        return backend->get_ptr != NULL;
+}
+
+// FOR TESTING ONLY!!
+size_t getsize(void)
+{
+        return unmap_size;
+}
@@ -8,19 +8,108 @@
 #include "cofs_parameters.h"
 #include "cofs_data_structures.h"
 
+/* I/O engines available for accessing the backing store */
+typedef enum {
+        LAYER0_BACKEND_MMAP = 0,        /* memcpy against an mmap of the device */
+        LAYER0_BACKEND_PIO,             /* pread(2)/pwrite(2) against the device */
+        LAYER0_BACKEND_URING,           /* io_uring, with batched submission */
+} layer0_backend_type;
+
+/* When blocks written through layer 0 are pushed out to the backing store */
+typedef enum {
+        LAYER0_WRITEBACK_SYNC = 0,      /* as each block is written (the engine's own behaviour) */
+        LAYER0_WRITEBACK_INTERVAL,      /* by a background thread every `writeback_interval_ms`
+                                         * (layer 0 blocks only: in-core inodes are synced by
+                                         * layer 1 as it is called, see `mark_inode_dirty()`) */
+        LAYER0_WRITEBACK_ON_FSYNC,      /* only by `layer0_flush()` and `layer0_teardown()` */
+} layer0_writeback_mode;
+
+/* Page size backing an in-memory filesystem (mmap engine only) */
+typedef enum {
+        LAYER0_HUGEPAGES_NONE = 0,      /* regular pages */
+        LAYER0_HUGEPAGES_THP,           /* transparent huge pages, via madvise(MADV_HUGEPAGE) */
+        LAYER0_HUGEPAGES_HUGETLB,       /* reserved huge pages via MAP_HUGETLB, else THP */
+} layer0_hugepage_mode;
+
+/**
+ * Tunables for layer 0. Must be filled in before calling `layer0_init()`;
+ * `layer0_opts` starts out holding the default configuration.
+ */
+struct layer0_options {
+        layer0_backend_type backend;
+        /* open block devices with O_DIRECT, bypassing the host page cache.
+         * Needs a file descriptor engine: implies `pio` if `mmap` was selected.
+         */
+        bool direct;
+        layer0_writeback_mode writeback;
+        unsigned writeback_interval_ms;
+        layer0_hugepage_mode hugepages;
+        /* pre-fault the whole in-memory filesystem at init (MAP_POPULATE) */
+        bool populate;
+        /* start an in-memory filesystem from this image instead of running mkfs */
+        const char *load_image;
+        /* map `load_image` copy-on-write (MAP_PRIVATE) instead of reading it in.
+         * Needs the mmap engine. */
+        bool load_cow;
+        /* save an in-memory filesystem to this image in `layer0_teardown()` */
+        const char *save_image;
+        /* hand freed blocks back to the host (see `layer0_discard()`) */
+        bool discard;
+        /* largest read-ahead window for sequential file reads, in blocks. 0 disables
+         * read-ahead. Defaults to 256 (1 MiB). */
+        unsigned readahead_blocks;
+        /* size of the buffer cache in MiB. 0 disables it, so every buffer is a
+         * private copy. Defaults to 16. */
+        unsigned cache_mb;
+        /* number of independently locked shards the buffer cache is split into,
+         * rounded down to a power of two. 0 picks one per 64 buffers, up to 64. */
+        unsigned cache_shards;
+};
+
+extern struct layer0_options layer0_opts;
+
+/**
+ * Selects the I/O engine by name
+ * @param name One of "mmap", "pio" or "uring"
+ * @return `true` on success, else `false` if `name` is not a known engine
+ */
+bool layer0_setBackend(const char *name);
+
+/**
+ * Selects the writeback policy
+ * @param spec One of "sync", "on-fsync" or "interval=<ms>"
+ * @return `true` on success, else `false` if `spec` is malformed
+ */
+bool layer0_setWriteback(const char *spec);
+
+/**
+ * Selects the page size for in-memory filesystems
+ * @param name One of "none", "thp" or "hugetlb"
+ * @return `true` on success, else `false` if `name` is not a known mode
+ */
+bool layer0_setHugepages(const char *name);
+
 /**
  * Initializes layer 0. Should not be called more than once.
  * @param blkdev Path to the block device containing our filesystem
  * @param memsize Size of memory to allocate for in-core filesystem
  * @note  If `blkdev` is non-NULL, `memsize` is ignored. Likewise,
  *        if `memsize` is non-zero, `blkdev` must be NULL. This policy
- *        should be enforced by the caller.
+ *        should be enforced by the caller. When loading an image
+ *        (`layer0_opts.load_image`), the image's size is used instead.
  * @return `true` on success, else `false`
  */
 bool layer0_init(const char *blkdev, size_t memsize);
 
 /**
- * mmap's the device file at `path` into memory
+ * Creates a sparse regular image file of `size` bytes at `path`, or grows an
+ * existing one to `size` bytes. Existing images are never shrunk.
+ * @return `true` on success, else `false`
+ */
+bool layer0_createImage(const char *path, size_t size);
+
+/**
+ * mmap's the device file (or regular image file) at `path` into memory
  * @param path Path of device to mmap
  * @param size outptr to size of block device (NOT size of filesystem)
  * @return pointer to start of mapped region
@@ -33,6 +122,32 @@ void *layer0_mapBlkdev(const char *path, size_t *size);
  */
 bool layer0_teardown(void);
 
+/**
+ * Forces every block written so far out to the backing store, starting with
+ * the dirty buffers in the buffer cache. With a deferred writeback policy only
+ * the dirty extents are flushed.
+ * @return `true` on success, else `false`
+ */
+bool layer0_flush(void);
+
+/**
+ * Tells layer 0 that the contents of block `bnum` are no longer needed, so its
+ * storage can be returned to the host: a hole is punched in a regular image
+ * file, and in-memory pages are dropped. Does nothing unless
+ * `layer0_opts.discard` is set.
+ * @return -1 on failure, else 0. Failure is harmless; the block is just kept.
+ * @note The block's contents are undefined until it is next written
+ */
+int layer0_discard(block_reference bnum);
+
+/**
+ * Hints that `count` blocks starting at `first` will be read soon, so the engine
+ * can start bringing them in from the device (`madvise(MADV_WILLNEED)` on the
+ * mapping, `posix_fadvise(POSIX_FADV_WILLNEED)` for the fd engines). Purely
+ * advisory: errors are ignored, and blocks past the end are clipped.
+ */
+void layer0_readahead(block_reference first, size_t count);
+
 /**
  * Write `BLOCK_SIZE` bytes from the specified buffer out to the specified disk block
  * @param bnum Disk block number to write
@@ -51,4 +166,123 @@ int layer0_writeBlock(block_reference bnum, const void *buf);
  * @note No bounds checking is done--if the region of memory pointed to by buf
  *      is smaller than 1 disk block, this *will* segfault
  */
-int layer0_readBlock(block_reference bnum, void *buf);
\ No newline at end of file
+int layer0_readBlock(block_reference bnum, void *buf);
+
+/* One block of a vectored transfer: the disk block and the memory it moves to or from */
+struct layer0_iovec {
+        block_reference bnum;
+        void *buf;
+};
+
+/**
+ * Write a list of blocks in one call. Runs of physically contiguous blocks are
+ * coalesced into a single copy/syscall by every engine, and the uring engine
+ * additionally keeps all of the runs in flight at once.
+ * @param iov `iov[i].buf` holds the data for block `iov[i].bnum`
+ * @param count Number of entries in `iov`
+ * @return -1 on failure, else 0. On failure, an unspecified subset of the
+ *      blocks may have been written.
+ * @note Same buffer size caveats as `layer0_writeBlock()`
+ */
+int layer0_writev(const struct layer0_iovec iov[], size_t count);
+
+/**
+ * Read a list of blocks in one call. See `layer0_writev()`
+ * @param iov `iov[i].buf` receives the contents of block `iov[i].bnum`
+ * @param count Number of entries in `iov`
+ * @return -1 on failure, else 0
+ */
+int layer0_readv(const struct layer0_iovec iov[], size_t count);
+
+/**
+ * Borrows a read-only view of disk block `bnum`. Blocks in the buffer cache are
+ * lent out of it. Otherwise, with the mmap engine (including in-memory
+ * filesystems) this points straight into the mapped image and nothing is
+ * copied; other engines read the block into a private buffer.
+ * @param bnum Disk block number to borrow
+ * @return pointer to `COFS_BLOCK_SIZE` bytes of block contents, else NULL on failure
+ * @note Every borrowed pointer must be given back with `layer0_putBlockPtr()`. A
+ *      zero-copy view reflects writes made to the block while it is borrowed.
+ */
+const void *layer0_getBlockPtr(block_reference bnum);
+
+/**
+ * Returns a pointer obtained from `layer0_getBlockPtr()`
+ * @param ptr The borrowed pointer. NULL is ignored.
+ */
+void layer0_putBlockPtr(const void *ptr);
+
+/**
+ * @return `true` if `layer0_getBlockPtr()` hands out pointers into the image
+ *      itself (so borrowing is cheaper than reading), else `false`
+ */
+bool layer0_isZeroCopy(void);
+
+/* A block held in the buffer cache (see `layer0_getBuffer()`) */
+typedef struct layer0_buffer {
+        block_reference bnum;
+        void *data;     /* `COFS_BLOCK_SIZE` bytes, block-aligned */
+} layer0_buffer;
+
+/**
+ * Gets block `bnum` from the buffer cache, reading it in if it isn't resident.
+ * The buffer is pinned, so it stays in the cache and `data` stays valid until
+ * it is released with `layer0_putBuffer()`. The cache holds the blocks that are
+ * used over and over (inode, directory, indirect and free list blocks); file
+ * contents go through `layer0_readvData()`/`layer0_writevData()` instead.
+ * @param bnum Disk block number to get
+ * @return the pinned buffer, else NULL on failure
+ * @note Blocks read or written with the other layer 0 calls stay coherent with
+ *      the cache: cached copies are read from and updated in place.
+ */
+layer0_buffer *layer0_getBuffer(block_reference bnum);
+
+/**
+ * Gets `count` blocks from the buffer cache at once. Whatever isn't resident is
+ * brought in with a single vectored read.
+ * @param bnums Disk block numbers to get
+ * @param bufs receives the pinned buffer for each entry of `bnums`
+ * @return -1 on failure (in which case nothing is left pinned), else 0
+ */
+int layer0_getBuffers(const block_reference bnums[], layer0_buffer *bufs[], size_t count);
+
+/**
+ * Like `layer0_getBuffer()`, but for a block that is about to be overwritten in
+ * full: the old contents are not read in, so the buffer's contents are
+ * undefined until the caller fills them.
+ * @return the pinned buffer, else NULL on failure
+ */
+layer0_buffer *layer0_claimBuffer(block_reference bnum);
+
+/**
+ * Unpins a buffer obtained from `layer0_getBuffer()`. The block stays cached
+ * until it is evicted. NULL is ignored.
+ */
+void layer0_putBuffer(layer0_buffer *buf);
+
+/**
+ * Writes a pinned buffer's contents out to its block after they were changed
+ * in place. Under the `sync' writeback policy this happens right away; under
+ * the deferred policies the buffer is only marked dirty, and is written out
+ * when it is evicted, by `layer0_flush()`/`layer0_teardown()`, or (`interval')
+ * by the background flusher within `writeback_interval_ms`, even when idle.
+ * @return -1 on failure, else 0
+ */
+int layer0_writeBuffer(layer0_buffer *buf);
+
+/**
+ * `layer0_readv()` for file contents. Blocks that weren't resident are kept in
+ * the buffer cache as file data, which is accounted separately from metadata
+ * and can only take a bounded share of the cache, so streaming through a large
+ * file never pushes out the metadata working set. With a zero-copy engine (see
+ * `layer0_isZeroCopy()`) file data is not cached at all.
+ * @return -1 on failure, else 0
+ */
+int layer0_readvData(const struct layer0_iovec iov[], size_t count);
+
+/**
+ * `layer0_writev()` for file contents. The blocks are written through and kept
+ * in the cache as file data, as for `layer0_readvData()`.
+ * @return -1 on failure, else 0
+ */
+int layer0_writevData(const struct layer0_iovec iov[], size_t count);
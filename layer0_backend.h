@@ -0,0 +1,220 @@
+/* layer0_backend.h - COFS Layer 0 I/O engine interface
+ *
+ * Each engine knows how to attach to a backing store and move whole blocks
+ * in and out of it. layer0.c picks one at init time and routes every
+ * `layer0_readBlock()`/`layer0_writeBlock()` call through it. Bounds checking
+ * is done by layer0.c before dispatching, so engines may assume `bnum` is
+ * valid. The block I/O ops can be called from several threads at once (the
+ * FUSE threads and the `interval' writeback flusher), so an engine has to
+ * serialize any state they share itself.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "layer0.h"
+
+typedef struct layer0_backend {
+        const char *name;
+
+        /**
+         * Attaches the engine to the device file at `path`
+         * @param path Path of the device
+         * @param size outptr to size of the device in bytes
+         * @return `true` on success, else `false`
+         */
+        bool (*open)(const char *path, size_t *size);
+
+        /**
+         * Attaches the engine to a fresh, zero-filled in-memory store
+         * @param memsize Size of the store in bytes
+         * @return `true` on success, else `false`
+         */
+        bool (*open_mem)(size_t memsize);
+
+        /**
+         * Attaches the engine to a private, copy-on-write view of the image file
+         * at `path`. Optional: used for `layer0_opts.load_cow` when present.
+         * @param size Size of the image in bytes
+         * @return `true` on success, else `false`
+         */
+        bool (*open_cow)(const char *path, size_t size);
+
+        /* see `layer0_readBlock()` */
+        int (*read)(block_reference bnum, void *buf);
+
+        /* see `layer0_writeBlock()` */
+        int (*write)(block_reference bnum, const void *buf);
+
+        /* see `layer0_readv()`. Optional: if NULL, `read` is called once per block */
+        int (*readv)(const struct layer0_iovec iov[], size_t count);
+
+        /* see `layer0_writev()`. Optional: if NULL, `write` is called once per block */
+        int (*writev)(const struct layer0_iovec iov[], size_t count);
+
+        /* see `layer0_getBlockPtr()`. Optional: only for engines that can hand out
+         * pointers into the image. If NULL, layer0.c reads into a private copy. */
+        const void *(*get_ptr)(block_reference bnum);
+
+        /* see `layer0_readahead()`. Optional. */
+        void (*readahead)(block_reference first, size_t count);
+
+        /**
+         * Hands the storage behind `count` blocks starting at `first` back to the
+         * host (e.g. punches a hole in an image file). Optional and advisory: the
+         * blocks' contents are undefined afterwards until they are next written.
+         * @return -1 on failure, else 0
+         */
+        int (*discard)(block_reference first, size_t count);
+
+        /**
+         * Synchronously writes back `count` blocks starting at `first`. Optional:
+         * engines without it are only flushed by `teardown`.
+         * @return -1 on failure, else 0
+         */
+        int (*flush)(block_reference first, size_t count);
+
+        /**
+         * Flushes any outstanding writes and detaches from the backing store.
+         * Must be safe to call when the engine was never opened.
+         */
+        bool (*teardown)(void);
+} layer0_backend;
+
+extern const layer0_backend layer0_mmap_backend;
+extern const layer0_backend layer0_pio_backend;
+extern const layer0_backend layer0_uring_backend;
+
+/* Helpers shared by the file descriptor based engines (layer0_pio.c) */
+
+/**
+ * Finds the usable size of an open block device or regular image file
+ * @param size outptr to size in bytes
+ * @param is_file outptr set to whether `fd` is a regular file. May be NULL.
+ * @return `true` on success, else `false` if `fd` is neither
+ */
+bool pio_deviceSize(int fd, size_t *size, bool *is_file);
+
+/**
+ * Opens the device file at `path` for reading and writing
+ * @param flags Extra open(2) flags. If O_DIRECT is given, `pio_read()` and
+ *      `pio_write()` bounce misaligned buffers through an aligned one.
+ * @param size outptr to size of the device in bytes
+ * @return file descriptor on success, else -1
+ */
+int pio_openDevice(const char *path, int flags, size_t *size);
+
+/**
+ * Creates an anonymous, zero-filled file of `memsize` bytes
+ * @return file descriptor on success, else -1
+ */
+int pio_openMem(size_t memsize);
+
+/**
+ * Flushes and closes a file opened with `pio_openDevice()`/`pio_openMem()`.
+ * Does nothing if `fd` is negative.
+ * @return `true` on success, else `false`
+ */
+bool pio_close(int fd);
+
+/**
+ * @return `false` if `buf` must be bounced through an aligned buffer before
+ *      being handed to the kernel (i.e. the device is open with O_DIRECT and
+ *      `buf` is not block-aligned), else `true`
+ */
+bool pio_isAligned(const void *buf);
+
+/* Transfers exactly one block, retrying short transfers. -1 on failure, else 0 */
+int pio_read(int fd, block_reference bnum, void *buf);
+int pio_write(int fd, block_reference bnum, const void *buf);
+
+/* Asks the kernel to start reading a range of blocks into the page cache */
+void pio_readahead(int fd, block_reference first, size_t count);
+
+/* Punches a hole over a range of blocks if the file supports it. -1 on failure, else 0 */
+int pio_discard(int fd, block_reference first, size_t count);
+
+/* Makes a range of blocks already handed to the kernel durable. -1 on failure, else 0 */
+int pio_flush(int fd, block_reference first, size_t count);
+
+/* Vectored versions of the above: each run of consecutive blocks is one syscall */
+int pio_readv(int fd, const struct layer0_iovec iov[], size_t count);
+int pio_writev(int fd, const struct layer0_iovec iov[], size_t count);
+
+/**
+ * @return the number of entries at the start of `iov` (at most `max`) that refer
+ *      to consecutive disk blocks and can go out as one transfer
+ */
+size_t layer0_contiguousRun(const struct layer0_iovec iov[], size_t count, size_t max);
+
+/* Dirty block tracking for the deferred writeback policies (layer0_writeback.c) */
+
+/**
+ * Sets up dirty tracking for a store of `n_blocks` blocks according to
+ * `layer0_opts.writeback`, starting the background flusher if needed
+ * @return `true` on success, else `false`
+ */
+bool writeback_init(const layer0_backend *engine, size_t n_blocks);
+
+/* Records that the blocks in `iov` were written. Safe to call from any thread. */
+void writeback_markDirty(const struct layer0_iovec iov[], size_t count);
+void writeback_markBlockDirty(block_reference bnum);
+
+/**
+ * Flushes every dirty extent, merging runs of adjacent dirty blocks into a
+ * single `flush` call
+ * @return `true` on success, else `false`
+ */
+bool writeback_flush(void);
+
+/* Stops the `interval' flusher thread, if it is running. Called before the
+ * buffer cache is torn down, since the flusher also flushes the cache
+ */
+void writeback_stopFlusher(void);
+
+/* Stops the flusher, flushes whatever is still dirty and releases the bitmap */
+bool writeback_teardown(void);
+
+/* Buffer cache (layer0_cache.c) */
+
+/* Copies block `bnum` into `buf` if it is cached. @return `true` on a hit */
+bool cache_read(block_reference bnum, void *buf);
+
+/* Refreshes the cached copy of block `bnum`, if there is one, after it was written from `buf` */
+void cache_update(block_reference bnum, const void *buf);
+
+/* Forgets the cached copy of block `bnum`, if there is one and it isn't pinned */
+void cache_drop(block_reference bnum);
+
+/* Pins block `bnum` if it is cached. @return its contents, else NULL on a miss */
+const void *cache_borrow(block_reference bnum);
+
+/* Unpins a pointer from `cache_borrow()`. @return `false` if `ptr` isn't one */
+bool cache_unborrow(const void *ptr);
+
+/* Writes every dirty buffer out to the engine, in block order. @return `true` on success */
+bool cache_flush(void);
+
+/* Flushes and releases the cache; it is set up again, sized by `layer0_opts`, on next use */
+bool cache_teardown(void);
+
+/**
+ * Block transfers straight to the engine, bypassing the buffer cache. Bounds
+ * are checked and written blocks are marked dirty, as for `layer0_readv()`
+ * and `layer0_writev()`.
+ * @return -1 on failure, else 0
+ */
+int layer0_engineReadv(const struct layer0_iovec iov[], size_t count);
+int layer0_engineWritev(const struct layer0_iovec iov[], size_t count);
+
+/* In-memory filesystem snapshots (layer0_snapshot.c) */
+
+/* @return usable size in bytes of the image at `path`, else -1 if it isn't one */
+ssize_t snapshot_size(const char *path);
+
+/* Fills the (zeroed) store's first `n_blocks` blocks from the image at `path` */
+bool snapshot_load(const char *path, size_t n_blocks);
+
+/* Writes the store's first `n_blocks` blocks out to a sparse image at `path` */
+bool snapshot_save(const char *path, size_t n_blocks);
@@ -0,0 +1,977 @@
+/* layer0_cache.c - COFS buffer cache
+ *
+ * Keeps a fixed pool of `layer0_opts.cache_mb` MiB of blocks in memory, hashed
+ * by block number. Blocks are handed out as pinned buffers that the upper
+ * layers read and modify in place, so hot inode, directory and indirect blocks
+ * stay resident across operations instead of each module keeping (and
+ * constantly replacing) a single cached block.
+ *
+ * Replacement follows 2Q, which keeps one-off scans (a `find' over a big tree,
+ * a streaming read) from flushing out the blocks that are used over and over.
+ * A block seen for the first time goes on the A1in FIFO; if it falls off the
+ * end without being used again only its number is remembered, on the A1out
+ * ghost queue. A block that is asked for again while on A1out has proven
+ * itself and goes on the Am LRU, which is where the working set lives.
+ *
+ * Metadata and file data are kept apart, each with its own A1in and Am, and
+ * file data may never hold more than a quarter of the pool: bulk I/O can only
+ * ever recycle its own buffers (and cold metadata up to that share), so the
+ * metadata working set survives it. File data is only cached when the engine
+ * can't hand out pointers into the image, since otherwise the store (or the
+ * host page cache behind the mapping) already holds it in memory.
+ *
+ * The cache can be used from any number of threads. The pool is split into
+ * shards by block number, each with its own lock, hash table and queues, so
+ * threads working on different blocks rarely contend. A shard's lock is only
+ * held while its bookkeeping changes (and while an evicted dirty block is
+ * written out); blocks are read in with it dropped, and a thread that wants a
+ * block another thread is still reading in waits for that read instead of
+ * issuing its own. The contents of a pinned buffer are not protected: callers
+ * sharing a block have to serialize their changes to it.
+ *
+ * The plain block calls in layer0.c stay coherent with the cache: they are
+ * served from it when the block is resident and update the cached copy when
+ * they write, but never bring new blocks into it.
+ *
+ * Under the deferred writeback policies `layer0_writeBuffer()` only marks the
+ * buffer dirty, so repeated updates to the same block (the inode block and
+ * free list head during a create, say) reach the engine as one write. Dirty
+ * buffers go out when they are evicted, on `layer0_flush()` and at teardown,
+ * and every `writeback_interval_ms` under the `interval' policy.
+ */
+
+#include "layer0_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cofs_parameters.h"
+#include "cofs_util.h"
+#include "cofs_errno.h"
+
+#define MEGABYTE                (1024UL * 1024)
+
+// file data may hold at most 1/DATA_DIVISOR of each shard
+#define DATA_DIVISOR            4
+// each class keeps 1/A1IN_DIVISOR of its buffers on A1in
+#define A1IN_DIVISOR            4
+// A1out remembers as many evicted blocks as 1/A1OUT_DIVISOR of a shard holds
+#define A1OUT_DIVISOR           2
+
+// most shards the cache is split into, and the fewest buffers each gets by default
+#define MAX_SHARDS              64
+#define MIN_SHARD_BUFS          64
+
+enum cache_class {
+        CLASS_META = 0,
+        CLASS_DATA,
+        N_CLASSES
+};
+
+struct cache_buf;
+
+/* a doubly-linked queue of buffers; new entries go on at the head */
+struct buf_list {
+        struct cache_buf *head, *tail;
+        size_t len;
+};
+
+struct cache_buf {
+        layer0_buffer pub;              /* what the caller sees; must come first */
+        struct cache_shard *shard;      /* NULL for overflow buffers (see __claim()) */
+        struct cache_buf *hash_next;
+        struct cache_buf *prev, *next;  /* position on `list` */
+        struct buf_list *list;
+        enum cache_class class;
+        unsigned pins;
+        bool hashed;                    /* holds a block and is in the hash table */
+        bool valid;                     /* the block's contents have been read in */
+        bool loading;                   /* a thread is reading the contents in */
+        bool dirty;                     /* changed since it was last written out */
+};
+
+/* a block number remembered on A1out */
+struct ghost {
+        block_reference bnum;
+        size_t hash_next;               /* index + 1 of the next ghost in the bucket, 0 ends it */
+        bool used;
+};
+
+/* one lock's worth of the cache. Everything in here is guarded by `lock`, as
+ * is the bookkeeping (not the contents) of the buffers it owns.
+ */
+struct cache_shard {
+        pthread_mutex_t lock;
+        pthread_cond_t loaded;          /* signalled when a buffer stops `loading` */
+
+        struct cache_buf **buckets;
+        struct buf_list free_bufs;
+        struct buf_list a1in[N_CLASSES];
+        struct buf_list am[N_CLASSES];
+        size_t data_max;
+
+        struct ghost *ghosts;
+        size_t *ghost_buckets;
+        size_t n_ghosts;
+        size_t ghost_next;              /* slot the next ghost overwrites (FIFO order) */
+
+        size_t n_dirty;
+} __attribute__((aligned(64)));         /* keep shards' locks off each other's cache lines */
+
+// serializes setting the cache up and tearing it down; `ready` is read without it
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool ready = false;
+
+static struct cache_buf *bufs;
+static unsigned char *pool;
+static size_t n_bufs;
+
+static struct cache_shard *shards;
+static unsigned shard_bits;
+static unsigned bucket_bits;            /* per shard */
+
+// when dirty buffers were last written out, for the `interval' policy
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec last_flush;
+
+static inline struct cache_buf *__from_pub(layer0_buffer *buf)
+{
+        return (struct cache_buf *) buf;
+}
+
+static inline uint64_t __hash(block_reference bnum)
+{
+        // Fibonacci hashing spreads the runs of adjacent blocks we tend to cache;
+        // the top bits pick the shard and the ones below them the bucket
+        return (uint64_t) bnum * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline struct cache_shard *__shard_of(block_reference bnum)
+{
+        return shard_bits == 0 ? &shards[0] : &shards[__hash(bnum) >> (64 - shard_bits)];
+}
+
+static inline size_t __bucket_of(block_reference bnum)
+{
+        return (size_t) ((__hash(bnum) << shard_bits) >> (64 - bucket_bits));
+}
+
+static void __list_push(struct buf_list *list, struct cache_buf *b)
+{
+        b->list = list;
+        b->prev = NULL;
+        b->next = list->head;
+        if (list->head != NULL)
+                list->head->prev = b;
+        else
+                list->tail = b;
+        list->head = b;
+        ++list->len;
+}
+
+static void __list_remove(struct cache_buf *b)
+{
+        struct buf_list *list = b->list;
+        if (list == NULL)
+                return;
+
+        if (b->prev != NULL)
+                b->prev->next = b->next;
+        else
+                list->head = b->next;
+        if (b->next != NULL)
+                b->next->prev = b->prev;
+        else
+                list->tail = b->prev;
+
+        --list->len;
+        b->list = NULL;
+        b->prev = b->next = NULL;
+}
+
+static inline size_t __class_size(struct cache_shard *s, enum cache_class class)
+{
+        return s->a1in[class].len + s->am[class].len;
+}
+
+/* A1out: a ring of block numbers with a small hash table over it */
+
+static inline size_t __ghost_bucket(struct cache_shard *s, block_reference bnum)
+{
+        return (size_t) (__hash(bnum) >> 32) % s->n_ghosts;
+}
+
+static void __ghost_unlink(struct cache_shard *s, size_t slot)
+{
+        size_t *link = &s->ghost_buckets[__ghost_bucket(s, s->ghosts[slot].bnum)];
+        while (*link != slot + 1)
+                link = &s->ghosts[*link - 1].hash_next;
+
+        *link = s->ghosts[slot].hash_next;
+        s->ghosts[slot].used = false;
+}
+
+static void __ghost_add(struct cache_shard *s, block_reference bnum)
+{
+        if (s->n_ghosts == 0)
+                return;
+
+        // the oldest ghost makes room
+        size_t slot = s->ghost_next;
+        s->ghost_next = (s->ghost_next + 1) % s->n_ghosts;
+        if (s->ghosts[slot].used)
+                __ghost_unlink(s, slot);
+
+        size_t *bucket = &s->ghost_buckets[__ghost_bucket(s, bnum)];
+        s->ghosts[slot].bnum = bnum;
+        s->ghosts[slot].hash_next = *bucket;
+        s->ghosts[slot].used = true;
+        *bucket = slot + 1;
+}
+
+// @return `true` if `bnum` was on A1out, in which case it is taken off
+static bool __ghost_take(struct cache_shard *s, block_reference bnum)
+{
+        if (s->n_ghosts == 0)
+                return false;
+
+        size_t i = s->ghost_buckets[__ghost_bucket(s, bnum)];
+        for (; i != 0; i = s->ghosts[i - 1].hash_next) {
+                if (s->ghosts[i - 1].bnum == bnum) {
+                        __ghost_unlink(s, i - 1);
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+// log2 of the number of shards; a power of two so the hash splits the blocks evenly
+static unsigned __pick_shard_bits(void)
+{
+        size_t want = layer0_opts.cache_shards;
+        if (want == 0)
+                want = n_bufs / MIN_SHARD_BUFS;
+        if (want > MAX_SHARDS)
+                want = MAX_SHARDS;
+        if (want > n_bufs)
+                want = n_bufs;
+
+        unsigned bits = 0;
+        while (((size_t) 2 << bits) <= want)
+                ++bits;
+        return bits;
+}
+
+static bool __setup_shard(struct cache_shard *s, struct cache_buf *first, size_t count)
+{
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->loaded, NULL);
+
+        s->n_ghosts = count / A1OUT_DIVISOR;
+        s->data_max = count / DATA_DIVISOR;
+        CALLOC_CHECK(s->buckets, (size_t) 1 << bucket_bits, sizeof(struct cache_buf *));
+        CALLOC_CHECK(s->ghosts, s->n_ghosts + 1, sizeof(struct ghost));
+        CALLOC_CHECK(s->ghost_buckets, s->n_ghosts + 1, sizeof(size_t));
+        if (s->buckets == NULL || s->ghosts == NULL || s->ghost_buckets == NULL)
+                return false;
+
+        for (size_t i = 0; i < count; i++) {
+                first[i].shard = s;
+                __list_push(&s->free_bufs, &first[i]);
+        }
+
+        return true;
+}
+
+static void __free_shards(size_t n_shards)
+{
+        for (size_t i = 0; i < n_shards; i++) {
+                free(shards[i].ghost_buckets);
+                free(shards[i].ghosts);
+                free(shards[i].buckets);
+                pthread_cond_destroy(&shards[i].loaded);
+                pthread_mutex_destroy(&shards[i].lock);
+        }
+
+        free(shards);
+        shards = NULL;
+}
+
+// allocate the pool the first time it is needed, sized by the current options
+static bool __setup(void)
+{
+        if (__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+                return n_bufs > 0;
+
+        pthread_mutex_lock(&setup_lock);
+        if (ready) {
+                pthread_mutex_unlock(&setup_lock);
+                return n_bufs > 0;
+        }
+
+        n_bufs = (size_t) layer0_opts.cache_mb * MEGABYTE / COFS_BLOCK_SIZE;
+        if (n_bufs > 0) {
+                shard_bits = __pick_shard_bits();
+                size_t n_shards = (size_t) 1 << shard_bits;
+                size_t per_shard = n_bufs / n_shards;
+                n_bufs = per_shard * n_shards;
+
+                bucket_bits = 1;
+                while (((size_t) 1 << bucket_bits) < per_shard)
+                        ++bucket_bits;
+
+                pool = aligned_alloc(COFS_BLOCK_SIZE, n_bufs * COFS_BLOCK_SIZE);
+                CALLOC_CHECK(bufs, n_bufs, sizeof(struct cache_buf));
+                shards = aligned_alloc(64, n_shards * sizeof(struct cache_shard));
+                bool ok = pool != NULL && bufs != NULL && shards != NULL;
+
+                size_t n_set_up = 0;
+                if (ok)
+                        memset(shards, 0, n_shards * sizeof(struct cache_shard));
+                while (ok && n_set_up < n_shards) {
+                        ok = __setup_shard(&shards[n_set_up], bufs + n_set_up * per_shard, per_shard);
+                        ++n_set_up;
+                }
+
+                if (!ok) {
+                        PRINT_ERR("Cannot allocate a %u MiB buffer cache; running without one\n",
+                                  layer0_opts.cache_mb);
+                        if (shards != NULL)
+                                __free_shards(n_set_up);
+                        free(bufs);
+                        free(pool);
+                        bufs = NULL;
+                        pool = NULL;
+                        n_bufs = 0;
+                } else {
+                        for (size_t i = 0; i < n_bufs; i++)
+                                bufs[i].pub.data = pool + i * COFS_BLOCK_SIZE;
+
+                        clock_gettime(CLOCK_MONOTONIC, &last_flush);
+                        PRINT_DBG("Buffer cache holds %zu blocks in %zu shards\n", n_bufs, n_shards);
+                }
+        }
+
+        __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&setup_lock);
+        return n_bufs > 0;
+}
+
+// locks and returns the shard `bnum` belongs to, else NULL if there is no cache
+static struct cache_shard *__lock_shard(block_reference bnum)
+{
+        if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE) || n_bufs == 0)
+                return NULL;
+
+        struct cache_shard *s = __shard_of(bnum);
+        pthread_mutex_lock(&s->lock);
+        return s;
+}
+
+// finds the buffer holding `bnum` in shard `s`, which must be locked
+static struct cache_buf *__lookup(struct cache_shard *s, block_reference bnum)
+{
+        struct cache_buf *b = s->buckets[__bucket_of(bnum)];
+        while (b != NULL && b->pub.bnum != bnum)
+                b = b->hash_next;
+
+        return b;
+}
+
+static void __set_dirty(struct cache_buf *b, bool dirty)
+{
+        if (b->shard != NULL && b->dirty != dirty)
+                b->shard->n_dirty += dirty ? 1 : -1;
+        b->dirty = dirty;
+}
+
+static bool __write_out(struct cache_buf *b)
+{
+        struct layer0_iovec iov = {b->pub.bnum, b->pub.data};
+        if (layer0_engineWritev(&iov, 1) == -1)
+                return false;
+
+        __set_dirty(b, false);
+        return true;
+}
+
+// takes a buffer out of the hash table and its queue, and puts it back on the free list
+static void __release(struct cache_buf *b)
+{
+        struct cache_shard *s = b->shard;
+        struct cache_buf **link = &s->buckets[__bucket_of(b->pub.bnum)];
+        while (*link != b)
+                link = &(*link)->hash_next;
+
+        *link = b->hash_next;
+        b->hash_next = NULL;
+        b->hashed = false;
+        b->valid = false;
+        __set_dirty(b, false);
+
+        __list_remove(b);
+        __list_push(&s->free_bufs, b);
+}
+
+// the least recently queued buffer on `list` that can be given up, else NULL
+static struct cache_buf *__oldest_unpinned(struct buf_list *list)
+{
+        for (struct cache_buf *b = list->tail; b != NULL; b = b->prev) {
+                if (b->pins > 0)
+                        continue;
+
+                if (b->dirty && !__write_out(b))
+                        continue; // keep it; the next flush will retry
+
+                return b;
+        }
+
+        return NULL;
+}
+
+// frees up one buffer held by `class`. @return `false` if all of them are pinned
+static bool __evict(struct cache_shard *s, enum cache_class class)
+{
+        struct cache_buf *victim = NULL;
+
+        // 2Q: recycle A1in while it is over its share, else the coldest of Am
+        if (s->a1in[class].len > __class_size(s, class) / A1IN_DIVISOR)
+                victim = __oldest_unpinned(&s->a1in[class]);
+        if (victim == NULL)
+                victim = __oldest_unpinned(&s->am[class]);
+        if (victim == NULL)
+                victim = __oldest_unpinned(&s->a1in[class]);
+        if (victim == NULL)
+                return false;
+
+        // only blocks that never made it past A1in are worth remembering
+        if (victim->list == &s->a1in[class])
+                __ghost_add(s, victim->pub.bnum);
+
+        __release(victim);
+        return true;
+}
+
+// makes sure shard `s` has a free buffer for a new block of `class`
+static bool __make_room(struct cache_shard *s, enum cache_class class)
+{
+        // file data that has used up its share recycles its own buffers, even
+        // if there are free ones left for metadata
+        if (class == CLASS_DATA && __class_size(s, CLASS_DATA) >= s->data_max && __evict(s, CLASS_DATA))
+                return true;
+
+        if (s->free_bufs.len > 0)
+                return true;
+
+        // below its share, file data grows at the expense of cold metadata;
+        // metadata only takes buffers back from file data once its own are all pinned
+        return __evict(s, CLASS_META) || __evict(s, CLASS_DATA);
+}
+
+// a resident block was used again
+static void __touch(struct cache_buf *b, enum cache_class class)
+{
+        struct cache_shard *s = b->shard;
+        if (b->class != class) {
+                // the block was freed and reused as the other kind
+                bool hot = b->list == &s->am[b->class];
+                __list_remove(b);
+                b->class = class;
+                __list_push(hot ? &s->am[class] : &s->a1in[class], b);
+        } else if (b->list == &s->am[class]) {
+                __list_remove(b);
+                __list_push(&s->am[class], b);
+        }
+        // a repeat hit on A1in is usually the same operation touching the block
+        // again, so it doesn't count as reuse (that's what A1out is for)
+}
+
+static struct cache_buf *__alloc_overflow(block_reference bnum)
+{
+        struct cache_buf *b;
+        CALLOC_CHECK(b, 1, sizeof(struct cache_buf));
+        if (b == NULL || (b->pub.data = aligned_alloc(COFS_BLOCK_SIZE, COFS_BLOCK_SIZE)) == NULL) {
+                free(b);
+                cofs_errno = ENOMEM;
+                return NULL;
+        }
+
+        b->pub.bnum = bnum;
+        b->pins = 1;
+        return b;
+}
+
+// puts `bnum` in a free buffer of shard `s`, which must be locked, and pins it
+static struct cache_buf *__install(struct cache_shard *s, block_reference bnum, enum cache_class class)
+{
+        struct cache_buf *b = s->free_bufs.head;
+        __list_remove(b);
+        b->class = class;
+        __list_push(__ghost_take(s, bnum) ? &s->am[class] : &s->a1in[class], b);
+
+        size_t bucket = __bucket_of(bnum);
+        b->pub.bnum = bnum;
+        b->hash_next = s->buckets[bucket];
+        s->buckets[bucket] = b;
+        b->hashed = true;
+        b->valid = false;
+        b->loading = false;
+        b->pins = 1;
+        return b;
+}
+
+/* Finds or allocates the buffer for `bnum` in shard `s`, which must be locked,
+ * and pins it. Its contents still have to be read in unless it is `valid` (or
+ * another thread is `loading` them). If every buffer in the shard is pinned
+ * the caller gets a private overflow buffer that is freed on release.
+ */
+static struct cache_buf *__claim(struct cache_shard *s, block_reference bnum, enum cache_class class)
+{
+        struct cache_buf *b = __lookup(s, bnum);
+        if (b != NULL) {
+                ++b->pins;
+                __touch(b, class);
+                return b;
+        }
+
+        if (!__make_room(s, class))
+                return __alloc_overflow(bnum);
+
+        return __install(s, bnum, class);
+}
+
+// claims `bnum` from its shard, or as an overflow buffer if there is no cache
+static struct cache_buf *__claim_any(block_reference bnum, enum cache_class class)
+{
+        if (!__setup())
+                return __alloc_overflow(bnum);
+
+        struct cache_shard *s = __shard_of(bnum);
+        pthread_mutex_lock(&s->lock);
+        struct cache_buf *b = __claim(s, bnum, class);
+        pthread_mutex_unlock(&s->lock);
+        return b;
+}
+
+/* Decides who reads in a claimed buffer. @return `true` if the caller has to,
+ * in which case the buffer is `loading` until `__finish_load()`, else `false`
+ * once its contents are valid. If another thread is already reading the block
+ * in, waits for it to finish if `wait` is set, else leaves it to that thread.
+ */
+static bool __start_load(struct cache_buf *b, bool wait)
+{
+        struct cache_shard *s = b->shard;
+        if (s == NULL)
+                return true;
+
+        pthread_mutex_lock(&s->lock);
+        while (wait && b->loading)
+                pthread_cond_wait(&s->loaded, &s->lock);
+
+        bool must_load = !b->valid && !b->loading;
+        if (must_load)
+                b->loading = true;
+        pthread_mutex_unlock(&s->lock);
+        return must_load;
+}
+
+// ends a load started by `__start_load()`; if it failed, the next waiter tries
+static void __finish_load(struct cache_buf *b, bool ok)
+{
+        struct cache_shard *s = b->shard;
+        if (s == NULL)
+                return;
+
+        pthread_mutex_lock(&s->lock);
+        b->valid = ok;
+        b->loading = false;
+        pthread_cond_broadcast(&s->loaded);
+        pthread_mutex_unlock(&s->lock);
+}
+
+// gives up a claim whose contents could not be read in
+static void __abandon(struct cache_buf *b)
+{
+        struct cache_shard *s = b->shard;
+        if (s != NULL) {
+                pthread_mutex_lock(&s->lock);
+                if (b->hashed && !b->valid && !b->loading && b->pins == 1)
+                        __release(b);
+                pthread_mutex_unlock(&s->lock);
+        }
+
+        layer0_putBuffer(&b->pub);
+}
+
+// reads a claimed buffer in if nobody else has. @return `false` on failure
+static bool __load(struct cache_buf *b)
+{
+        if (!__start_load(b, true))
+                return true;
+
+        struct layer0_iovec iov = {b->pub.bnum, b->pub.data};
+        bool ok = layer0_engineReadv(&iov, 1) == 0;
+        __finish_load(b, ok);
+        return ok;
+}
+
+layer0_buffer *layer0_getBuffer(block_reference bnum)
+{
+        if (bnum >= NUM_BLOCKS) {
+                cofs_errno = EIO;
+                return NULL;
+        }
+
+        struct cache_buf *b = __claim_any(bnum, CLASS_META);
+        if (b == NULL)
+                return NULL;
+
+        if (!__load(b)) {
+                __abandon(b);
+                return NULL;
+        }
+
+        return &b->pub;
+}
+
+layer0_buffer *layer0_claimBuffer(block_reference bnum)
+{
+        if (bnum >= NUM_BLOCKS) {
+                cofs_errno = EIO;
+                return NULL;
+        }
+
+        struct cache_buf *b = __claim_any(bnum, CLASS_META);
+        if (b == NULL)
+                return NULL;
+
+        /* the caller is about to overwrite it, so whatever is there will do, but
+         * a read already under way has to land first or it would land on top
+         */
+        if (__start_load(b, true))
+                __finish_load(b, true);
+        return &b->pub;
+}
+
+int layer0_getBuffers(const block_reference bnums[], layer0_buffer *out[], size_t count)
+{
+        struct layer0_iovec *iov;
+        bool *mine;
+        CALLOC_CHECK(iov, count, sizeof(struct layer0_iovec));
+        CALLOC_CHECK(mine, count, sizeof(bool));
+        if (iov == NULL || mine == NULL) {
+                free(iov);
+                free(mine);
+                cofs_errno = ENOMEM;
+                return -1;
+        }
+
+        size_t n_claimed, n_misses = 0;
+        bool ok = true;
+        for (n_claimed = 0; n_claimed < count; n_claimed++) {
+                if (bnums[n_claimed] >= NUM_BLOCKS) {
+                        cofs_errno = EIO;
+                        ok = false;
+                        break;
+                }
+
+                struct cache_buf *b = __claim_any(bnums[n_claimed], CLASS_META);
+                if (b == NULL) {
+                        ok = false;
+                        break;
+                }
+
+                out[n_claimed] = &b->pub;
+                mine[n_claimed] = __start_load(b, false);
+                if (mine[n_claimed]) {
+                        iov[n_misses].bnum = b->pub.bnum;
+                        iov[n_misses].buf = b->pub.data;
+                        ++n_misses;
+                }
+        }
+
+        // everything that wasn't resident comes in with one vectored read
+        if (ok && n_misses > 0)
+                ok = layer0_engineReadv(iov, n_misses) == 0;
+        for (size_t i = 0; i < n_claimed; i++) {
+                if (mine[i])
+                        __finish_load(__from_pub(out[i]), ok);
+        }
+
+        // blocks other threads were reading in are only waited for now, with
+        // ours done, so two batches can never end up waiting on each other
+        for (size_t i = 0; ok && i < n_claimed; i++) {
+                if (!mine[i])
+                        ok = __load(__from_pub(out[i]));
+        }
+
+        if (!ok) {
+                for (size_t i = 0; i < n_claimed; i++)
+                        __abandon(__from_pub(out[i]));
+        }
+
+        free(mine);
+        free(iov);
+        return ok ? 0 : -1;
+}
+
+void layer0_putBuffer(layer0_buffer *buf)
+{
+        if (buf == NULL)
+                return;
+
+        struct cache_buf *b = __from_pub(buf);
+        struct cache_shard *s = b->shard;
+        if (s == NULL) {
+                free(b->pub.data);
+                free(b);
+                return;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        --b->pins;
+        pthread_mutex_unlock(&s->lock);
+}
+
+// under the `interval' policy, writes out the dirty buffers once they are old enough
+static void __flush_if_due(void)
+{
+        if (layer0_opts.writeback != LAYER0_WRITEBACK_INTERVAL)
+                return;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&flush_lock);
+        long elapsed_ms = (now.tv_sec - last_flush.tv_sec) * 1000
+                          + (now.tv_nsec - last_flush.tv_nsec) / 1000000;
+        pthread_mutex_unlock(&flush_lock);
+
+        if (elapsed_ms >= (long) layer0_opts.writeback_interval_ms)
+                cache_flush();
+}
+
+int layer0_writeBuffer(layer0_buffer *buf)
+{
+        struct cache_buf *b = __from_pub(buf);
+        struct cache_shard *s = b->shard;
+        if (s == NULL || layer0_opts.writeback == LAYER0_WRITEBACK_SYNC) {
+                struct layer0_iovec iov = {b->pub.bnum, b->pub.data};
+                if (layer0_engineWritev(&iov, 1) == -1)
+                        return -1;
+        }
+
+        if (s != NULL) {
+                pthread_mutex_lock(&s->lock);
+                __set_dirty(b, layer0_opts.writeback != LAYER0_WRITEBACK_SYNC);
+                pthread_mutex_unlock(&s->lock);
+                __flush_if_due();
+        }
+
+        return 0;
+}
+
+// keeps a clean copy of file data block `bnum` from `src`, unless it is already resident
+static void __insert_data(block_reference bnum, const void *src)
+{
+        struct cache_shard *s = __lock_shard(bnum);
+        if (s == NULL)
+                return;
+
+        struct cache_buf *b = __lookup(s, bnum);
+        if (b != NULL) {
+                // layer0_readv()/layer0_writev() already served or updated it
+                __touch(b, CLASS_DATA);
+        } else if (__make_room(s, CLASS_DATA)) {
+                b = __install(s, bnum, CLASS_DATA);
+                memcpy(b->pub.data, src, COFS_BLOCK_SIZE);
+                b->valid = true;
+                b->pins = 0;
+        }
+
+        pthread_mutex_unlock(&s->lock);
+}
+
+int layer0_readvData(const struct layer0_iovec iov[], size_t count)
+{
+        if (layer0_readv(iov, count) == -1)
+                return -1;
+
+        if (!layer0_isZeroCopy() && __setup()) {
+                for (size_t i = 0; i < count; i++)
+                        __insert_data(iov[i].bnum, iov[i].buf);
+        }
+
+        return 0;
+}
+
+int layer0_writevData(const struct layer0_iovec iov[], size_t count)
+{
+        if (layer0_writev(iov, count) == -1)
+                return -1;
+
+        if (!layer0_isZeroCopy() && __setup()) {
+                for (size_t i = 0; i < count; i++)
+                        __insert_data(iov[i].bnum, iov[i].buf);
+        }
+
+        return 0;
+}
+
+bool cache_read(block_reference bnum, void *buf)
+{
+        struct cache_shard *s = __lock_shard(bnum);
+        if (s == NULL)
+                return false;
+
+        struct cache_buf *b = __lookup(s, bnum);
+        bool hit = b != NULL && b->valid;
+        if (hit)
+                memcpy(buf, b->pub.data, COFS_BLOCK_SIZE);
+
+        pthread_mutex_unlock(&s->lock);
+        return hit;
+}
+
+void cache_update(block_reference bnum, const void *buf)
+{
+        struct cache_shard *s = __lock_shard(bnum);
+        if (s == NULL)
+                return;
+
+        struct cache_buf *b = __lookup(s, bnum);
+        if (b != NULL && b->valid) {
+                if (b->pub.data != buf)
+                        memcpy(b->pub.data, buf, COFS_BLOCK_SIZE);
+
+                // the engine has just been given these exact contents
+                __set_dirty(b, false);
+        }
+
+        pthread_mutex_unlock(&s->lock);
+}
+
+void cache_drop(block_reference bnum)
+{
+        struct cache_shard *s = __lock_shard(bnum);
+        if (s == NULL)
+                return;
+
+        struct cache_buf *b = __lookup(s, bnum);
+        if (b != NULL && b->pins == 0)
+                __release(b);
+
+        pthread_mutex_unlock(&s->lock);
+}
+
+const void *cache_borrow(block_reference bnum)
+{
+        struct cache_shard *s = __lock_shard(bnum);
+        if (s == NULL)
+                return NULL;
+
+        struct cache_buf *b = __lookup(s, bnum);
+        const void *data = NULL;
+        if (b != NULL && b->valid) {
+                ++b->pins;
+                data = b->pub.data;
+        }
+
+        pthread_mutex_unlock(&s->lock);
+        return data;
+}
+
+bool cache_unborrow(const void *ptr)
+{
+        const unsigned char *p = ptr;
+        if (n_bufs == 0 || p < pool || p >= pool + n_bufs * COFS_BLOCK_SIZE)
+                return false;
+
+        layer0_putBuffer(&bufs[(p - pool) / COFS_BLOCK_SIZE].pub);
+        return true;
+}
+
+static int __bnum_comp(const void *a, const void *b)
+{
+        block_reference arg1 = (*(const struct layer0_iovec *) a).bnum;
+        block_reference arg2 = (*(const struct layer0_iovec *) b).bnum;
+
+        return (arg1 > arg2) - (arg1 < arg2);
+}
+
+bool cache_flush(void)
+{
+        if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE) || n_bufs == 0)
+                return true;
+
+        // hold every shard, always taken in the same order, so the set of dirty
+        // buffers can't change while it is written out
+        size_t n_shards = (size_t) 1 << shard_bits, n_dirty = 0;
+        for (size_t i = 0; i < n_shards; i++) {
+                pthread_mutex_lock(&shards[i].lock);
+                n_dirty += shards[i].n_dirty;
+        }
+
+        bool ret = true;
+        struct layer0_iovec *iov = NULL;
+        if (n_dirty > 0) {
+                CALLOC_CHECK(iov, n_dirty, sizeof(struct layer0_iovec));
+                if (iov == NULL) {
+                        cofs_errno = ENOMEM;
+                        ret = false;
+                }
+        }
+
+        if (iov != NULL) {
+                size_t count = 0;
+                for (size_t i = 0; i < n_bufs && count < n_dirty; i++) {
+                        if (bufs[i].dirty) {
+                                iov[count].bnum = bufs[i].pub.bnum;
+                                iov[count].buf = bufs[i].pub.data;
+                                ++count;
+                        }
+                }
+
+                // in block order, so adjacent dirty blocks go out as one transfer
+                qsort(iov, count, sizeof(struct layer0_iovec), &__bnum_comp);
+                ret = layer0_engineWritev(iov, count) == 0;
+                if (ret) {
+                        for (size_t i = 0; i < n_bufs; i++)
+                                __set_dirty(&bufs[i], false);
+                }
+        }
+
+        for (size_t i = n_shards; i-- > 0; )
+                pthread_mutex_unlock(&shards[i].lock);
+
+        if (ret) {
+                pthread_mutex_lock(&flush_lock);
+                clock_gettime(CLOCK_MONOTONIC, &last_flush);
+                pthread_mutex_unlock(&flush_lock);
+        }
+
+        free(iov);
+        return ret;
+}
+
+bool cache_teardown(void)
+{
+        bool ret = cache_flush();
+
+        pthread_mutex_lock(&setup_lock);
+        if (shards != NULL)
+                __free_shards((size_t) 1 << shard_bits);
+        free(bufs);
+        free(pool);
+        bufs = NULL;
+        pool = NULL;
+        n_bufs = 0;
+        __atomic_store_n(&ready, false, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&setup_lock);
+        return ret;
+}
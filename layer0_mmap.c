@@ -0,0 +1,335 @@
+/* layer0_mmap.c - COFS layer 0 mmap engine
+ *
+ * Maps the whole backing store into our address space and services block
+ * requests with memcpy(). This is the original layer 0 implementation.
+ */
+
+#include "layer0_backend.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "cofs_parameters.h"
+#include "cofs_util.h"
+#include "cofs_errno.h"
+
+static volatile unsigned char *backing;
+
+static size_t unmap_size = 0;
+
+// what `backing` maps, which decides how blocks can be discarded
+static enum {
+        BACKING_ANON,           /* in-memory filesystem */
+        BACKING_FILE,           /* shared mapping of a regular image file */
+        BACKING_OTHER,          /* block device, or a private view of an image */
+} backing_kind;
+
+// default huge page size on x86-64 and arm64
+#define HUGE_PAGE_SIZE          (2UL << 20)
+
+static inline size_t __round_up(size_t n, size_t align)
+{
+        return (n + align - 1) / align * align;
+}
+
+// map anonymous memory for the in-memory FS, aligned so THP can back all of it
+static void *__map_thp(size_t memsize, int flags)
+{
+        // over-allocate by one huge page and trim both ends to get an aligned region
+        size_t padded = memsize + HUGE_PAGE_SIZE;
+        unsigned char *raw = mmap(NULL, padded, PROT_WRITE | PROT_READ,
+                                  MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (raw == MAP_FAILED)
+                return MAP_FAILED;
+
+        unsigned char *aligned = (unsigned char *) __round_up((uintptr_t) raw, HUGE_PAGE_SIZE);
+        if (aligned != raw)
+                munmap(raw, aligned - raw);
+        if (aligned + memsize != raw + padded)
+                munmap(aligned + memsize, (raw + padded) - (aligned + memsize));
+
+        if (madvise(aligned, memsize, MADV_HUGEPAGE) == -1)
+                PRINT_ERR("madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+
+        // MAP_POPULATE has to come after the madvise() or we'd fault in small pages
+        if ((flags & MAP_POPULATE) && madvise(aligned, memsize, MADV_POPULATE_WRITE) == -1)
+                PRINT_ERR("Cannot pre-fault in-memory filesystem: %s\n", strerror(errno));
+
+        return aligned;
+}
+
+static bool __mmap_open_mem(size_t memsize)
+{
+        int flags = layer0_opts.populate ? MAP_POPULATE : 0;
+        void *buf = MAP_FAILED;
+
+        switch (layer0_opts.hugepages) {
+        case LAYER0_HUGEPAGES_HUGETLB:
+                memsize = __round_up(memsize, HUGE_PAGE_SIZE);
+                buf = mmap(NULL, memsize, PROT_WRITE | PROT_READ,
+                           MAP_ANON | MAP_PRIVATE | MAP_HUGETLB | flags, -1, 0);
+                if (buf != MAP_FAILED)
+                        break;
+
+                PRINT_ERR("Cannot map huge pages (%s); falling back to transparent huge pages\n",
+                          strerror(errno));
+                // fall through
+        case LAYER0_HUGEPAGES_THP:
+                buf = __map_thp(memsize, flags);
+                break;
+        default:
+                buf = mmap(NULL, memsize, PROT_WRITE | PROT_READ,
+                           MAP_ANON | MAP_PRIVATE | flags, -1, 0);
+                break;
+        }
+
+        if (buf == MAP_FAILED)
+                return false;
+
+        unmap_size = memsize;
+        backing = buf;
+        // dropping pages would split huge pages and defeat the point of them
+        backing_kind = layer0_opts.hugepages == LAYER0_HUGEPAGES_NONE ? BACKING_ANON : BACKING_OTHER;
+        return true;
+}
+
+// copy-on-write view of a saved image: pages are read in as they are touched and
+// our changes never reach the file
+static bool __mmap_open_cow(const char *path, size_t size)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                PRINT_ERR("Cannot open image %s: %s\n", path, strerror(errno));
+                return false;
+        }
+
+        int flags = MAP_PRIVATE | (layer0_opts.populate ? MAP_POPULATE : 0);
+        void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+        close(fd);
+
+        if (buf == MAP_FAILED) {
+                PRINT_ERR("Cannot map image %s: %s\n", path, strerror(errno));
+                return false;
+        }
+
+        unmap_size = size;
+        backing = buf;
+        backing_kind = BACKING_OTHER;
+        return true;
+}
+
+// We can change this later... but it feels cleaner to me than using lseek/read/write
+void *layer0_mapBlkdev(const char *path, size_t *size)
+{
+        int fdd = open(path, O_RDWR | O_NONBLOCK);
+        if (fdd < 0) {
+                PRINT_ERR("Cannot open block device: %s\n",
+                          strerror(errno));
+                return NULL;
+        }
+
+        // regular image files work too, so we don't need a loop device
+        size_t blkdev_size = 0;
+        bool is_file = false;
+        if (!pio_deviceSize(fdd, &blkdev_size, &is_file) || blkdev_size < COFS_BLOCK_SIZE) {
+                PRINT_ERR("Cannot get size of block device: %s\n",
+                          blkdev_size ? strerror(errno) : "device is empty");
+                close(fdd);
+                return NULL;
+        }
+
+        PRINT_DBG("Loading %s %s with size %zu\n", is_file ? "image file" : "block device",
+                  path, blkdev_size);
+
+        void *buf = mmap(NULL, blkdev_size, PROT_READ | PROT_WRITE,
+                MAP_FILE | MAP_SHARED, fdd, 0);
+
+        close(fdd);
+
+        if (buf == MAP_FAILED) {
+                PRINT_ERR("Cannot map block device: %s\n",
+                          strerror(errno));
+                return NULL;
+        }
+
+        // touch all of the pages so that we can access them later
+//        for (size_t offset = 0; offset < blkdev_size; offset += sysconf(_SC_PAGESIZE)) {
+//                volatile unsigned char a = *(volatile unsigned char *) (backing + offset);
+//        }
+
+        unmap_size = blkdev_size;
+        *size = blkdev_size;
+
+        backing = buf;
+        backing_kind = is_file ? BACKING_FILE : BACKING_OTHER;
+
+        return buf;
+}
+
+static bool __mmap_open(const char *path, size_t *size)
+{
+        return layer0_mapBlkdev(path, size) != NULL;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored  "-Wdiscarded-qualifiers"
+static bool __mmap_teardown(void)
+{
+        if (unmap_size) {
+                // mmap(2) man page indicates that changes may not be committed before munmap()
+                // call unless we cal msync()
+                msync(backing, unmap_size, MS_SYNC);
+                munmap(backing, unmap_size);
+                unmap_size = 0;
+                backing = NULL;
+        }
+
+        return true;
+}
+
+static int __mmap_write(block_reference bnum, const void *buf)
+{
+        unsigned char *dest = backing + (bnum * COFS_BLOCK_SIZE);
+
+        memcpy(dest, buf, COFS_BLOCK_SIZE);
+        if (layer0_opts.writeback == LAYER0_WRITEBACK_SYNC)
+                msync(dest, COFS_BLOCK_SIZE, MS_ASYNC);
+
+        return 0;
+}
+
+static int __mmap_read(block_reference bnum, void *buf)
+{
+        memcpy(buf, backing + (bnum * COFS_BLOCK_SIZE), COFS_BLOCK_SIZE);
+        return 0;
+}
+
+// number of leading entries of `iov` whose buffers are also laid out back-to-back,
+// so the whole stretch can be moved with a single memcpy()
+static size_t __adjacent_buffers(const struct layer0_iovec iov[], size_t count)
+{
+        size_t n = 1;
+        while (n < count && (unsigned char *) iov[n].buf
+                            == (unsigned char *) iov[n - 1].buf + COFS_BLOCK_SIZE)
+                ++n;
+
+        return n;
+}
+
+static int __mmap_writev(const struct layer0_iovec iov[], size_t count)
+{
+        size_t i = 0;
+        while (i < count) {
+                size_t run = layer0_contiguousRun(iov + i, count - i, SIZE_MAX);
+                unsigned char *dest = backing + (iov[i].bnum * COFS_BLOCK_SIZE);
+
+                for (size_t j = 0; j < run; ) {
+                        size_t n = __adjacent_buffers(iov + i + j, run - j);
+                        memcpy(dest + j * COFS_BLOCK_SIZE, iov[i + j].buf, n * COFS_BLOCK_SIZE);
+                        j += n;
+                }
+
+                // one msync() for the whole run instead of one per block
+                if (layer0_opts.writeback == LAYER0_WRITEBACK_SYNC)
+                        msync(dest, run * COFS_BLOCK_SIZE, MS_ASYNC);
+                i += run;
+        }
+
+        return 0;
+}
+
+static int __mmap_readv(const struct layer0_iovec iov[], size_t count)
+{
+        size_t i = 0;
+        while (i < count) {
+                size_t n = layer0_contiguousRun(iov + i, count - i, SIZE_MAX);
+                n = __adjacent_buffers(iov + i, n);
+                memcpy(iov[i].buf, backing + (iov[i].bnum * COFS_BLOCK_SIZE), n * COFS_BLOCK_SIZE);
+                i += n;
+        }
+
+        return 0;
+}
+
+static void __mmap_readahead(block_reference first, size_t count)
+{
+        // anonymous memory is never read from anywhere, so only hint real mappings
+        if (backing_kind == BACKING_ANON)
+                return;
+
+        // madvise() wants a page-aligned start
+        uintptr_t from = (uintptr_t) (backing + (first * COFS_BLOCK_SIZE));
+        uintptr_t aligned = from & ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+        madvise((void *) aligned, count * COFS_BLOCK_SIZE + (from - aligned), MADV_WILLNEED);
+}
+
+static int __mmap_discard(block_reference first, size_t count)
+{
+        // MADV_REMOVE punches a hole in the file behind a shared mapping; anonymous
+        // pages are simply dropped and fault back in as zeroes
+        int advice;
+        switch (backing_kind) {
+        case BACKING_FILE:
+                advice = MADV_REMOVE;
+                break;
+        case BACKING_ANON:
+                advice = MADV_DONTNEED;
+                break;
+        default:
+                return 0;
+        }
+
+        if (madvise(backing + (first * COFS_BLOCK_SIZE), count * COFS_BLOCK_SIZE, advice) == -1) {
+                if (errno == EOPNOTSUPP || errno == EINVAL)
+                        backing_kind = BACKING_OTHER;
+                cofs_errno = errno;
+                return -1;
+        }
+
+        return 0;
+}
+
+static const void *__mmap_get_ptr(block_reference bnum)
+{
+        return backing + (bnum * COFS_BLOCK_SIZE);
+}
+
+static int __mmap_flush(block_reference first, size_t count)
+{
+        if (msync(backing + (first * COFS_BLOCK_SIZE), count * COFS_BLOCK_SIZE, MS_SYNC) == -1) {
+                cofs_errno = EIO;
+                return -1;
+        }
+
+        return 0;
+}
+#pragma GCC diagnostic pop
+
+const layer0_backend layer0_mmap_backend = {
+        .name           = "mmap",
+        .open           = __mmap_open,
+        .open_mem       = __mmap_open_mem,
+        .open_cow       = __mmap_open_cow,
+        .read           = __mmap_read,
+        .write          = __mmap_write,
+        .readv          = __mmap_readv,
+        .writev         = __mmap_writev,
+        .get_ptr        = __mmap_get_ptr,
+        .readahead      = __mmap_readahead,
+        .discard        = __mmap_discard,
+        .flush          = __mmap_flush,
+        .teardown       = __mmap_teardown,
+};
+
+#ifdef DEBUG
+
+volatile unsigned char *getmembase(void)
+{ return backing; }
+
+#endif
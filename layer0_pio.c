@@ -0,0 +1,371 @@
+/* layer0_pio.c - COFS layer 0 pread/pwrite engine
+ *
+ * Services block requests with positioned read(2)/write(2) calls against the
+ * device (or regular image file) instead of mapping it. Blocks are only
+ * faulted in when they are asked for, and the size of every transfer is under
+ * our control.
+ */
+
+#define _GNU_SOURCE
+#include "layer0_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "cofs_parameters.h"
+#include "cofs_util.h"
+#include "cofs_errno.h"
+
+// longest run of blocks moved by a single preadv()/pwritev() (1 MiB)
+#define PIO_MAX_RUN             256U
+
+static int dev_fd = -1;
+
+// whether the device was opened with O_DIRECT
+static bool direct_io = false;
+
+// whether the backing file supports fallocate(FALLOC_FL_PUNCH_HOLE)
+static bool punch_holes = false;
+
+bool pio_deviceSize(int fd, size_t *size, bool *is_file)
+{
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+                return false;
+
+        if (is_file)
+                *is_file = S_ISREG(st.st_mode);
+
+        if (S_ISREG(st.st_mode)) {
+                *size = st.st_size;
+                return true;
+        }
+
+        if (!S_ISBLK(st.st_mode)) {
+                errno = ENOTBLK;
+                return false;
+        }
+
+        uint64_t blkdev_size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &blkdev_size) == -1)
+                return false;
+
+        *size = blkdev_size;
+        return true;
+}
+
+int pio_openDevice(const char *path, int flags, size_t *size)
+{
+        int fd = open(path, O_RDWR | flags);
+        if (fd < 0) {
+                PRINT_ERR("Cannot open block device: %s\n",
+                          strerror(errno));
+                return -1;
+        }
+
+        bool is_file;
+        if (!pio_deviceSize(fd, size, &is_file)) {
+                PRINT_ERR("Cannot get size of block device: %s\n",
+                          strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        PRINT_DBG("Opened %s %s with size %zu%s\n", is_file ? "image file" : "block device",
+                  path, *size, (flags & O_DIRECT) ? " for direct I/O" : "");
+
+        direct_io = flags & O_DIRECT;
+        punch_holes = is_file;
+        return fd;
+}
+
+// back the in-memory FS with an anonymous file so we can still pread/pwrite it
+int pio_openMem(size_t memsize)
+{
+        int fd = memfd_create("cofs", MFD_CLOEXEC);
+        if (fd < 0)
+                return -1;
+
+        if (ftruncate(fd, memsize) == -1) {
+                close(fd);
+                return -1;
+        }
+
+        punch_holes = true;
+        return fd;
+}
+
+bool pio_close(int fd)
+{
+        if (fd < 0)
+                return true;
+
+        direct_io = false;
+        punch_holes = false;
+        bool ret = fdatasync(fd) == 0 || errno == EINVAL;
+        return close(fd) == 0 && ret;
+}
+
+bool pio_isAligned(const void *buf)
+{
+        return !direct_io || ((uintptr_t) buf % COFS_BLOCK_SIZE) == 0;
+}
+
+int pio_write(int fd, block_reference bnum, const void *buf)
+{
+        if (!pio_isAligned(buf)) {
+                unsigned char *bounce;
+                MALIGN_CHECK(bounce, COFS_BLOCK_SIZE);
+                if (bounce == NULL) {
+                        cofs_errno = ENOMEM;
+                        return -1;
+                }
+
+                memcpy(bounce, buf, COFS_BLOCK_SIZE);
+                int ret = pio_write(fd, bnum, bounce);
+                free(bounce);
+                return ret;
+        }
+
+        const unsigned char *src = buf;
+        off_t off = (off_t) bnum * COFS_BLOCK_SIZE;
+        size_t done = 0;
+
+        while (done < COFS_BLOCK_SIZE) {
+                ssize_t n = pwrite(fd, src + done, COFS_BLOCK_SIZE - done, off + done);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        cofs_errno = EIO;
+                        return -1;
+                }
+                done += n;
+        }
+
+        return 0;
+}
+
+int pio_read(int fd, block_reference bnum, void *buf)
+{
+        if (!pio_isAligned(buf)) {
+                unsigned char *bounce;
+                MALIGN_CHECK(bounce, COFS_BLOCK_SIZE);
+                if (bounce == NULL) {
+                        cofs_errno = ENOMEM;
+                        return -1;
+                }
+
+                int ret = pio_read(fd, bnum, bounce);
+                if (ret == 0)
+                        memcpy(buf, bounce, COFS_BLOCK_SIZE);
+                free(bounce);
+                return ret;
+        }
+
+        unsigned char *dest = buf;
+        off_t off = (off_t) bnum * COFS_BLOCK_SIZE;
+        size_t done = 0;
+
+        while (done < COFS_BLOCK_SIZE) {
+                ssize_t n = pread(fd, dest + done, COFS_BLOCK_SIZE - done, off + done);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        cofs_errno = EIO;
+                        return -1;
+                }
+                done += n;
+        }
+
+        return 0;
+}
+
+void pio_readahead(int fd, block_reference first, size_t count)
+{
+        // O_DIRECT reads never look in the page cache, so there's nothing to warm up
+        if (direct_io)
+                return;
+
+        posix_fadvise(fd, (off_t) first * COFS_BLOCK_SIZE, (off_t) count * COFS_BLOCK_SIZE,
+                      POSIX_FADV_WILLNEED);
+}
+
+int pio_discard(int fd, block_reference first, size_t count)
+{
+        if (!punch_holes)
+                return 0;
+
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t) first * COFS_BLOCK_SIZE, (off_t) count * COFS_BLOCK_SIZE) == -1)
+        {
+                // not every host filesystem can punch holes; stop trying if ours can't
+                if (errno == EOPNOTSUPP)
+                        punch_holes = false;
+                cofs_errno = errno;
+                return -1;
+        }
+
+        return 0;
+}
+
+int pio_flush(int fd, block_reference first, size_t count)
+{
+        // start the range's write-out first, so fdatasync() mostly waits on it
+        sync_file_range(fd, (off_t) first * COFS_BLOCK_SIZE, (off_t) count * COFS_BLOCK_SIZE,
+                        SYNC_FILE_RANGE_WRITE);
+
+        /* only fdatasync() also commits the image's block allocations and
+         * flushes the device's write cache, as msync(MS_SYNC) does for mmap
+         */
+        int r;
+        do {
+                r = fdatasync(fd);
+        } while (r == -1 && errno == EINTR);
+
+        if (r == -1) {
+                cofs_errno = EIO;
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Moves a run of consecutive disk blocks with one preadv(2)/pwritev(2). A short
+ * transfer (or a misaligned buffer under O_DIRECT) finishes the rest of the run
+ * one block at a time.
+ */
+static int __pio_transferRun(int fd, bool write, const struct layer0_iovec iov[], size_t run)
+{
+        struct iovec vecs[PIO_MAX_RUN];
+        size_t done = 0;
+
+        bool aligned = true;
+        for (size_t i = 0; i < run; i++) {
+                vecs[i].iov_base = iov[i].buf;
+                vecs[i].iov_len = COFS_BLOCK_SIZE;
+                aligned = aligned && pio_isAligned(iov[i].buf);
+        }
+
+        if (aligned) {
+                off_t off = (off_t) iov[0].bnum * COFS_BLOCK_SIZE;
+                ssize_t n;
+                do {
+                        n = write ? pwritev(fd, vecs, (int) run, off)
+                                  : preadv(fd, vecs, (int) run, off);
+                } while (n < 0 && errno == EINTR);
+
+                if (n > 0)
+                        done = n / COFS_BLOCK_SIZE;
+        }
+
+        for (size_t i = done; i < run; i++) {
+                int r = write ? pio_write(fd, iov[i].bnum, iov[i].buf)
+                              : pio_read(fd, iov[i].bnum, iov[i].buf);
+                if (r == -1)
+                        return -1;
+        }
+
+        return 0;
+}
+
+int pio_writev(int fd, const struct layer0_iovec iov[], size_t count)
+{
+        for (size_t i = 0; i < count; ) {
+                size_t run = layer0_contiguousRun(iov + i, count - i, PIO_MAX_RUN);
+                if (__pio_transferRun(fd, true, iov + i, run) == -1)
+                        return -1;
+                i += run;
+        }
+
+        return 0;
+}
+
+int pio_readv(int fd, const struct layer0_iovec iov[], size_t count)
+{
+        for (size_t i = 0; i < count; ) {
+                size_t run = layer0_contiguousRun(iov + i, count - i, PIO_MAX_RUN);
+                if (__pio_transferRun(fd, false, iov + i, run) == -1)
+                        return -1;
+                i += run;
+        }
+
+        return 0;
+}
+
+static bool __pio_open(const char *path, size_t *size)
+{
+        dev_fd = pio_openDevice(path, layer0_opts.direct ? O_DIRECT : 0, size);
+        return dev_fd >= 0;
+}
+
+static bool __pio_open_mem(size_t memsize)
+{
+        dev_fd = pio_openMem(memsize);
+        return dev_fd >= 0;
+}
+
+static bool __pio_teardown(void)
+{
+        bool ret = pio_close(dev_fd);
+        dev_fd = -1;
+        return ret;
+}
+
+static int __pio_write(block_reference bnum, const void *buf)
+{
+        return pio_write(dev_fd, bnum, buf);
+}
+
+static int __pio_read(block_reference bnum, void *buf)
+{
+        return pio_read(dev_fd, bnum, buf);
+}
+
+static int __pio_writev(const struct layer0_iovec iov[], size_t count)
+{
+        return pio_writev(dev_fd, iov, count);
+}
+
+static int __pio_readv(const struct layer0_iovec iov[], size_t count)
+{
+        return pio_readv(dev_fd, iov, count);
+}
+
+static int __pio_flush(block_reference first, size_t count)
+{
+        return pio_flush(dev_fd, first, count);
+}
+
+static void __pio_readahead(block_reference first, size_t count)
+{
+        pio_readahead(dev_fd, first, count);
+}
+
+static int __pio_discard(block_reference first, size_t count)
+{
+        return pio_discard(dev_fd, first, count);
+}
+
+const layer0_backend layer0_pio_backend = {
+        .name           = "pio",
+        .open           = __pio_open,
+        .open_mem       = __pio_open_mem,
+        .read           = __pio_read,
+        .write          = __pio_write,
+        .readv          = __pio_readv,
+        .writev         = __pio_writev,
+        .readahead      = __pio_readahead,
+        .discard        = __pio_discard,
+        .flush          = __pio_flush,
+        .teardown       = __pio_teardown,
+};
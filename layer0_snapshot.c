@@ -0,0 +1,183 @@
+/* layer0_snapshot.c - COFS layer 0 in-memory filesystem snapshots
+ *
+ * Lets an in-memory filesystem outlive the process: it can be saved to an
+ * image file when layer 0 is torn down, and a later mount can start from that
+ * image instead of running mkfs. Images are raw, so they are also valid
+ * block device images.
+ */
+
+#define _GNU_SOURCE
+#include "layer0_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "cofs_parameters.h"
+#include "cofs_util.h"
+#include "cofs_errno.h"
+
+// blocks moved per read(2)/write(2) while streaming an image (8 MiB)
+#define SNAPSHOT_CHUNK          2048U
+
+// sets up `iov` to move `n` blocks starting at `first` through `buf`
+static void __chunk_iov(struct layer0_iovec iov[], unsigned char *buf,
+                        block_reference first, size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                iov[i].bnum = first + i;
+                iov[i].buf = buf + i * COFS_BLOCK_SIZE;
+        }
+}
+
+static bool __is_zero(const unsigned char *buf, size_t len)
+{
+        return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+ssize_t snapshot_size(const char *path)
+{
+        struct stat st;
+        if (stat(path, &st) == -1) {
+                PRINT_ERR("Cannot open image %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        if (!S_ISREG(st.st_mode) || st.st_size < COFS_BLOCK_SIZE) {
+                PRINT_ERR("%s is not a COFS image\n", path);
+                return -1;
+        }
+
+        return st.st_size / COFS_BLOCK_SIZE * COFS_BLOCK_SIZE;
+}
+
+bool snapshot_load(const char *path, size_t n_blocks)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                PRINT_ERR("Cannot open image %s: %s\n", path, strerror(errno));
+                return false;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        unsigned char *buf = aligned_alloc(COFS_BLOCK_SIZE, SNAPSHOT_CHUNK * COFS_BLOCK_SIZE);
+        struct layer0_iovec *iov = calloc(SNAPSHOT_CHUNK, sizeof(struct layer0_iovec));
+        bool ret = buf != NULL && iov != NULL;
+
+        for (block_reference b = 0; ret && b < n_blocks; ) {
+                size_t n = n_blocks - b < SNAPSHOT_CHUNK ? n_blocks - b : SNAPSHOT_CHUNK;
+                size_t len = n * COFS_BLOCK_SIZE, done = 0;
+
+                while (done < len) {
+                        ssize_t r = read(fd, buf + done, len - done);
+                        if (r < 0 && errno == EINTR)
+                                continue;
+                        if (r <= 0) {
+                                PRINT_ERR("Cannot read image %s: %s\n", path,
+                                          r == 0 ? "unexpected end of file" : strerror(errno));
+                                ret = false;
+                                break;
+                        }
+                        done += r;
+                }
+
+                // the store starts out zero-filled, so holes in the image cost nothing
+                for (size_t i = 0; ret && i < n; ) {
+                        size_t run = 0;
+                        while (i + run < n && !__is_zero(buf + (i + run) * COFS_BLOCK_SIZE, COFS_BLOCK_SIZE))
+                                ++run;
+
+                        if (run > 0) {
+                                __chunk_iov(iov, buf + i * COFS_BLOCK_SIZE, b + i, run);
+                                ret = layer0_writev(iov, run) == 0;
+                        }
+                        i += run + 1;
+                }
+
+                b += n;
+        }
+
+        free(iov);
+        free(buf);
+        close(fd);
+        return ret;
+}
+
+bool snapshot_save(const char *path, size_t n_blocks)
+{
+        // write next to the target and rename over it, so a crash mid-save never
+        // leaves a torn image behind
+        size_t tmp_len = strlen(path) + sizeof(".tmp");
+        char *tmp_path = malloc(tmp_len);
+        if (tmp_path == NULL)
+                return false;
+        snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                PRINT_ERR("Cannot create image %s: %s\n", tmp_path, strerror(errno));
+                free(tmp_path);
+                return false;
+        }
+
+        unsigned char *buf = aligned_alloc(COFS_BLOCK_SIZE, SNAPSHOT_CHUNK * COFS_BLOCK_SIZE);
+        struct layer0_iovec *iov = calloc(SNAPSHOT_CHUNK, sizeof(struct layer0_iovec));
+        bool ret = buf != NULL && iov != NULL;
+
+        for (block_reference b = 0; ret && b < n_blocks; ) {
+                size_t n = n_blocks - b < SNAPSHOT_CHUNK ? n_blocks - b : SNAPSHOT_CHUNK;
+                __chunk_iov(iov, buf, b, n);
+                if (layer0_readv(iov, n) == -1) {
+                        ret = false;
+                        break;
+                }
+
+                // leave all-zero blocks as holes so the image stays sparse
+                for (size_t i = 0; ret && i < n; ) {
+                        size_t run = 0;
+                        while (i + run < n && !__is_zero(buf + (i + run) * COFS_BLOCK_SIZE, COFS_BLOCK_SIZE))
+                                ++run;
+
+                        const unsigned char *src = buf + i * COFS_BLOCK_SIZE;
+                        off_t off = (off_t) (b + i) * COFS_BLOCK_SIZE;
+                        size_t len = run * COFS_BLOCK_SIZE, done = 0;
+                        while (done < len) {
+                                ssize_t w = pwrite(fd, src + done, len - done, off + done);
+                                if (w < 0 && errno == EINTR)
+                                        continue;
+                                if (w <= 0) {
+                                        PRINT_ERR("Cannot write image %s: %s\n", tmp_path, strerror(errno));
+                                        ret = false;
+                                        break;
+                                }
+                                done += w;
+                        }
+                        i += run + 1;
+                }
+
+                b += n;
+        }
+
+        ret = ret && ftruncate(fd, (off_t) n_blocks * COFS_BLOCK_SIZE) == 0
+                  && fsync(fd) == 0;
+        ret = close(fd) == 0 && ret;
+
+        if (ret && rename(tmp_path, path) == -1) {
+                PRINT_ERR("Cannot replace image %s: %s\n", path, strerror(errno));
+                ret = false;
+        }
+        if (!ret)
+                unlink(tmp_path);
+
+        PRINT_DBG("%s in-memory filesystem to %s\n", ret ? "Saved" : "Failed to save", path);
+
+        free(iov);
+        free(buf);
+        free(tmp_path);
+        return ret;
+}
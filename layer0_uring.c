@@ -0,0 +1,396 @@
+/* layer0_uring.c - COFS layer 0 io_uring engine
+ *
+ * Like the pio engine, but the runs of blocks handed to `layer0_readv()`/
+ * `layer0_writev()` are queued on an io_uring and submitted with a single
+ * io_uring_enter(2), so up to URING_DEPTH requests are in flight at once.
+ * Single-block requests gain nothing from the ring and go straight to
+ * pread(2)/pwrite(2).
+ *
+ * We talk to the kernel through the raw syscalls so that COFS does not
+ * need liburing to build.
+ */
+
+#define _GNU_SOURCE
+#include "layer0_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "cofs_parameters.h"
+#include "cofs_util.h"
+#include "cofs_errno.h"
+
+#define URING_DEPTH             64U
+
+// longest run of blocks moved by a single READV/WRITEV request (1 MiB)
+#define URING_MAX_RUN           256U
+
+static int dev_fd = -1;
+static int ring_fd = -1;
+
+/* submission queue */
+static struct {
+        unsigned *head, *tail, *mask, *array;
+        unsigned entries;
+        struct io_uring_sqe *sqes;
+} sq;
+
+/* completion queue */
+static struct {
+        unsigned *head, *tail, *mask;
+        struct io_uring_cqe *cqes;
+} cq;
+
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+
+/* there is one ring, shared by the FUSE threads and the background flusher;
+ * neither queue may be filled or reaped by two transfers at once
+ */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool __uring_setup(void)
+{
+        struct io_uring_params params;
+        memset(&params, 0, sizeof params);
+
+        ring_fd = (int) syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+        if (ring_fd < 0) {
+                PRINT_ERR("Cannot create io_uring: %s\n", strerror(errno));
+                return false;
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        // newer kernels let us map both rings with one call
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+                if (cq_ring_size > sq_ring_size)
+                        sq_ring_size = cq_ring_size;
+                cq_ring_size = sq_ring_size;
+        }
+
+        sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+                goto fail;
+
+        cq_ring = single_mmap ? sq_ring
+                              : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+                goto fail;
+
+        sq.sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sq.sqes == MAP_FAILED)
+                goto fail;
+
+        sq.head = (unsigned *) ((char *) sq_ring + params.sq_off.head);
+        sq.tail = (unsigned *) ((char *) sq_ring + params.sq_off.tail);
+        sq.mask = (unsigned *) ((char *) sq_ring + params.sq_off.ring_mask);
+        sq.array = (unsigned *) ((char *) sq_ring + params.sq_off.array);
+        sq.entries = params.sq_entries;
+
+        cq.head = (unsigned *) ((char *) cq_ring + params.cq_off.head);
+        cq.tail = (unsigned *) ((char *) cq_ring + params.cq_off.tail);
+        cq.mask = (unsigned *) ((char *) cq_ring + params.cq_off.ring_mask);
+        cq.cqes = (struct io_uring_cqe *) ((char *) cq_ring + params.cq_off.cqes);
+
+        return true;
+
+fail:
+        PRINT_ERR("Cannot map io_uring: %s\n", strerror(errno));
+        if (sq_ring != MAP_FAILED && sq_ring != NULL)
+                munmap(sq_ring, sq_ring_size);
+        if (!single_mmap && cq_ring != MAP_FAILED && cq_ring != NULL)
+                munmap(cq_ring, cq_ring_size);
+        close(ring_fd);
+        sq_ring = cq_ring = NULL;
+        ring_fd = -1;
+        return false;
+}
+
+static void __uring_destroy(void)
+{
+        if (ring_fd < 0)
+                return;
+
+        munmap(sq.sqes, sqes_size);
+        if (cq_ring != sq_ring)
+                munmap(cq_ring, cq_ring_size);
+        munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+
+        sq_ring = cq_ring = NULL;
+        ring_fd = -1;
+}
+
+// redoes run `r` of a ring transfer synchronously
+static int __uring_redo_run(const struct layer0_iovec iov[], const size_t run_start[], size_t r, bool write)
+{
+        size_t first = run_start[r];
+        size_t len = run_start[r + 1] - first;
+        return write ? pio_writev(dev_fd, iov + first, len)
+                     : pio_readv(dev_fd, iov + first, len);
+}
+
+/* Runs a vectored transfer through the ring. Each run of consecutive disk blocks
+ * (at most URING_MAX_RUN long) becomes one READV/WRITEV request. Short or failed
+ * runs are redone synchronously so callers see all-or-nothing semantics per block.
+ * Transfers from different threads take turns on the ring.
+ */
+static int __uring_transfer(bool write, const struct layer0_iovec iov[], size_t count)
+{
+        struct iovec *vecs = calloc(count, sizeof(struct iovec));
+        size_t *run_start = calloc(count + 1, sizeof(size_t));
+        if (vecs == NULL || run_start == NULL) {
+                free(vecs);
+                free(run_start);
+                cofs_errno = ENOMEM;
+                return -1;
+        }
+
+        size_t n_runs = 0;
+        for (size_t i = 0; i < count; i++) {
+                vecs[i].iov_base = iov[i].buf;
+                vecs[i].iov_len = COFS_BLOCK_SIZE;
+        }
+        for (size_t i = 0; i < count; i += layer0_contiguousRun(iov + i, count - i, URING_MAX_RUN))
+                run_start[n_runs++] = i;
+        run_start[n_runs] = count;
+
+        size_t queued = 0, completed = 0;
+        unsigned pending = 0;   // in the SQ but not yet consumed by the kernel
+        unsigned inflight = 0;  // consumed by the kernel but not yet completed
+        bool ring_failed = false;
+        int ret = 0;
+
+        pthread_mutex_lock(&ring_lock);
+        while (completed < n_runs) {
+                /* fill the submission queue */
+                unsigned tail = *sq.tail;
+                while (queued < n_runs && inflight + pending < sq.entries) {
+                        unsigned idx = tail & *sq.mask;
+                        struct io_uring_sqe *sqe = &sq.sqes[idx];
+                        size_t first = run_start[queued];
+
+                        memset(sqe, 0, sizeof *sqe);
+                        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+                        sqe->fd = dev_fd;
+                        sqe->addr = (unsigned long) &vecs[first];
+                        sqe->len = run_start[queued + 1] - first;
+                        sqe->off = (uint64_t) iov[first].bnum * COFS_BLOCK_SIZE;
+                        sqe->user_data = queued;
+
+                        sq.array[idx] = idx;
+                        ++tail;
+                        ++queued;
+                        ++pending;
+                }
+                __atomic_store_n(sq.tail, tail, __ATOMIC_RELEASE);
+
+                int n = (int) syscall(__NR_io_uring_enter, ring_fd, pending, 1,
+                                      IORING_ENTER_GETEVENTS, NULL, 0);
+                if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                        if (!ring_failed) {
+                                // the ring is unusable: take back whatever the kernel hasn't
+                                // consumed and finish those requests (and any we haven't
+                                // queued yet) synchronously
+                                ring_failed = true;
+                                PRINT_ERR("io_uring_enter failed: %s\n", strerror(errno));
+                                __atomic_store_n(sq.tail, tail - pending, __ATOMIC_RELEASE);
+                                for (size_t r = queued - pending; r < n_runs; r++) {
+                                        if (__uring_redo_run(iov, run_start, r, write) == -1)
+                                                ret = -1;
+                                        ++completed;
+                                }
+                                queued = n_runs;
+                                pending = 0;
+                        } else {
+                                /* the kernel still owns the iovecs and buffers of the
+                                 * requests in flight, so nothing may be freed until they
+                                 * complete: keep polling the completion queue for them
+                                 */
+                                sched_yield();
+                        }
+                        if (inflight == 0)
+                                break;
+                        n = 0;
+                } else if (n < 0) {
+                        n = 0;
+                }
+                pending -= n;
+                inflight += n;
+
+                /* reap whatever has completed */
+                unsigned head = *cq.head;
+                while (head != __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe *cqe = &cq.cqes[head & *cq.mask];
+                        size_t r = cqe->user_data;
+                        size_t expected = (run_start[r + 1] - run_start[r]) * COFS_BLOCK_SIZE;
+
+                        if ((cqe->res < 0 || (size_t) cqe->res != expected)
+                            && __uring_redo_run(iov, run_start, r, write) == -1)
+                        {
+                                ret = -1;
+                        }
+
+                        ++head;
+                        ++completed;
+                        --inflight;
+                }
+                __atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&ring_lock);
+
+        free(vecs);
+        free(run_start);
+
+        if (ret == -1)
+                cofs_errno = EIO;
+        return ret;
+}
+
+// sets up the ring for a freshly opened `dev_fd`, closing it again if that fails
+static bool __uring_attach(void)
+{
+        if (dev_fd < 0)
+                return false;
+
+        if (!__uring_setup()) {
+                pio_close(dev_fd);
+                dev_fd = -1;
+                return false;
+        }
+
+        return true;
+}
+
+static bool __uring_open(const char *path, size_t *size)
+{
+        dev_fd = pio_openDevice(path, layer0_opts.direct ? O_DIRECT : 0, size);
+        return __uring_attach();
+}
+
+static bool __uring_open_mem(size_t memsize)
+{
+        dev_fd = pio_openMem(memsize);
+        return __uring_attach();
+}
+
+static bool __uring_teardown(void)
+{
+        __uring_destroy();
+
+        bool ret = pio_close(dev_fd);
+        dev_fd = -1;
+        return ret;
+}
+
+static int __uring_read(block_reference bnum, void *buf)
+{
+        return pio_read(dev_fd, bnum, buf);
+}
+
+static int __uring_write(block_reference bnum, const void *buf)
+{
+        return pio_write(dev_fd, bnum, buf);
+}
+
+/* With O_DIRECT the kernel rejects misaligned buffers, so run the transfer against
+ * an aligned staging area instead, copying in before a write or out after a read.
+ */
+static int __uring_transfer_bounced(bool write, const struct layer0_iovec iov[], size_t count)
+{
+        size_t n_misaligned = 0;
+        for (size_t i = 0; i < count; i++)
+                n_misaligned += !pio_isAligned(iov[i].buf);
+
+        if (n_misaligned == 0)
+                return __uring_transfer(write, iov, count);
+
+        unsigned char *staging = aligned_alloc(COFS_BLOCK_SIZE, n_misaligned * COFS_BLOCK_SIZE);
+        struct layer0_iovec *staged = calloc(count, sizeof(struct layer0_iovec));
+        int ret = -1;
+        if (staging == NULL || staged == NULL) {
+                cofs_errno = ENOMEM;
+                goto cleanup;
+        }
+
+        for (size_t i = 0, slot = 0; i < count; i++) {
+                staged[i] = iov[i];
+                if (pio_isAligned(iov[i].buf))
+                        continue;
+
+                staged[i].buf = staging + (slot++) * COFS_BLOCK_SIZE;
+                if (write)
+                        memcpy(staged[i].buf, iov[i].buf, COFS_BLOCK_SIZE);
+        }
+
+        ret = __uring_transfer(write, staged, count);
+
+        if (ret == 0 && !write) {
+                for (size_t i = 0; i < count; i++) {
+                        if (staged[i].buf != iov[i].buf)
+                                memcpy(iov[i].buf, staged[i].buf, COFS_BLOCK_SIZE);
+                }
+        }
+
+cleanup:
+        free(staging);
+        free(staged);
+        return ret;
+}
+
+static int __uring_readv(const struct layer0_iovec iov[], size_t count)
+{
+        return __uring_transfer_bounced(false, iov, count);
+}
+
+static int __uring_writev(const struct layer0_iovec iov[], size_t count)
+{
+        return __uring_transfer_bounced(true, iov, count);
+}
+
+static int __uring_flush(block_reference first, size_t count)
+{
+        return pio_flush(dev_fd, first, count);
+}
+
+static void __uring_readahead(block_reference first, size_t count)
+{
+        pio_readahead(dev_fd, first, count);
+}
+
+static int __uring_discard(block_reference first, size_t count)
+{
+        return pio_discard(dev_fd, first, count);
+}
+
+const layer0_backend layer0_uring_backend = {
+        .name           = "uring",
+        .open           = __uring_open,
+        .open_mem       = __uring_open_mem,
+        .read           = __uring_read,
+        .write          = __uring_write,
+        .readv          = __uring_readv,
+        .writev         = __uring_writev,
+        .readahead      = __uring_readahead,
+        .discard        = __uring_discard,
+        .flush          = __uring_flush,
+        .teardown       = __uring_teardown,
+};
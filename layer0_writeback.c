@@ -0,0 +1,197 @@
+/* layer0_writeback.c - COFS layer 0 deferred writeback
+ *
+ * Under the `interval' and `on-fsync' policies, writes are not pushed out to
+ * the backing store as they happen. Instead each written block sets a bit in
+ * a dirty bitmap, and a flush walks the bitmap handing every run of adjacent
+ * dirty blocks to the engine's `flush` op in one call. Under `interval' a
+ * background thread does this every `writeback_interval_ms`, after writing out
+ * the buffer cache's dirty buffers.
+ */
+
+#include "layer0_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "cofs_util.h"
+
+#define BITS_PER_WORD           (sizeof(unsigned long) * CHAR_BIT)
+
+static const layer0_backend *engine;
+
+static unsigned long *dirty_map;
+static size_t dirty_words;
+
+/* background flusher state */
+static pthread_t flusher;
+static bool flusher_running = false;
+static bool flusher_stop = false;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+
+// serializes flushes between the flusher thread and layer0_flush()
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *__flusher_main(void *arg)
+{
+        (void) arg;
+
+        pthread_mutex_lock(&flusher_lock);
+        while (!flusher_stop) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += layer0_opts.writeback_interval_ms / 1000;
+                deadline.tv_nsec += (long) (layer0_opts.writeback_interval_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                        deadline.tv_sec += 1;
+                        deadline.tv_nsec -= 1000000000L;
+                }
+
+                int r = pthread_cond_timedwait(&flusher_wake, &flusher_lock, &deadline);
+                if (flusher_stop)
+                        break;
+                if (r != ETIMEDOUT)
+                        continue;
+
+                // the buffer cache first, so its dirty buffers reach the device even when idle
+                pthread_mutex_unlock(&flusher_lock);
+                cache_flush();
+                writeback_flush();
+                pthread_mutex_lock(&flusher_lock);
+        }
+        pthread_mutex_unlock(&flusher_lock);
+
+        return NULL;
+}
+
+bool writeback_init(const layer0_backend *backend, size_t n_blocks)
+{
+        engine = backend;
+
+        if (layer0_opts.writeback == LAYER0_WRITEBACK_SYNC)
+                return true;
+
+        dirty_words = (n_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        CALLOC_CHECK(dirty_map, dirty_words, sizeof(unsigned long));
+        if (dirty_map == NULL)
+                return false;
+
+        if (layer0_opts.writeback != LAYER0_WRITEBACK_INTERVAL)
+                return true;
+
+        if (layer0_opts.writeback_interval_ms == 0) {
+                PRINT_ERR("Writeback interval must be non-zero\n");
+                return false;
+        }
+
+        flusher_stop = false;
+        int r = pthread_create(&flusher, NULL, __flusher_main, NULL);
+        if (r != 0) {
+                PRINT_ERR("Cannot start writeback thread: %s\n", strerror(r));
+                return false;
+        }
+
+        flusher_running = true;
+        return true;
+}
+
+void writeback_markBlockDirty(block_reference bnum)
+{
+        if (dirty_map == NULL)
+                return;
+
+        __atomic_fetch_or(&dirty_map[bnum / BITS_PER_WORD], 1UL << (bnum % BITS_PER_WORD),
+                          __ATOMIC_RELAXED);
+}
+
+void writeback_markDirty(const struct layer0_iovec iov[], size_t count)
+{
+        if (dirty_map == NULL)
+                return;
+
+        for (size_t i = 0; i < count; i++)
+                writeback_markBlockDirty(iov[i].bnum);
+}
+
+bool writeback_flush(void)
+{
+        if (dirty_map == NULL || engine->flush == NULL)
+                return true;
+
+        bool ret = true;
+        block_reference run_start = 0;
+        size_t run_len = 0;
+
+        pthread_mutex_lock(&flush_lock);
+        for (size_t w = 0; w < dirty_words; w++) {
+                // claim the word; anything written after this point is caught next time
+                unsigned long bits = __atomic_load_n(&dirty_map[w], __ATOMIC_RELAXED) == 0 ? 0
+                                     : __atomic_exchange_n(&dirty_map[w], 0, __ATOMIC_ACQ_REL);
+
+                if (bits == ~0UL && run_len > 0 && run_start + run_len == w * BITS_PER_WORD) {
+                        run_len += BITS_PER_WORD;
+                        continue;
+                }
+
+                for (size_t b = 0; b < BITS_PER_WORD; b++) {
+                        if (bits & (1UL << b)) {
+                                if (run_len == 0)
+                                        run_start = w * BITS_PER_WORD + b;
+                                ++run_len;
+                        } else if (run_len > 0) {
+                                if (engine->flush(run_start, run_len) == -1) {
+                                        ret = false;
+                                        // keep the extent dirty so a later flush retries it
+                                        for (size_t i = 0; i < run_len; i++)
+                                                writeback_markBlockDirty(run_start + i);
+                                }
+                                run_len = 0;
+                        }
+
+                        if (run_len == 0 && (bits >> b) <= 1)
+                                break; // nothing else set in this word
+                }
+        }
+
+        if (run_len > 0 && engine->flush(run_start, run_len) == -1) {
+                ret = false;
+                for (size_t i = 0; i < run_len; i++)
+                        writeback_markBlockDirty(run_start + i);
+        }
+        pthread_mutex_unlock(&flush_lock);
+
+        return ret;
+}
+
+void writeback_stopFlusher(void)
+{
+        if (!flusher_running)
+                return;
+
+        pthread_mutex_lock(&flusher_lock);
+        flusher_stop = true;
+        pthread_cond_signal(&flusher_wake);
+        pthread_mutex_unlock(&flusher_lock);
+
+        pthread_join(flusher, NULL);
+        flusher_running = false;
+}
+
+bool writeback_teardown(void)
+{
+        writeback_stopFlusher();
+
+        bool ret = writeback_flush();
+
+        free(dirty_map);
+        dirty_map = NULL;
+        dirty_words = 0;
+
+        return ret;
+}
@@ -14,6 +14,14 @@
 #include "cofs_datablocks.h"
 #include "cofs_errno.h"
 
+// how old an atime may get before relatime updates it anyway
+#define RELATIME_MAX_AGE_SEC    (24 * 60 * 60)
+
+struct layer2_options layer2_opts = {
+        .atime = LAYER2_ATIME_STRICT,
+        .lazytime = false,
+};
+
 void fill_statbuf(struct stat *statbuf, const cofs_inode *inode)
 {
         struct stat out = {
@@ -38,12 +46,13 @@ inode_reference namei(const char *pathname)
         if (parent == INODE_MISSING)
                 return INODE_MISSING;
 
-        cofs_inode inode;
-        if (!read_inode(&inode, parent))
+        cofs_inode *inode = iget(parent);
+        if (inode == NULL)
                 return INODE_MISSING;
 
-        const char *dirent = gnu_basename(pathname);
-        return Dir_lookup(&inode, dirent);
+        inode_reference inum = Dir_lookup(inode, gnu_basename(pathname));
+        iput(inode);
+        return inum;
 }
 
 inode_reference namei_parent(const char *pathname)
@@ -51,10 +60,10 @@ inode_reference namei_parent(const char *pathname)
         if (strcmp(pathname, "/") == 0)
                 return sblock_incore.root_dir;
 
-        cofs_inode inode;
         inode_reference inum = sblock_incore.root_dir;
-        if (!read_inode(&inode, inum))
-                        return INODE_MISSING;
+        cofs_inode *inode = iget(inum);
+        if (inode == NULL)
+                return INODE_MISSING;
 
         ++pathname; // skip past the leading / character
 
@@ -62,32 +71,30 @@ inode_reference namei_parent(const char *pathname)
         char *strtok_arg = dirname(pathname_mut);
         const char *dirent;
         while ((dirent = strtok(strtok_arg, "/")) != NULL) {
-                if (inode.type == INODE_TYPE_SYML) {
+                if (inode->type == INODE_TYPE_SYML) {
                         // don't think this should ever happen?
-                } else if (inode.type != INODE_TYPE_DIR) {
+                } else if (inode->type != INODE_TYPE_DIR) {
                         cofs_errno = ENOTDIR;
                         inum = INODE_MISSING;
                         goto cleanup;
                 }
 
-                inum = Dir_lookup(&inode, dirent);
+                inum = Dir_lookup(inode, dirent);
+                iput(inode);
 
-                if (inum == INODE_MISSING
-                    || !read_inode(&inode, inum))
-                {
+                if (inum == INODE_MISSING || (inode = iget(inum)) == NULL) {
+                        inode = NULL;
                         inum = INODE_MISSING;
                         goto cleanup;
                 }
 
-                // RIP this for being so expensive LOL
-                update_inode_atime(&inode);
-                if (!write_inode(&inode, inode.inum))
-                        goto cleanup;
+                touch_inode_atime(inode);
 
                 strtok_arg = NULL;
         }
 
 cleanup:
+        iput(inode);
         free(pathname_mut);
         return inum;
 }
@@ -202,6 +209,35 @@ bool update_inode_atime(cofs_inode *inode)
         return clock_gettime(CLOCK_REALTIME, &inode->atim) == 0;
 }
 
+static int __timespec_comp(const struct timespec *a, const struct timespec *b)
+{
+        if (a->tv_sec != b->tv_sec)
+                return (a->tv_sec > b->tv_sec) - (a->tv_sec < b->tv_sec);
+        return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
+
+bool touch_inode_atime(cofs_inode *inode)
+{
+        if (layer2_opts.atime == LAYER2_ATIME_NOATIME)
+                return true;
+
+        struct timespec now;
+        if (clock_gettime(CLOCK_REALTIME, &now) != 0)
+                return false;
+
+        // relatime only keeps track of whether a file was read since it was last changed
+        if (layer2_opts.atime == LAYER2_ATIME_RELATIME
+            && __timespec_comp(&inode->atim, &inode->mtim) > 0
+            && __timespec_comp(&inode->atim, &inode->ctim) > 0
+            && now.tv_sec - inode->atim.tv_sec < RELATIME_MAX_AGE_SEC)
+        {
+                return true;
+        }
+
+        inode->atim = now;
+        return layer2_opts.lazytime ? mark_inode_time_dirty(inode) : mark_inode_dirty(inode);
+}
+
 // TODO: check which of these should also modify the access time
 bool update_inode_mtime(cofs_inode *inode)
 {
@@ -8,6 +8,24 @@
 
 #define INODE_MISSING           (SIZE_MAX)
 
+/* When reading a file or directory (or walking through one) updates its atime */
+typedef enum {
+        LAYER2_ATIME_STRICT = 0,        /* on every access */
+        LAYER2_ATIME_RELATIME,          /* if it isn't newer than mtime/ctime, or is a day old */
+        LAYER2_ATIME_NOATIME,           /* never */
+} layer2_atime_mode;
+
+/**
+ * Tunables for layer 2; `layer2_opts` starts out holding the default configuration
+ */
+struct layer2_options {
+        layer2_atime_mode atime;
+        /* keep atime updates in the in-core inode until it is synced or evicted */
+        bool lazytime;
+};
+
+extern struct layer2_options layer2_opts;
+
 /**
  * Populates a statbuf from the given inode. Basically getattr() without the FUSE
  * @param statbuf
@@ -123,6 +141,14 @@ bool check_exec_permission(uid_t uid, gid_t gid, const cofs_inode *ino);
  */
 bool update_inode_atime(cofs_inode *inode);
 
+/**
+ * Records an access to an in-core inode, updating its atim field as
+ * `layer2_opts` asks for and marking the inode dirty if it was changed
+ * @param inode an inode obtained from `iget()`
+ * @return `true` on success, else `false`
+ */
+bool touch_inode_atime(cofs_inode *inode);
+
 /**
  * Updates the inode's mtim field with the current wall clock time
  * @param inode Inode to update
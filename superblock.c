@@ -6,11 +6,21 @@
 #include "cofs_data_structures.h"
 #include "layer0.h"
 
+#include <string.h>
+
 cofs_superblock sblock_incore;
 
 const unsigned char ZERO_BLOCK[COFS_BLOCK_SIZE] = {0};
 
 int update_superblock(void)
 {
-        return layer0_writeBlock(0, &sblock_incore);
+        // goes through the buffer cache, which coalesces back-to-back updates
+        layer0_buffer *buf = layer0_claimBuffer(0);
+        if (buf == NULL)
+                return -1;
+
+        memcpy(buf->data, &sblock_incore, sizeof(sblock_incore));
+        int ret = layer0_writeBuffer(buf);
+        layer0_putBuffer(buf);
+        return ret;
 }
\ No newline at end of file
@@ -0,0 +1,167 @@
+//
+// Block allocator throughput: the linked free list against the free-space
+// bitmap, popping a batch of blocks and appending them back, both in the
+// order they came out and shuffled (as files freed in some other order would).
+//
+// The second part has several threads doing the same at once, either straight
+// on the shared allocator or through their per-thread magazines.
+//
+// usage: alloc.bench [batch [rounds]]
+//
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#include <cstdlib>
+
+#include "cofs_test.h"
+
+using namespace std;
+
+static const size_t memsize = 1024 * MEGABYTE;
+
+static size_t batch = 50'000;
+static unsigned rounds = 5;
+
+struct config {
+        const char *name;
+        size_t allocator;       // mkfs_allocator
+        bool shuffle;           // append in a different order than popped
+};
+
+static const config configs[] = {
+        {"list, in order",      COFS_ALLOC_FREELIST,    false},
+        {"bitmap, in order",    COFS_ALLOC_BITMAP,      false},
+        {"list, shuffled",      COFS_ALLOC_FREELIST,    true},
+        {"bitmap, shuffled",    COFS_ALLOC_BITMAP,      true},
+};
+
+static double mops(size_t ops, bench_clock::time_point start)
+{
+        return ops / seconds_since(start) / 1e6;
+}
+
+static void bench(const config &cfg)
+{
+        mkfs_allocator = cfg.allocator;
+        if (!layer0_init(NULL, memsize)) {
+                cerr << cfg.name << ": failed to init layer 0" << endl;
+                return;
+        }
+
+        mt19937_64 rng(270);
+        vector<block_reference> blocks(batch);
+        double pop_rate = 0, append_rate = 0;
+        size_t free_before = sblock_incore.free_blocks;
+        bool ok = true;
+
+        for (unsigned r = 0; r < rounds && ok; r++) {
+                auto start = bench_clock::now();
+                for (size_t i = 0; i < batch; i++)
+                        if ((blocks[i] = FreeList_pop()) == 0)
+                                ok = false;
+                pop_rate += mops(batch, start);
+
+                if (cfg.shuffle)
+                        shuffle(blocks.begin(), blocks.end(), rng);
+
+                start = bench_clock::now();
+                for (size_t i = 0; i < batch; i++)
+                        if (!FreeList_append(blocks[i]))
+                                ok = false;
+                append_rate += mops(batch, start);
+        }
+
+        cout << left << setw(20) << cfg.name << right << fixed << setprecision(2);
+        if (!ok || sblock_incore.free_blocks != free_before)
+                cout << setw(10) << "failed" << endl;
+        else
+                cout << setw(10) << pop_rate / rounds << setw(10) << append_rate / rounds << endl;
+
+        layer0_teardown();
+}
+
+// each thread pops its share of `batch` blocks and appends them back, `rounds` times
+static bool worker(size_t count, bool local)
+{
+        vector<block_reference> blocks(count);
+        for (unsigned r = 0; r < rounds; r++) {
+                for (size_t i = 0; i < count; i++)
+                        if ((blocks[i] = local ? FreeList_popLocal(0) : FreeList_pop()) == 0)
+                                return false;
+                for (size_t i = 0; i < count; i++)
+                        if (!(local ? FreeList_appendLocal(blocks[i]) : FreeList_append(blocks[i])))
+                                return false;
+        }
+
+        return true;
+}
+
+static void bench_threads(size_t allocator, unsigned n_threads)
+{
+        mkfs_allocator = allocator;
+        double rates[2];
+
+        for (bool local : {false, true}) {
+                if (!layer0_init(NULL, memsize)) {
+                        cerr << "failed to init layer 0" << endl;
+                        return;
+                }
+
+                size_t free_before = sblock_incore.free_blocks;
+                vector<thread> threads;
+                vector<char> ok(n_threads);
+                auto start = bench_clock::now();
+                for (unsigned t = 0; t < n_threads; t++)
+                        threads.emplace_back([&, t] { ok[t] = worker(batch / n_threads, local); });
+                for (thread &t : threads)
+                        t.join();
+                rates[local] = mops(2 * rounds * (batch / n_threads) * n_threads, start);
+
+                // a negative rate marks a failed run
+                if (find(ok.begin(), ok.end(), false) != ok.end()
+                    || !FreeList_drainMagazines() || sblock_incore.free_blocks != free_before)
+                        rates[local] = -1;
+
+                layer0_teardown();
+        }
+
+        cout << left << setw(8) << (allocator == COFS_ALLOC_BITMAP ? "bitmap" : "list")
+             << setw(12) << n_threads << right << fixed << setprecision(2);
+        for (double rate : rates) {
+                if (rate < 0)
+                        cout << setw(12) << "failed";
+                else
+                        cout << setw(12) << rate;
+        }
+        cout << endl;
+}
+
+int main(int argc, char **argv)
+{
+        if (argc > 1)
+                batch = strtoul(argv[1], nullptr, 10);
+        if (argc > 2)
+                rounds = strtoul(argv[2], nullptr, 10);
+
+        cout << "popping and appending back " << batch << " blocks, " << rounds
+             << " rounds, on a " << memsize / MEGABYTE << " MiB in-memory filesystem" << endl;
+        cout << left << setw(20) << "config" << right << setw(10) << "pop" << setw(10) << "append"
+             << "  (Mops/s)" << endl;
+
+        for (const config &cfg : configs)
+                bench(cfg);
+
+        cout << endl << "the same split over several threads, pop and append together (Mops/s)" << endl;
+        cout << left << setw(8) << "alloc" << setw(12) << "threads" << right << setw(12) << "shared"
+             << setw(12) << "magazines" << endl;
+        for (size_t allocator : {COFS_ALLOC_FREELIST, COFS_ALLOC_BITMAP})
+                for (unsigned n_threads : {1U, 2U, 4U, 8U})
+                        bench_threads(allocator, n_threads);
+
+        return 0;
+}
@@ -0,0 +1,142 @@
+//
+// Buffer cache contention: N threads getting and releasing random blocks at
+// once, with the cache behind a single lock and split into shards.
+//
+// usage: cachescale.bench [max_threads [ops_per_thread]]
+//
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "cofs_test.h"
+
+using namespace std;
+
+static const size_t memsize = 512 * MEGABYTE;
+static const unsigned cache_mb = 64;
+
+static unsigned max_threads = 64;
+static size_t ops_per_thread = 200'000;
+
+struct config {
+        const char *name;
+        unsigned shards;        // layer0_opts.cache_shards; 0 picks automatically
+        size_t span;            // blocks the reads are spread over
+};
+
+static const config configs[] = {
+        // everything fits in the cache: only the lookup path is measured
+        {"1 shard, hits",       1, cache_mb * MEGABYTE / COFS_BLOCK_SIZE / 2},
+        {"sharded, hits",       0, cache_mb * MEGABYTE / COFS_BLOCK_SIZE / 2},
+        // 4x the cache: mostly misses, so eviction and reads in as well
+        {"1 shard, misses",     1, 4 * cache_mb * MEGABYTE / COFS_BLOCK_SIZE},
+        {"sharded, misses",     0, 4 * cache_mb * MEGABYTE / COFS_BLOCK_SIZE},
+};
+
+static void worker(unsigned seed, size_t span, uint64_t *sink, bool *ok)
+{
+        mt19937_64 rng(seed);
+        uniform_int_distribution<block_reference> pick(1, span);
+        uint64_t sum = 0;
+
+        for (size_t i = 0; i < ops_per_thread; i++) {
+                block_reference b = pick(rng);
+                layer0_buffer *buf = layer0_getBuffer(b);
+                if (buf == NULL) {
+                        *ok = false;
+                        return;
+                }
+                sum += ((const uint64_t *) buf->data)[b % (COFS_BLOCK_SIZE / sizeof(uint64_t))];
+                layer0_putBuffer(buf);
+        }
+
+        *sink = sum;
+}
+
+// @return aggregate throughput in millions of buffers per second, else -1
+static double run(const config &cfg, unsigned n_threads)
+{
+        vector<thread> threads;
+        vector<uint64_t> sinks(n_threads);
+        vector<char> oks(n_threads, true);
+
+        auto start = bench_clock::now();
+        for (unsigned t = 0; t < n_threads; t++)
+                threads.emplace_back(worker, 270 + t, cfg.span, &sinks[t], (bool *) &oks[t]);
+        for (auto &th : threads)
+                th.join();
+        double secs = seconds_since(start);
+
+        for (unsigned t = 0; t < n_threads; t++) {
+                if (!oks[t])
+                        return -1;
+                bench_sink += sinks[t];
+        }
+
+        return n_threads * ops_per_thread / secs / 1e6;
+}
+
+static void bench(const config &cfg)
+{
+        layer0_opts.cache_mb = cache_mb;
+        layer0_opts.cache_shards = cfg.shards;
+        if (!layer0_init(NULL, memsize)) {
+                cerr << cfg.name << ": failed to init layer 0" << endl;
+                return;
+        }
+
+        // give every block distinct contents, so a mixed-up buffer would show in the sink
+        static unsigned char buf[COFS_BLOCK_SIZE] __attribute__((aligned(COFS_BLOCK_SIZE)));
+        for (block_reference b = 1; b <= cfg.span; b++) {
+                memset(buf, (int) b, sizeof buf);
+                layer0_writeBlock(b, buf);
+        }
+
+        // warm the cache up
+        run(cfg, 1);
+
+        cout << left << setw(20) << cfg.name << right << fixed << setprecision(2);
+        double first = 0, last = 0;
+        for (unsigned n = 1; n <= max_threads; n *= 2) {
+                last = run(cfg, n);
+                if (n == 1)
+                        first = last;
+                if (last < 0)
+                        cout << setw(8) << "failed";
+                else
+                        cout << setw(8) << last;
+        }
+        cout << setw(9) << setprecision(1) << last / first << "x" << endl;
+
+        layer0_teardown();
+}
+
+int main(int argc, char **argv)
+{
+        if (argc > 1)
+                max_threads = strtoul(argv[1], nullptr, 10);
+        if (argc > 2)
+                ops_per_thread = strtoul(argv[2], nullptr, 10);
+
+        // file descriptor reads can be issued from any number of threads at once
+        layer0_setBackend("pio");
+
+        cout << "random buffer gets against a " << cache_mb << " MiB cache, " << ops_per_thread
+             << " per thread, on " << thread::hardware_concurrency() << " CPUs" << endl;
+        cout << "Mbuf/s by number of threads, and the speedup of the most threads over one" << endl;
+        cout << left << setw(20) << "config" << right;
+        for (unsigned n = 1; n <= max_threads; n *= 2)
+                cout << setw(8) << n;
+        cout << setw(10) << "scaling" << endl;
+
+        for (const config &cfg : configs)
+                bench(cfg);
+
+        return 0;
+}
@@ -0,0 +1,100 @@
+//
+// Latency of the first free after a remount that has to start a new free list
+// block, with the list's tail taken from the superblock against having to find
+// it by walking the list (as on filesystems made before the tail was kept).
+//
+// usage: flisttail.bench [image [size in GiB]]
+//
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+
+#include <cstdlib>
+#include <unistd.h>
+
+#include "cofs_test.h"
+
+using namespace std;
+
+static string image = "/tmp/flisttail.img";
+static size_t size_gb = 4;
+
+static bool make_image()
+{
+        size_t size;
+        if (!layer0_createImage(image.c_str(), size_gb * GIGABYTE)
+            || layer0_mapBlkdev(image.c_str(), &size) == NULL || !mkfs(size)) {
+                cerr << "failed to make " << image << endl;
+                return false;
+        }
+
+        return layer0_teardown();
+}
+
+// takes the whole first block of the list, so the head is full at the next mount
+static bool empty_first_block(vector<block_reference> &popped)
+{
+        if (!layer0_init(image.c_str(), 0) || !FreeList_init(sblock_incore.flist_head))
+                return false;
+
+        block_reference head = sblock_incore.flist_head;
+        while (sblock_incore.flist_head == head) {
+                block_reference b = FreeList_pop();
+                if (b == 0)
+                        return false;
+                popped.push_back(b);
+        }
+
+        return layer0_teardown();
+}
+
+static void bench(const char *name, bool forget_tail, block_reference block)
+{
+        if (!layer0_init(image.c_str(), 0)) {
+                cerr << name << ": failed to mount " << image << endl;
+                return;
+        }
+
+        if (forget_tail)
+                sblock_incore.flist_tail = 0;
+        FreeList_init(sblock_incore.flist_head);
+        size_t free_before = sblock_incore.free_blocks;
+
+        auto start = bench_clock::now();
+        bool ok = FreeList_append(block);
+        double us = seconds_since(start) * 1e6;
+
+        cout << left << setw(24) << name << right << fixed << setprecision(1);
+        if (!ok || sblock_incore.free_blocks != free_before + 1 || sblock_incore.flist_tail != block)
+                cout << setw(12) << "failed" << endl;
+        else
+                cout << setw(12) << us << " us" << endl;
+
+        layer0_teardown();
+}
+
+int main(int argc, char **argv)
+{
+        if (argc > 1)
+                image = argv[1];
+        if (argc > 2)
+                size_gb = strtoul(argv[2], nullptr, 10);
+
+        cout << "first free into a new free list block after remount, on a " << size_gb
+             << " GiB image (" << size_gb * GIGABYTE / COFS_BLOCK_SIZE << " blocks)" << endl;
+
+        vector<block_reference> popped;
+        if (!make_image() || !empty_first_block(popped) || popped.size() < 2) {
+                cerr << "failed to set up " << image << endl;
+                return EXIT_FAILURE;
+        }
+
+        // the head stays full, so each of these starts a block of its own at the tail
+        bench("tail from superblock", false, popped[0]);
+        bench("tail found by walking", true, popped[1]);
+
+        unlink(image.c_str());
+        return 0;
+}
@@ -0,0 +1,110 @@
+//
+// Random-read throughput of an in-memory filesystem with and without huge pages.
+//
+// usage: randread.bench [size_mb [n_reads]]
+//
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "cofs_test.h"
+
+using namespace std;
+
+static size_t memsize = 1024 * MEGABYTE;
+static size_t n_reads = 2'000'000;
+
+struct config {
+        const char *name;
+        layer0_hugepage_mode hugepages;
+        bool populate;
+};
+
+static const config configs[] = {
+        {"4k pages",              LAYER0_HUGEPAGES_NONE,    false},
+        {"4k pages + populate",   LAYER0_HUGEPAGES_NONE,    true},
+        {"thp",                   LAYER0_HUGEPAGES_THP,     false},
+        {"thp + populate",        LAYER0_HUGEPAGES_THP,     true},
+        {"hugetlb",               LAYER0_HUGEPAGES_HUGETLB, false},
+        {"hugetlb + populate",    LAYER0_HUGEPAGES_HUGETLB, true},
+};
+
+static void bench(const config &cfg, const vector<block_reference> &targets)
+{
+        layer0_opts.hugepages = cfg.hugepages;
+        layer0_opts.populate = cfg.populate;
+
+        auto start = bench_clock::now();
+        if (!layer0_init(NULL, memsize)) {
+                cerr << cfg.name << ": failed to init layer 0" << endl;
+                return;
+        }
+        double init_time = seconds_since(start);
+
+        // write every block once so reads don't all land on the shared zero page;
+        // without `populate` this is where the page faults are paid
+        static unsigned char buf[COFS_BLOCK_SIZE] __attribute__((aligned(COFS_BLOCK_SIZE)));
+        memset(buf, 0xa5, sizeof buf);
+        size_t n_blocks = memsize / COFS_BLOCK_SIZE;
+        start = bench_clock::now();
+        for (block_reference b = 1; b < n_blocks; b++)
+                layer0_writeBlock(b, buf);
+        double touch_time = seconds_since(start);
+
+        // copy out of the image, as File_readData() does for whole blocks
+        start = bench_clock::now();
+        for (block_reference b : targets)
+                layer0_readBlock(b, buf);
+        double copy_time = seconds_since(start);
+
+        // touch one word per block through a borrowed pointer, which is dominated by TLB misses
+        uint64_t sink = 0;
+        start = bench_clock::now();
+        for (block_reference b : targets) {
+                const uint64_t *p = (const uint64_t *) layer0_getBlockPtr(b);
+                sink += p[b % (COFS_BLOCK_SIZE / sizeof(uint64_t))];
+                layer0_putBlockPtr(p);
+        }
+        double borrow_time = seconds_since(start);
+        bench_sink += sink;
+
+        layer0_teardown();
+
+        double mb = (double) targets.size() * COFS_BLOCK_SIZE / MEGABYTE;
+        cout << left << setw(22) << cfg.name << right << fixed << setprecision(3)
+             << setw(10) << init_time << " s"
+             << setw(10) << touch_time << " s"
+             << setw(12) << setprecision(1) << mb / copy_time << " MB/s"
+             << setw(12) << setprecision(2) << targets.size() / borrow_time / 1e6 << " Mblk/s"
+             << endl;
+}
+
+int main(int argc, char **argv)
+{
+        if (argc > 1)
+                memsize = strtoul(argv[1], nullptr, 10) * MEGABYTE;
+        if (argc > 2)
+                n_reads = strtoul(argv[2], nullptr, 10);
+
+        size_t n_blocks = memsize / COFS_BLOCK_SIZE;
+        mt19937_64 rng(270);
+        uniform_int_distribution<block_reference> pick(0, n_blocks - 1);
+        vector<block_reference> targets(n_reads);
+        for (auto &b : targets)
+                b = pick(rng);
+
+        cout << "random 4 KiB reads over a " << memsize / MEGABYTE << " MiB in-memory filesystem ("
+             << n_reads << " reads)" << endl;
+        cout << left << setw(22) << "config" << right << setw(12) << "init"
+             << setw(12) << "touch" << setw(17) << "copy" << setw(19) << "borrow" << endl;
+
+        for (const config &cfg : configs)
+                bench(cfg, targets);
+
+        return 0;
+}
@@ -0,0 +1,63 @@
+//
+// Shared by the tests and benchmarks: the COFS headers, wrapped for C++, and
+// the sizes, clock and assertion they all use.
+//
+#pragma once
+
+#include <iostream>
+#include <chrono>
+
+#include <cstdint>
+
+extern "C" {
+// the C headers check their struct sizes with _Static_assert, which C++ spells differently
+#define _Static_assert(...)
+#include "layer0.h"
+#include "layer0_backend.h"
+#include "free_list.h"
+#include "superblock.h"
+#include "cofs_mkfs.h"
+#include "cofs_parameters.h"
+#include "cofs_data_structures.h"
+#include "cofs_inode_functions.h"
+#include "cofs_directories.h"
+#include "cofs_dcache.h"
+#include "cofs_errno.h"
+#include "layer2.h"
+#undef _Static_assert
+};
+
+#define MEGABYTE        (1024UL * 1024)
+#define GIGABYTE        (1024UL * MEGABYTE)
+
+using bench_clock = std::chrono::steady_clock;
+
+static inline double seconds_since(bench_clock::time_point start)
+{
+        return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// benchmarks add what they read to this, so the compiler can't discard the loads
+inline uint64_t bench_sink;
+
+// tests record failed assertions here, and `report()` prints the outcome
+inline bool assert_status = true;
+#define ASSERT_EQ(expected, actual)                                                             \
+        do {                                                                                    \
+                if ((expected) != (actual)) {                                                   \
+                        std::cerr << "Assertion failed at " __FILE__ "#" << __LINE__ << ":\n"   \
+                                "\t '" #expected " == " #actual "'" << std::endl <<             \
+                                "\texpected: " << (expected) << std::endl <<                    \
+                                "\tactual: " << (actual) << std::endl;                          \
+                        assert_status = false;                                                  \
+                }                                                                               \
+        } while (0)
+
+// prints whether the assertions since the last report held, and starts over
+static inline bool report(const char *what)
+{
+        (assert_status ? std::cout : std::cerr) << what << (assert_status ? " passed" : " failed") << std::endl;
+        bool ret = assert_status;
+        assert_status = true;
+        return ret;
+}
@@ -0,0 +1,355 @@
+//
+// Correctness of the buffer cache on an image file: pinning past its size,
+// dirty buffers reaching the image, 2Q promotion, the file data cap, and
+// concurrent loading and claiming. Every block of the image starts out stamped
+// with its own number, so whatever the cache hands out can be checked.
+//
+// usage: cache.test [image]
+//
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <vector>
+#include <string>
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cofs_test.h"
+
+static constexpr size_t IMAGE_SIZE = 64 * MEGABYTE;
+// 1 MiB of cache, all in one shard unless a test asks otherwise
+static constexpr size_t CACHE_BUFS = MEGABYTE / COFS_BLOCK_SIZE;
+
+using namespace std;
+
+static string image = "/tmp/cache_test.img";
+
+// the first word of each block as the image starts out, and after `restamp()`
+static uint64_t stamp(block_reference b)
+{
+        return b;
+}
+
+static uint64_t restamp(block_reference b)
+{
+        return ~b;
+}
+
+static uint64_t first_word(const void *data)
+{
+        return *(const uint64_t *) data;
+}
+
+// what the image itself holds in the first word of `b`, behind the cache's back
+static uint64_t on_disk(block_reference b)
+{
+        uint64_t word = 0;
+        int fd = open(image.c_str(), O_RDONLY);
+        if (fd == -1 || pread(fd, &word, sizeof word, b * COFS_BLOCK_SIZE) != sizeof word)
+                word = UINT64_MAX;
+        if (fd != -1)
+                close(fd);
+        return word;
+}
+
+/* The engine's reads are wrapped (see the Makefile) so one can be held open:
+ * a read of `held_block` waits for `claim_done` before it goes to the image,
+ * or gives up waiting after a while, since a claim may rightly wait on it.
+ */
+static atomic<block_reference> held_block{0};
+static atomic<bool> read_started{false}, claim_done{false};
+
+extern "C" int __real_layer0_engineReadv(const struct layer0_iovec iov[], size_t count);
+extern "C" int __wrap_layer0_engineReadv(const struct layer0_iovec iov[], size_t count)
+{
+        if (count == 1 && iov[0].bnum == held_block) {
+                read_started = true;
+                auto start = bench_clock::now();
+                while (!claim_done && seconds_since(start) < 0.2)
+                        this_thread::yield();
+        }
+
+        return __real_layer0_engineReadv(iov, count);
+}
+
+static bool resident(block_reference b)
+{
+        static thread_local char scratch[COFS_BLOCK_SIZE];
+        return cache_read(b, scratch);
+}
+
+static bool make_image()
+{
+        if (!layer0_createImage(image.c_str(), IMAGE_SIZE))
+                return false;
+
+        int fd = open(image.c_str(), O_WRONLY);
+        if (fd == -1)
+                return false;
+
+        bool ok = true;
+        for (block_reference b = 0; ok && b < IMAGE_SIZE / COFS_BLOCK_SIZE; b++) {
+                uint64_t word = stamp(b);
+                ok = pwrite(fd, &word, sizeof word, b * COFS_BLOCK_SIZE) == sizeof word;
+        }
+
+        close(fd);
+        return ok;
+}
+
+// opens the image under a deferred writeback policy, with an empty cache of `shards` shards
+static bool mount(unsigned shards)
+{
+        layer0_opts.cache_mb = CACHE_BUFS * COFS_BLOCK_SIZE / MEGABYTE;
+        layer0_opts.cache_shards = shards;
+        if (!layer0_setBackend("pio") || !layer0_setWriteback("on-fsync") || !layer0_init(image.c_str(), 0)) {
+                cerr << "failed to open " << image << endl;
+                return false;
+        }
+
+        return true;
+}
+
+// gets and releases `count` blocks from `first` on, once each
+static void scan(block_reference first, size_t count)
+{
+        for (block_reference b = first; b < first + count; b++)
+                layer0_putBuffer(layer0_getBuffer(b));
+}
+
+static bool test_pinning()
+{
+        if (!mount(1))
+                return false;
+
+        // three times what the cache holds, all pinned at once
+        const block_reference first = 100;
+        vector<layer0_buffer *> pinned;
+        for (block_reference b = first; b < first + 3 * CACHE_BUFS; b++) {
+                layer0_buffer *buf = layer0_getBuffer(b);
+                ASSERT_EQ(true, buf != nullptr);
+                if (buf == nullptr)
+                        break;
+                ASSERT_EQ(b, buf->bnum);
+                ASSERT_EQ(stamp(b), first_word(buf->data));
+                pinned.push_back(buf);
+        }
+
+        for (size_t i = 1; i < pinned.size(); i++)
+                ASSERT_EQ(true, pinned[i]->data != pinned[i - 1]->data);
+
+        for (layer0_buffer *buf : pinned) {
+                *(uint64_t *) buf->data = restamp(buf->bnum);
+                ASSERT_EQ(0, layer0_writeBuffer(buf));
+        }
+        for (layer0_buffer *buf : pinned)
+                layer0_putBuffer(buf);
+
+        // whether it stayed cached or was an overflow buffer, every block reads back changed
+        for (block_reference b = first; b < first + 3 * CACHE_BUFS; b++) {
+                layer0_buffer *buf = layer0_getBuffer(b);
+                ASSERT_EQ(restamp(b), buf == nullptr ? 0 : first_word(buf->data));
+                layer0_putBuffer(buf);
+        }
+
+        ASSERT_EQ(true, layer0_flush());
+        for (block_reference b = first; b < first + 3 * CACHE_BUFS; b++)
+                ASSERT_EQ(restamp(b), on_disk(b));
+
+        layer0_teardown();
+        return report("pinning past the cache's size");
+}
+
+static bool test_dirty()
+{
+        if (!mount(1))
+                return false;
+
+        const block_reference evicted = 2000, kept = 2001;
+        layer0_buffer *buf = layer0_getBuffer(evicted);
+        *(uint64_t *) buf->data = restamp(evicted);
+        layer0_writeBuffer(buf);
+        layer0_putBuffer(buf);
+
+        // deferred: only the cache has it so far
+        ASSERT_EQ(stamp(evicted), on_disk(evicted));
+
+        // a dirty block pushed out of the cache is written out as it goes...
+        scan(3000, 2 * CACHE_BUFS);
+        ASSERT_EQ(false, resident(evicted));
+        ASSERT_EQ(restamp(evicted), on_disk(evicted));
+
+        // ...and survives a flush afterwards, which writes out one that is still resident
+        buf = layer0_getBuffer(kept);
+        *(uint64_t *) buf->data = restamp(kept);
+        layer0_writeBuffer(buf);
+        layer0_putBuffer(buf);
+        ASSERT_EQ(stamp(kept), on_disk(kept));
+
+        ASSERT_EQ(true, cache_flush());
+        ASSERT_EQ(true, resident(kept));
+        ASSERT_EQ(restamp(evicted), on_disk(evicted));
+        ASSERT_EQ(restamp(kept), on_disk(kept));
+
+        buf = layer0_getBuffer(evicted);
+        ASSERT_EQ(restamp(evicted), buf == nullptr ? 0 : first_word(buf->data));
+        layer0_putBuffer(buf);
+
+        uint64_t block[COFS_BLOCK_SIZE / sizeof(uint64_t)];
+        ASSERT_EQ(0, layer0_readBlock(evicted, block));
+        ASSERT_EQ(restamp(evicted), block[0]);
+
+        layer0_teardown();
+        return report("dirty buffers");
+}
+
+static bool test_2q()
+{
+        if (!mount(1))
+                return false;
+
+        // used once, pushed out, then used again while still remembered on A1out
+        const block_reference hot = 5000, cold = 5001;
+        scan(hot, 1);
+        scan(5100, CACHE_BUFS + CACHE_BUFS / 8);
+        ASSERT_EQ(false, resident(hot));
+        scan(hot, 1);
+        ASSERT_EQ(true, resident(hot));
+
+        // a one-off scan of many times the cache then recycles A1in, not Am
+        scan(cold, 1);
+        scan(6000, 4 * CACHE_BUFS);
+        ASSERT_EQ(true, resident(hot));
+        ASSERT_EQ(false, resident(cold));
+
+        layer0_teardown();
+        return report("2Q promotion");
+}
+
+static bool test_data_cap()
+{
+        if (!mount(1))
+                return false;
+
+        // metadata fills just over half the cache...
+        const size_t n_meta = CACHE_BUFS / 2 + CACHE_BUFS / 8;
+        scan(7000, n_meta);
+
+        // ...and streaming far more file data than the cache holds mustn't push any of it out
+        vector<char> data(16 * COFS_BLOCK_SIZE);
+        for (block_reference b = 9000; b < 9000 + 8 * CACHE_BUFS; b += 16) {
+                struct layer0_iovec iov[16];
+                for (size_t i = 0; i < 16; i++)
+                        iov[i] = {b + i, data.data() + i * COFS_BLOCK_SIZE};
+                ASSERT_EQ(0, layer0_readvData(iov, 16));
+                ASSERT_EQ(stamp(b + 15), first_word(iov[15].buf));
+        }
+
+        size_t meta_left = 0, data_left = 0;
+        for (block_reference b = 7000; b < 7000 + n_meta; b++)
+                meta_left += resident(b);
+        for (block_reference b = 9000; b < 9000 + 8 * CACHE_BUFS; b++)
+                data_left += resident(b);
+        ASSERT_EQ(n_meta, meta_left);
+        ASSERT_EQ(true, data_left > 0 && data_left <= CACHE_BUFS / 4);
+
+        layer0_teardown();
+        return report("file data cap");
+}
+
+static void reader(unsigned seed, block_reference first, size_t span, size_t ops, size_t *bad)
+{
+        mt19937_64 rng(seed);
+        uniform_int_distribution<block_reference> pick(first, first + span - 1);
+
+        for (size_t i = 0; i < ops; i++) {
+                // every other round a batch, so single and batched loads race each other
+                if (i % 2 == 0) {
+                        block_reference b = pick(rng);
+                        layer0_buffer *buf = layer0_getBuffer(b);
+                        if (buf == nullptr || buf->bnum != b || first_word(buf->data) != stamp(b))
+                                ++*bad;
+                        layer0_putBuffer(buf);
+                } else {
+                        block_reference bnums[8];
+                        layer0_buffer *bufs[8];
+                        for (block_reference &b : bnums)
+                                b = pick(rng);
+                        if (layer0_getBuffers(bnums, bufs, 8) == -1) {
+                                ++*bad;
+                                continue;
+                        }
+                        for (size_t j = 0; j < 8; j++) {
+                                if (bufs[j]->bnum != bnums[j] || first_word(bufs[j]->data) != stamp(bnums[j]))
+                                        ++*bad;
+                                layer0_putBuffer(bufs[j]);
+                        }
+                }
+        }
+}
+
+static bool test_threads()
+{
+        // picks shards automatically: one per 64 buffers
+        if (!mount(0))
+                return false;
+
+        // a span a few times the cache, so threads keep missing on the same blocks
+        const unsigned n_threads = 8;
+        vector<thread> threads;
+        vector<size_t> bad(n_threads);
+        for (unsigned t = 0; t < n_threads; t++)
+                threads.emplace_back(reader, t + 1, 12000, 3 * CACHE_BUFS, 20'000, &bad[t]);
+        for (thread &t : threads)
+                t.join();
+
+        for (unsigned t = 0; t < n_threads; t++)
+                ASSERT_EQ(0UL, bad[t]);
+
+        // a block claimed while another thread is reading it in keeps what the claimer wrote
+        const block_reference raced = 14000;
+        held_block = raced;
+        thread getter([] { layer0_putBuffer(layer0_getBuffer(raced)); });
+        while (!read_started)
+                this_thread::yield();
+
+        layer0_buffer *buf = layer0_claimBuffer(raced);
+        *(uint64_t *) buf->data = restamp(raced);
+        claim_done = true;
+        layer0_writeBuffer(buf);
+        layer0_putBuffer(buf);
+        getter.join();
+        held_block = 0;
+
+        buf = layer0_getBuffer(raced);
+        ASSERT_EQ(restamp(raced), buf == nullptr ? 0 : first_word(buf->data));
+        layer0_putBuffer(buf);
+
+        layer0_teardown();
+        return report("concurrent loading and claiming");
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc > 1)
+                image = argv[1];
+
+        if (!make_image()) {
+                cerr << "failed to make " << image << endl;
+                return EXIT_FAILURE;
+        }
+
+        bool ok = test_pinning();
+        ok = test_dirty() && ok;
+        ok = test_2q() && ok;
+        ok = test_data_cap() && ok;
+        ok = test_threads() && ok;
+
+        unlink(image.c_str());
+        return ok ? 0 : 1;
+}
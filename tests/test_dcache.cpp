@@ -0,0 +1,118 @@
+//
+// Behaviour of the directory entry cache, on its own and as the directory
+// functions keep it in step with the directories.
+//
+#include <iostream>
+#include <string>
+
+#include "cofs_test.h"
+
+// mirrors the cache's limit in cofs_dcache.c
+#define DCACHE_MAX_ENTRIES      16384
+
+static constexpr size_t MEMSIZE = 64 * MEGABYTE;
+
+using namespace std;
+
+// what the cache holds for `name` in `dir`: the inode, INODE_MISSING, or 0 on a miss
+static inode_reference cached(inode_reference dir, const char *name)
+{
+        inode_reference inum;
+        return Dcache_lookup(dir, name, &inum) ? inum : 0;
+}
+
+static bool test_entries()
+{
+        const inode_reference dir = 1000, other = 1001;
+
+        ASSERT_EQ(0UL, cached(dir, "a"));
+
+        Dcache_insert(dir, "a", INODE_MISSING);
+        ASSERT_EQ(INODE_MISSING, cached(dir, "a"));
+
+        // a negative entry is overwritten once the name exists
+        Dcache_insert(dir, "a", 7);
+        ASSERT_EQ(7UL, cached(dir, "a"));
+        ASSERT_EQ(0UL, cached(other, "a"));
+
+        Dcache_insert(dir, "b", 8);
+        Dcache_insert(other, "a", 9);
+        Dcache_purgeDir(dir);
+        ASSERT_EQ(0UL, cached(dir, "a"));
+        ASSERT_EQ(0UL, cached(dir, "b"));
+        ASSERT_EQ(9UL, cached(other, "a"));
+
+        // the least recently used entry goes first once the cache is full
+        Dcache_insert(dir, "oldest", 10);
+        for (size_t i = 0; i < DCACHE_MAX_ENTRIES; i++) {
+                if (i == DCACHE_MAX_ENTRIES / 2)
+                        ASSERT_EQ(9UL, cached(other, "a"));
+                Dcache_insert(dir + 2, to_string(i).c_str(), i + 1);
+        }
+        ASSERT_EQ(0UL, cached(dir, "oldest"));
+        ASSERT_EQ(9UL, cached(other, "a"));
+        ASSERT_EQ((inode_reference) DCACHE_MAX_ENTRIES, cached(dir + 2, to_string(DCACHE_MAX_ENTRIES - 1).c_str()));
+
+        Dcache_purgeDir(dir + 2);
+        Dcache_purgeDir(other);
+        return report("dcache entries");
+}
+
+static bool test_directories()
+{
+        if (!layer0_init(nullptr, MEMSIZE) || !FreeList_init(sblock_incore.flist_head) || !ilist_init()) {
+                cerr << "failed to set up a " << MEMSIZE / MEGABYTE << " MiB filesystem" << endl;
+                return false;
+        }
+
+        cofs_inode root;
+        read_inode(&root, sblock_incore.root_dir);
+        ASSERT_EQ(true, create_node(INODE_TYPE_DIR, &root, "d", {.as_int = 0755}, 0, 0));
+        inode_reference d = namei("/d");
+        ASSERT_EQ(true, d != INODE_MISSING);
+
+        // a failed lookup leaves a negative entry...
+        cofs_inode dir;
+        read_inode(&dir, d);
+        ASSERT_EQ(INODE_MISSING, Dir_lookup(&dir, "x"));
+        ASSERT_EQ(INODE_MISSING, cached(d, "x"));
+
+        // ...which creating the name overwrites
+        ASSERT_EQ(true, create_node(INODE_TYPE_FILE, &dir, "x", {.as_int = 0644}, 0, 0));
+        read_inode(&dir, d);
+        inode_reference x = Dir_lookup(&dir, "x");
+        ASSERT_EQ(true, x != INODE_MISSING);
+        ASSERT_EQ(x, cached(d, "x"));
+        ASSERT_EQ(x, namei("/d/x"));
+
+        // removing it makes it negative again
+        ASSERT_EQ(true, Dir_removeEntry(&dir, "x"));
+        ASSERT_EQ(INODE_MISSING, cached(d, "x"));
+        ASSERT_EQ(INODE_MISSING, namei("/d/x"));
+
+        // a removed directory's names are forgotten, so an inode reused for a new one starts clean
+        ASSERT_EQ(true, create_node(INODE_TYPE_FILE, &dir, "y", {.as_int = 0644}, 0, 0));
+        read_inode(&dir, d);
+        ASSERT_EQ(true, Dir_lookup(&dir, "y") != INODE_MISSING);
+        ASSERT_EQ(true, Dir_removeEntry(&dir, "y"));
+        read_inode(&dir, d);
+        ASSERT_EQ(INODE_MISSING, Dir_lookup(&dir, "gone"));
+
+        read_inode(&root, sblock_incore.root_dir);
+        ASSERT_EQ(true, Dir_removeEntry(&root, "d"));
+        ASSERT_EQ(0UL, cached(d, "y"));
+        ASSERT_EQ(0UL, cached(d, "gone"));
+        ASSERT_EQ(INODE_MISSING, namei("/d"));
+
+        evict_inodes();
+        layer0_teardown();
+        return report("dcache in directories");
+}
+
+int main(int argc, char *argv[])
+{
+        bool ok = test_entries();
+        ok = test_directories() && ok;
+
+        return ok ? 0 : 1;
+}
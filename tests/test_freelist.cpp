@@ -7,12 +7,14 @@
 #include <algorithm>
 #include <unordered_set>
 #include <string>
+#include <thread>
 
 #include <cstdlib>
 #include <cstdint>
 #include <cassert>
 #include <ctime>
 #include <cstring>
+#include <unistd.h>
 
 extern "C" {
 #define _Static_assert(...)
@@ -147,6 +149,162 @@ static void test_pop()
         layer0_teardown();
 }
 
+static void test_many(size_t allocator)
+{
+        size_t disk_size_in_bytes = 64 * MEGABYTE;
+        mkfs_allocator = allocator;
+        if (!layer0_init(NULL, disk_size_in_bytes)) {
+                printf("failed to init layer 0\n");
+                exit(EXIT_FAILURE);
+        }
+
+        bool ret = true;
+        size_t free_before = sblock_incore.free_blocks;
+        size_t count = free_before / 2;
+
+        cout << "testing popping " << count << " blocks at once" << endl;
+        vector<block_reference> blocks(count);
+        ASSERT_EQ(count, FreeList_popMany(0, blocks.data(), count), ret);
+        ASSERT_EQ(free_before - count, sblock_incore.free_blocks, ret);
+        unordered_set<block_reference> no_dups(blocks.cbegin(), blocks.cend());
+        ASSERT_EQ(count, no_dups.size(), ret);
+
+        cout << "testing appending them back at once, shuffled" << endl;
+        srand(time(nullptr));
+        for (size_t i = count - 1; i > 0; i--)
+                swap(blocks[i], blocks[rand() % (i + 1)]);
+        ASSERT_EQ(count, FreeList_appendMany(blocks.data(), count), ret);
+        ASSERT_EQ(free_before, sblock_incore.free_blocks, ret);
+
+        cout << "testing that every block can be popped again, and only once" << endl;
+        FreeList_init(sblock_incore.flist_head);
+        blocks.resize(free_before + 1);
+        ASSERT_EQ(free_before, FreeList_popMany(0, blocks.data(), free_before + 1), ret);
+        no_dups = unordered_set<block_reference>(blocks.cbegin(), blocks.cbegin() + free_before);
+        ASSERT_EQ(free_before, no_dups.size(), ret);
+        if (ret)
+                cout << "\tsuccess" << endl;
+
+        layer0_teardown();
+        mkfs_allocator = COFS_ALLOC_FREELIST;
+}
+
+static void test_magazines(size_t allocator)
+{
+        size_t disk_size_in_bytes = 64 * MEGABYTE;
+        mkfs_allocator = allocator;
+        if (!layer0_init(NULL, disk_size_in_bytes)) {
+                printf("failed to init layer 0\n");
+                exit(EXIT_FAILURE);
+        }
+
+        bool ret = true;
+        size_t free_before = sblock_incore.free_blocks;
+        static constexpr unsigned n_threads = 4;
+        static constexpr size_t per_thread = 1000;
+
+        cout << "testing " << n_threads << " threads popping through their magazines at once" << endl;
+        vector<vector<block_reference>> popped(n_threads);
+        vector<thread> threads;
+        for (unsigned t = 0; t < n_threads; t++) {
+                threads.emplace_back([&popped, t] {
+                        for (size_t i = 0; i < per_thread; i++)
+                                popped[t].push_back(FreeList_popLocal(0));
+                });
+        }
+        for (thread &t : threads)
+                t.join();
+        threads.clear();
+
+        unordered_set<block_reference> no_dups;
+        for (const auto &blocks : popped)
+                no_dups.insert(blocks.cbegin(), blocks.cend());
+        ASSERT_EQ(n_threads * per_thread, no_dups.size(), ret);
+        ASSERT_EQ(0UL, no_dups.count(0), ret);
+
+        cout << "testing that they all come back once the threads free them and the magazines drain" << endl;
+        for (unsigned t = 0; t < n_threads; t++) {
+                threads.emplace_back([&popped, t] {
+                        for (block_reference b : popped[t])
+                                FreeList_appendLocal(b);
+                });
+        }
+        for (thread &t : threads)
+                t.join();
+        ASSERT_EQ(true, FreeList_drainMagazines(), ret);
+        ASSERT_EQ(free_before, sblock_incore.free_blocks, ret);
+
+        vector<block_reference> blocks(free_before + 1);
+        ASSERT_EQ(free_before, FreeList_popMany(0, blocks.data(), free_before + 1), ret);
+        no_dups = unordered_set<block_reference>(blocks.cbegin(), blocks.cbegin() + free_before);
+        ASSERT_EQ(free_before, no_dups.size(), ret);
+        if (ret)
+                cout << "\tsuccess" << endl;
+
+        layer0_teardown();
+        mkfs_allocator = COFS_ALLOC_FREELIST;
+}
+
+static void test_tail()
+{
+        const char *image = "/tmp/freelist_tail.img";
+        size_t size;
+        if (!layer0_createImage(image, 64 * MEGABYTE) || layer0_mapBlkdev(image, &size) == NULL
+            || !mkfs(size) || !layer0_teardown()) {
+                printf("failed to make %s\n", image);
+                exit(EXIT_FAILURE);
+        }
+
+        bool ret = true;
+
+        // empty the list's first block, so every later free starts a block of its own
+        layer0_init(image, 0);
+        FreeList_init(sblock_incore.flist_head);
+        vector<block_reference> popped;
+        block_reference head = sblock_incore.flist_head;
+        while (sblock_incore.flist_head == head)
+                popped.push_back(FreeList_pop());
+        size_t free_after_pop = sblock_incore.free_blocks;
+        update_superblock();
+        layer0_teardown();
+
+        cout << "testing a free after remount, with the tail from the superblock" << endl;
+        layer0_init(image, 0);
+        FreeList_init(sblock_incore.flist_head);
+        ASSERT_EQ(true, (sblock_incore.flist_tail != 0), ret);
+        ASSERT_EQ(true, FreeList_append(popped[0]), ret);
+        ASSERT_EQ(popped[0], sblock_incore.flist_tail, ret);
+        update_superblock();
+        layer0_teardown();
+
+        cout << "testing a free after remount, with the tail found by walking the list" << endl;
+        layer0_init(image, 0);
+        sblock_incore.flist_tail = 0;
+        FreeList_init(sblock_incore.flist_head);
+        ASSERT_EQ(true, FreeList_append(popped[1]), ret);
+        ASSERT_EQ(popped[1], sblock_incore.flist_tail, ret);
+        ASSERT_EQ(free_after_pop + 2, sblock_incore.free_blocks, ret);
+        update_superblock();
+        layer0_teardown();
+
+        cout << "testing that both frees are on the list after another remount" << endl;
+        layer0_init(image, 0);
+        FreeList_init(sblock_incore.flist_head);
+        size_t n_free = sblock_incore.free_blocks;
+        ASSERT_EQ(free_after_pop + 2, n_free, ret);
+        vector<block_reference> blocks(n_free + 1);
+        ASSERT_EQ(n_free, FreeList_popMany(0, blocks.data(), n_free + 1), ret);
+        unordered_set<block_reference> no_dups(blocks.cbegin(), blocks.cbegin() + n_free);
+        ASSERT_EQ(n_free, no_dups.size(), ret);
+        ASSERT_EQ(1UL, no_dups.count(popped[0]), ret);
+        ASSERT_EQ(1UL, no_dups.count(popped[1]), ret);
+        if (ret)
+                cout << "\tsuccess" << endl;
+
+        layer0_teardown();
+        unlink(image);
+}
+
 void test_fill(void)
 {
 	size_t disk_size_in_bytes = 3 * MEGABYTE;
@@ -328,6 +486,21 @@ int main(int argc, char **argv)
         cout << endl << "testing freelist push/pop" << endl;
         test_pop();
 
+        cout << endl << "testing freelist batched push/pop" << endl;
+        test_many(COFS_ALLOC_FREELIST);
+
+        cout << endl << "testing bitmap batched push/pop" << endl;
+        test_many(COFS_ALLOC_BITMAP);
+
+        cout << endl << "testing freelist per-thread magazines" << endl;
+        test_magazines(COFS_ALLOC_FREELIST);
+
+        cout << endl << "testing bitmap per-thread magazines" << endl;
+        test_magazines(COFS_ALLOC_BITMAP);
+
+        cout << endl << "testing the freelist tail kept in the superblock" << endl;
+        test_tail();
+
 //	cout << endl << "testing freelist fill up" << endl;
 //	test_fill();
 	return 0;
@@ -0,0 +1,208 @@
+//
+// Behaviour of the in-core inode table, the free-inode bitmap and the atime
+// rules of layer 2, on a small in-memory filesystem.
+//
+#include <iostream>
+#include <cstring>
+#include <ctime>
+
+#include "cofs_test.h"
+
+// mirrors the table's limit in cofs_inode_functions.c
+#define ITABLE_MAX_UNREFERENCED 1024
+
+static constexpr size_t MEMSIZE = 64 * MEGABYTE;
+
+using namespace std;
+
+static bool mount(const char *writeback)
+{
+        if (!layer0_setWriteback(writeback) || !layer0_init(nullptr, MEMSIZE)
+            || !FreeList_init(sblock_incore.flist_head) || !ilist_init()) {
+                cerr << "failed to set up a " << MEMSIZE / MEGABYTE << " MiB filesystem" << endl;
+                return false;
+        }
+
+        return true;
+}
+
+static void unmount()
+{
+        evict_inodes();
+        layer0_teardown();
+        layer0_setWriteback("sync");
+}
+
+// the ilist's copy of an inode, bypassing the inode table
+static cofs_inode on_disk(inode_reference inum)
+{
+        cofs_inode ret = {};
+        layer0_buffer *buf = layer0_getBuffer(1 + inum / INODES_PER_BLOCK);
+        if (buf != nullptr) {
+                memcpy(&ret, (const cofs_inode *) buf->data + inum % INODES_PER_BLOCK, sizeof ret);
+                layer0_putBuffer(buf);
+        }
+
+        return ret;
+}
+
+static bool test_itable()
+{
+        if (!mount("on-fsync"))
+                return false;
+
+        // every iget() of an inode hands out the same in-core copy
+        inode_reference inum = allocate_inode();
+        cofs_inode *a = iget(inum);
+        cofs_inode *b = iget(inum);
+        ASSERT_EQ(true, a != nullptr && a == b);
+
+        a->n_bytes = 1234;
+        mark_inode_dirty(a);
+        ASSERT_EQ(0UL, (size_t) on_disk(inum).n_bytes);
+
+        cofs_inode copy;
+        read_inode(&copy, inum);
+        ASSERT_EQ(1234UL, (size_t) copy.n_bytes);
+
+        // unreferenced, it stays in core (and dirty) until it falls off the LRU
+        iput(a);
+        iput(b);
+        ASSERT_EQ(0UL, (size_t) on_disk(inum).n_bytes);
+
+        for (inode_reference i = inum + 1; i <= inum + ITABLE_MAX_UNREFERENCED; i++)
+                iput(iget(i));
+        ASSERT_EQ(1234UL, (size_t) on_disk(inum).n_bytes);
+
+        // a referenced inode is never evicted, however much else goes through
+        cofs_inode *held = iget(inum);
+        held->n_bytes = 99;
+        mark_inode_dirty(held);
+        for (inode_reference i = inum + 1; i <= inum + 2 * ITABLE_MAX_UNREFERENCED; i++)
+                iput(iget(i));
+        ASSERT_EQ(true, iget(inum) == held);
+        iput(held);
+        ASSERT_EQ(1234UL, (size_t) on_disk(inum).n_bytes);
+
+        ASSERT_EQ(true, sync_inodes());
+        ASSERT_EQ(99UL, (size_t) on_disk(inum).n_bytes);
+
+        // freeing resets the in-core copy, so writing it back can't resurrect the inode
+        held->n_bytes = 4321;
+        mark_inode_dirty(held);
+        ASSERT_EQ(true, free_inode(inum));
+        ASSERT_EQ(0, (int) held->in_use);
+        ASSERT_EQ(0UL, (size_t) held->n_bytes);
+        iput(held);
+
+        ASSERT_EQ(true, evict_inodes());
+        ASSERT_EQ(0, (int) on_disk(inum).in_use);
+        ASSERT_EQ(0UL, (size_t) on_disk(inum).n_bytes);
+
+        unmount();
+        return report("inode table");
+}
+
+static bool test_imap()
+{
+        if (!mount("sync"))
+                return false;
+
+        size_t free_before = sblock_incore.free_inodes;
+        inode_reference a = allocate_inode();
+        inode_reference b = allocate_inode();
+        inode_reference c = allocate_inode();
+        ASSERT_EQ(true, a < b && b < c);
+        ASSERT_EQ(free_before - 3, (size_t) sblock_incore.free_inodes);
+        ASSERT_EQ(1, (int) on_disk(b).in_use);
+
+        // freed inodes are handed out again, lowest first
+        ASSERT_EQ(true, free_inode(b));
+        ASSERT_EQ(free_before - 2, (size_t) sblock_incore.free_inodes);
+        ASSERT_EQ(b, allocate_inode());
+
+        ASSERT_EQ(true, free_inode(c));
+        ASSERT_EQ(true, free_inode(a));
+        ASSERT_EQ(a, allocate_inode());
+        ASSERT_EQ(c, allocate_inode());
+        ASSERT_EQ(free_before - 3, (size_t) sblock_incore.free_inodes);
+
+        // the ilist has the last word: a slot in use behind the bitmap's back is skipped
+        ASSERT_EQ(true, free_inode(b));
+        layer0_buffer *buf = layer0_getBuffer(1 + b / INODES_PER_BLOCK);
+        ((cofs_inode *) buf->data)[b % INODES_PER_BLOCK].in_use = 1;
+        layer0_writeBuffer(buf);
+        layer0_putBuffer(buf);
+        ASSERT_EQ(true, allocate_inode() != b);
+
+        unmount();
+        return report("inode bitmap");
+}
+
+static bool test_atime()
+{
+        if (!mount("sync"))
+                return false;
+
+        struct layer2_options saved = layer2_opts;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        inode_reference inum = allocate_inode();
+        cofs_inode *in = iget(inum);
+        in->in_use = 1;
+        in->atim = {now.tv_sec - 200, 0};
+        in->mtim = in->ctim = {now.tv_sec - 100, 0};
+        mark_inode_dirty(in);
+
+        layer2_opts.atime = LAYER2_ATIME_NOATIME;
+        touch_inode_atime(in);
+        ASSERT_EQ(now.tv_sec - 200, in->atim.tv_sec);
+
+        // relatime: updated when older than mtime/ctime...
+        layer2_opts.atime = LAYER2_ATIME_RELATIME;
+        touch_inode_atime(in);
+        ASSERT_EQ(true, in->atim.tv_sec >= now.tv_sec);
+        ASSERT_EQ(in->atim.tv_nsec, on_disk(inum).atim.tv_nsec);
+
+        // ...but not again until the file changes...
+        struct timespec first = in->atim;
+        touch_inode_atime(in);
+        ASSERT_EQ(first.tv_nsec, in->atim.tv_nsec);
+
+        // ...or the atime is a day old
+        in->atim = {now.tv_sec - 2 * 24 * 60 * 60, 0};
+        in->mtim = in->ctim = {now.tv_sec - 3 * 24 * 60 * 60, 0};
+        touch_inode_atime(in);
+        ASSERT_EQ(true, in->atim.tv_sec >= now.tv_sec);
+
+        // strict: on every access
+        layer2_opts.atime = LAYER2_ATIME_STRICT;
+        in->atim = {now.tv_sec - 1, 0};
+        touch_inode_atime(in);
+        ASSERT_EQ(true, in->atim.tv_sec >= now.tv_sec);
+
+        // lazytime keeps it in core, even under `sync', until the inode is synced
+        layer2_opts.lazytime = true;
+        in->atim = {now.tv_sec - 1, 0};
+        mark_inode_dirty(in);
+        touch_inode_atime(in);
+        ASSERT_EQ(now.tv_sec - 1, on_disk(inum).atim.tv_sec);
+        ASSERT_EQ(true, sync_inodes());
+        ASSERT_EQ(in->atim.tv_sec, on_disk(inum).atim.tv_sec);
+        ASSERT_EQ(in->atim.tv_nsec, on_disk(inum).atim.tv_nsec);
+
+        iput(in);
+        layer2_opts = saved;
+        unmount();
+        return report("atime rules");
+}
+
+int main(int argc, char *argv[])
+{
+        bool ok = test_itable();
+        ok = test_imap() && ok;
+        ok = test_atime() && ok;
+
+        return ok ? 0 : 1;
+}